@@ -0,0 +1,105 @@
+/*
+ Hospital Management System - allocation counts for registration and listing
+ Build: g++ -std=c++17 -O2 -pthread -o hospital_alloc "Health Management System Allocation Test.cpp"
+ Run: ./hospital_alloc [--patients N]
+      Replaces the global operator new with one that counts calls on the
+      current thread, then registers N patients (default 5000) in an
+      in-memory system and lists them a page at a time. Checks that
+      registration moves the caller's strings into the record and allocates
+      only the patient's history (plus the occasional table growth), and
+      that a listing page allocates its buffer once. Prints each check and
+      exits non-zero if any fails.
+*/
+
+#define HMS_NO_MAIN
+#include "Health Management System.cpp"
+
+// Background threads allocate on their own; only this thread's calls count
+thread_local size_t allocations = 0;
+
+void *operator new(size_t n) {
+    ++allocations;
+    if (void *p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+// Out of line, or GCC sees malloc'd memory reach a delete and warns
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+// The accessors hand out the stored strings, never copies
+static_assert(is_same_v<decltype(declval<const Patient&>().getName()), const string&>);
+static_assert(is_same_v<decltype(declval<const User&>().getUsername()), const string&>);
+
+// Swallows the listing output, so only the page itself is counted
+class NullBuf : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+size_t failures = 0;
+
+void check(bool ok, const string &what) {
+    cout << (ok ? "PASS  " : "FAIL  ") << what << "\n";
+    if (!ok) ++failures;
+}
+
+// Longer than the small-string buffer, so a copy would show up as an allocation
+string patientName(size_t i) { return "Patient Number " + to_string(i) + " Smith"; }
+
+void checkRegistration(HospitalSystem &sys, size_t n) {
+    for (size_t i = 0; i < 100; ++i) // first table chunks, metrics and interned gender
+        sys.registerPatient(patientName(i), 40, "Female", "fever and persistent cough", "2024-03-05");
+
+    size_t total = 0, single = 0, moved = 0;
+    for (size_t i = 0; i < n; ++i) {
+        string name = patientName(i), symptoms = "fever and persistent cough for three days", date = "2024-03-05";
+        const char *nameChars = name.data(), *symptomChars = symptoms.data();
+        size_t before = allocations;
+        int id = sys.registerPatient(move(name), 40, "Female", move(symptoms), move(date));
+        size_t used = allocations - before;
+        total += used;
+        if (used == 1) ++single;
+        const Patient *p = sys.findPatientById(id);
+        if (p && p->getName().data() == nameChars && p->getSymptoms().data() == symptomChars) ++moved;
+    }
+    cout << "registerPatient: " << total << " allocations for " << n << " patients\n";
+    check(moved == n, "registerPatient keeps the caller's name and symptoms buffers");
+    check(single >= n - n / 100, "registerPatient allocates only the history in 99% of calls");
+    check(total - n <= n / 100, "table growth adds under one allocation per 100 registrations");
+}
+
+void checkListing(HospitalSystem &sys) {
+    size_t pages = 0, onePerPage = 0;
+    int cursor = 0;
+    do {
+        size_t before = allocations;
+        cursor = sys.listPatientsBrief(cursor, LIST_PAGE_SIZE);
+        if (allocations - before == 1) ++onePerPage;
+        ++pages;
+    } while (cursor != 0);
+    cout << "listPatientsBrief: " << pages << " pages of " << LIST_PAGE_SIZE << "\n";
+    check(onePerPage == pages, "listPatientsBrief allocates one buffer per page");
+}
+
+int main(int argc, char **argv) {
+    size_t n = 5000;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--patients" && i + 1 < argc) {
+            n = max<size_t>(strtoul(argv[++i], nullptr, 10), 1);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--patients N]\n";
+            return 1;
+        }
+    }
+    NullBuf nullBuf;
+    ostream nullOut(&nullBuf);
+    console.out = &nullOut;
+
+    HospitalSystem sys;
+    checkRegistration(sys, n);
+    checkListing(sys);
+    if (failures) cout << failures << " check(s) failed\n";
+    return failures ? 1 : 0;
+}
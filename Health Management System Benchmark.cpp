@@ -0,0 +1,205 @@
+/*
+ Hospital Management System - benchmarks for the core operations
+ Build: g++ -std=c++17 -O2 -pthread -o hospital_bench "Health Management System Benchmark.cpp"
+ Run: ./hospital_bench [--scale N[,N...]] [--filter TEXT] [--min-time SECONDS]
+      Builds a synthetic in-memory system of N patients and N employees for
+      each scale (default 1000,100000,1000000) and times every operation for
+      at least --min-time seconds (default 0.3). --filter runs only the
+      benchmarks whose name contains TEXT. Passwords use --hash-cost 10 so
+      the login numbers show lookup overhead; see --bench-login in the main
+      program for the cost of hashing itself.
+*/
+
+#define HMS_NO_MAIN
+#include "Health Management System.cpp"
+
+// Swallows report output so the listings are timed without the terminal
+class NullBuf : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+// Keeps the compiler from dropping a result that is otherwise unused
+template <typename T>
+void keep(const T &value) { asm volatile("" : : "g"(&value) : "memory"); }
+
+// Cheap deterministic picks so every run touches the same records
+struct Rng {
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    int upTo(size_t n) { return static_cast<int>(next() % n) + 1; }
+};
+
+struct BenchOptions {
+    vector<size_t> scales{1000, 100000, 1000000};
+    string filter;
+    double minTime = 0.3;
+};
+
+class Bench {
+public:
+    explicit Bench(const BenchOptions &opts_) : opts(opts_) {
+        cout << left << setw(34) << "benchmark" << right << setw(10) << "records"
+             << setw(12) << "iterations" << setw(14) << "ns/op" << "\n";
+    }
+
+    // Runs op(i) in doubling batches until minTime has passed and prints the
+    // mean time per call
+    template <typename Op>
+    void run(const string &name, size_t records, Op &&op) {
+        if (!opts.filter.empty() && name.find(opts.filter) == string::npos) return;
+        using Clock = chrono::steady_clock;
+        size_t batch = 1, total = 0;
+        double elapsed = 0;
+        while (elapsed < opts.minTime) {
+            auto start = Clock::now();
+            for (size_t i = 0; i < batch; ++i) op(total + i);
+            elapsed += chrono::duration<double>(Clock::now() - start).count();
+            total += batch;
+            batch = min<size_t>(batch * 2, 1 << 20);
+        }
+        cout << left << setw(34) << name << right << setw(10) << records << setw(12) << total
+             << setw(14) << fixed << setprecision(1) << elapsed * 1e9 / static_cast<double>(total) << endl;
+    }
+
+private:
+    const BenchOptions &opts;
+};
+
+const char *const GENDERS[] = {"Male", "Female"};
+const char *const DRUGS[] = {"amoxicillin", "ibuprofen", "metformin", "lisinopril", "atorvastatin"};
+
+string syntheticDate(size_t i) {
+    char date[16];
+    snprintf(date, sizeof date, "2024-%02zu-%02zu", i % 12 + 1, i % 28 + 1);
+    return date;
+}
+
+void benchScale(Bench &bench, size_t n) {
+    auto started = chrono::steady_clock::now();
+    HospitalSystem sys;
+    for (size_t i = 0; i < n; ++i) {
+        int id = sys.registerPatient("Patient " + to_string(i) + " Smith", static_cast<int>(i % 90) + 1,
+                                     GENDERS[i % 2], "fever and cough", syntheticDate(i));
+        Patient &p = *sys.findPatientById(id);
+        sys.addCharge(p, "Consultation", 50.0 + static_cast<double>(i % 100));
+        if (i % 3 == 0) sys.addPayment(p, "Card", 25.0);
+        if (i % 10 == 0) sys.addPrescription(p, string(DRUGS[i % 5]) + " 500mg twice daily");
+    }
+    string credential = hashPassword("secret");
+    for (size_t i = 0; i < n; ++i) sys.addUser("user" + to_string(i), credential, Role::NURSE);
+    cout << "-- " << n << " patients and employees built in " << fixed << setprecision(2)
+         << chrono::duration<double>(chrono::steady_clock::now() - started).count() << " s" << endl;
+
+    Rng rng;
+    bench.run("findPatientById", n, [&](size_t) { keep(sys.findPatientById(rng.upTo(n))); });
+    bench.run("findPatientById/missing", n, [&](size_t) { keep(sys.findPatientById(static_cast<int>(n) * 2 + 7)); });
+    bench.run("printBasicInfo", n, [&](size_t) { keep(sys.printBasicInfo(rng.upTo(n))); });
+    bench.run("listPatientsBrief/page50", n, [&](size_t) {
+        keep(sys.listPatientsBrief(rng.upTo(n) - 1, LIST_PAGE_SIZE));
+    });
+    bench.run("listEmployees/page50", n, [&](size_t) {
+        keep(sys.listEmployees(static_cast<size_t>(rng.upTo(n)) - 1, LIST_PAGE_SIZE));
+    });
+    bench.run("authenticate", n, [&](size_t) {
+        keep(sys.authenticate("user" + to_string(rng.upTo(n) - 1), "secret"));
+    });
+    bench.run("authenticate/unknown-user", n, [&](size_t) { keep(sys.authenticate("nobody", "secret")); });
+    bench.run("HospitalSystem::addCharge", n, [&](size_t) {
+        sys.addCharge(*sys.findPatientById(rng.upTo(n)), "X-ray", 120.0);
+    });
+    bench.run("HospitalSystem::addPayment", n, [&](size_t) {
+        sys.addPayment(*sys.findPatientById(rng.upTo(n)), "Insurance", 10.0);
+    });
+
+    PatientSearchIndex::Query byName;
+    byName.name = "patient 12";
+    sys.searchPatients(byName); // builds the index outside the timing
+    bench.run("searchPatients/name-prefix", n, [&](size_t) { keep(sys.searchPatients(byName)); });
+    PatientSearchIndex::Query byDate;
+    byDate.dateFrom = "2024-03-01";
+    byDate.dateTo = "2024-03-07";
+    bench.run("searchPatients/date-range", n, [&](size_t) { keep(sys.searchPatients(byDate)); });
+    sys.searchClinicalText("metformin", ClinicalTextIndex::ALL_FIELDS);
+    bench.run("searchClinicalText/word", n, [&](size_t) {
+        keep(sys.searchClinicalText("metformin", ClinicalTextIndex::ALL_FIELDS));
+    });
+    bench.run("searchClinicalText/phrase", n, [&](size_t) {
+        keep(sys.searchClinicalText("\"500mg twice\" -ibuprofen", ClinicalTextIndex::ALL_FIELDS));
+    });
+    sys.printFinancialReport();
+    bench.run("printFinancialReport", n, [&](size_t) { sys.printFinancialReport(); });
+    CensusFilter adults;
+    adults.minAge = 18;
+    bench.run("census/adults", n, [&](size_t) { keep(sys.census(adults)); });
+
+    // Small amounts, so millions of timed calls stay under MAX_BILL_CENTS
+    Bill bill;
+    for (size_t i = 0; i < n; ++i) bill.addChargeCents("Consultation", 500, 0);
+    bench.run("Bill::addCharge", n, [&](size_t) { keep(bill.addCharge("X-ray", 0.25)); });
+    bench.run("Bill::addPayment", n, [&](size_t) { keep(bill.addPayment("Cash", 0.25)); });
+    bench.run("Bill::balance", n, [&](size_t) { keep(bill.balance()); });
+
+    // Last, since it grows the table
+    bench.run("registerPatient", n, [&](size_t i) {
+        keep(sys.registerPatient("Bench Patient", 40, "Female", "headache", syntheticDate(i)));
+    });
+}
+
+// Registration through the write-ahead log in a scratch directory, with the
+// per-record sync deferred as batch imports do
+void benchDurableRegister(Bench &bench) {
+    char dir[] = "/tmp/hms_bench_XXXXXX";
+    if (!mkdtemp(dir)) return;
+    {
+        HospitalSystem sys{string(dir)};
+        sys.setDeferredSync(true);
+        bench.run("registerPatient/durable", 0, [&](size_t i) {
+            keep(sys.registerPatient("Bench Patient", 40, "Female", "headache", syntheticDate(i)));
+        });
+        sys.setDeferredSync(false);
+    }
+    for (const char *name : {"/wal.log", "/snapshot.bin", "/wal.log.tmp", "/snapshot.bin.tmp", "/audit.log"})
+        ::unlink((string(dir) + name).c_str());
+    ::rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc) {
+            opts.scales.clear();
+            string list = argv[++i];
+            for (size_t at = 0; at < list.size();) {
+                size_t comma = min(list.find(',', at), list.size());
+                size_t v = 0;
+                from_chars(list.data() + at, list.data() + comma, v);
+                if (v > 0) opts.scales.push_back(v);
+                at = comma + 1;
+            }
+        } else if (arg == "--filter" && i + 1 < argc) {
+            opts.filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            opts.minTime = atof(argv[++i]);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--scale N[,N...]] [--filter TEXT] [--min-time SECONDS]\n";
+            return 1;
+        }
+    }
+    passwordCost().logN = 10;
+    NullBuf nullBuf;
+    ostream nullOut(&nullBuf);
+    console.out = &nullOut;
+
+    Bench bench(opts);
+    benchDurableRegister(bench);
+    for (size_t n : opts.scales) benchScale(bench, n);
+    return 0;
+}
@@ -0,0 +1,412 @@
+/*
+ Hospital Management System - synthetic data generator and load-test driver
+ Build: g++ -std=c++17 -O2 -pthread -o hospital_load "Health Management System Load Test.cpp"
+ Run: ./hospital_load generate [--data DIR] [--patients N] [--users N] [--items N] [--hash-cost LOGN]
+      ./hospital_load drive [--host ADDR] --port PORT [--patients N] [--users N] [--sessions N]
+                            [--seconds S] [--mix login=5,lookup=45,charge=25,payment=25]
+      generate fills DIR (default ./hospital_data) through the HospitalSystem
+      API: N patients (default 1000000) with about --items bill line items
+      each (default 4) plus diagnoses, notes and prescriptions, a share of
+      them discharged, and --users staff accounts of each clinical role
+      (default 100), all with password "load-test". Passwords are hashed at
+      --hash-cost (default that of the main program).
+      drive replays concurrent role sessions against a server started with
+      ./hospital --data DIR --serve PORT (give it the same --hash-cost, or
+      every first login rehashes): each of --sessions connections
+      (default 32) logs in as a generated user and picks operations by the
+      --mix weights for --seconds (default 30), switching user when an
+      operation needs another role. It prints throughput and p50/p99/p999
+      latency per operation. --patients and --users must match generate.
+*/
+
+#define HMS_NO_MAIN
+#include "Health Management System.cpp"
+
+#include <netdb.h>
+
+// Cheap deterministic picks, one stream per thread
+struct Rng {
+    uint64_t state;
+    explicit Rng(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    size_t below(size_t n) { return static_cast<size_t>(next() % n); }
+    template <typename T, size_t N>
+    const T &pick(const T (&items)[N]) { return items[below(N)]; }
+};
+
+const char *const FIRST_NAMES[] = {"James", "Mary", "Robert", "Patricia", "John", "Jennifer", "Michael", "Linda",
+                                   "David", "Elizabeth", "William", "Barbara", "Amina", "Wei", "Priya", "Carlos",
+                                   "Fatima", "Yuki", "Olga", "Kwame"};
+const char *const LAST_NAMES[] = {"Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis",
+                                  "Rodriguez", "Martinez", "Okafor", "Chen", "Patel", "Kim", "Nguyen", "Silva",
+                                  "Ivanova", "Haddad", "Mensah", "Tanaka"};
+const char *const SYMPTOMS[] = {"fever and cough", "chest pain", "shortness of breath", "abdominal pain",
+                                "headache and nausea", "fractured wrist", "lower back pain", "skin rash",
+                                "dizziness", "high blood pressure", "persistent fatigue", "sore throat"};
+const char *const DIAGNOSES[] = {"influenza", "community acquired pneumonia", "hypertension", "type 2 diabetes",
+                                 "migraine", "gastroenteritis", "distal radius fracture", "contact dermatitis",
+                                 "asthma exacerbation", "urinary tract infection"};
+const char *const NOTES[] = {"patient stable, observe overnight", "responding well to treatment",
+                             "follow up in two weeks", "referred to specialist", "vitals within normal range"};
+const char *const PRESCRIPTIONS[] = {"amoxicillin 500mg three times daily", "ibuprofen 400mg as needed",
+                                     "metformin 500mg twice daily", "lisinopril 10mg daily",
+                                     "salbutamol inhaler as needed", "paracetamol 1g four times daily"};
+const pair<const char*, int> CHARGES[] = {{"Consultation", 8000}, {"Blood test", 4500}, {"X-ray", 12000},
+                                          {"MRI scan", 65000}, {"Ward stay (per day)", 35000},
+                                          {"Emergency care", 25000}, {"Physiotherapy session", 7000}};
+const char *const PAYMENT_METHODS[] = {"Insurance", "Card", "Cash"};
+const char *const GENDERS[] = {"Female", "Male"};
+const char *const LOAD_PASSWORD = "load-test";
+
+// Generated staff are <role>-<n>, n from 1 to --users
+const pair<const char*, Role> LOAD_ROLES[] = {{"doctor", Role::DOCTOR}, {"nurse", Role::NURSE},
+                                              {"pharmacist", Role::PHARMACIST}, {"accounts", Role::ACCOUNTS}};
+
+string loadUserName(const char *role, size_t n) { return string(role) + "-" + to_string(n); }
+
+struct LoadOptions {
+    string dataDir = "hospital_data";
+    size_t patients = 1000000;
+    size_t users = 100;
+    size_t items = 4;
+    string host = "127.0.0.1";
+    int port = 0;
+    size_t sessions = 32;
+    double seconds = 30;
+    string mix = "login=5,lookup=45,charge=25,payment=25";
+};
+
+// ---------------------------------------------------------------------------
+// Generation: every record goes through the public API, so the data has the
+// shape (log, snapshot, indexes, audit trail) a production system builds up
+// ---------------------------------------------------------------------------
+
+string admissionDate(Rng &rng) {
+    char date[16];
+    snprintf(date, sizeof date, "%d-%02zu-%02zu", 2023 + static_cast<int>(rng.below(3)), rng.below(12) + 1,
+             rng.below(28) + 1);
+    return date;
+}
+
+// One patient's stay: admission, clinical entries and a bill of about
+// items lines, paid off in part or in full; one in five has gone home
+void generatePatient(HospitalSystem &sys, Rng &rng, size_t items) {
+    string name = string(rng.pick(FIRST_NAMES)) + " " + rng.pick(LAST_NAMES);
+    int age = static_cast<int>(rng.below(18) == 0 ? 1 + rng.below(17) : 18 + rng.below(72));
+    int id = sys.registerPatient(move(name), age, rng.pick(GENDERS), rng.pick(SYMPTOMS), admissionDate(rng));
+    Patient *p = sys.findPatientById(id);
+    if (!p) return;
+    sys.addDiagnosis(*p, rng.pick(DIAGNOSES));
+    if (rng.below(2) == 0) sys.addMedicalNote(*p, rng.pick(NOTES));
+    if (rng.below(3) != 0) sys.addPrescription(*p, rng.pick(PRESCRIPTIONS));
+    long long billed = 0;
+    for (size_t n = items ? 1 + rng.below(2 * items - 1) : 0; n > 0; --n) {
+        const auto &charge = rng.pick(CHARGES);
+        long long cents = charge.second / 2 + static_cast<long long>(rng.below(static_cast<size_t>(charge.second)));
+        sys.addCharge(*p, charge.first, static_cast<double>(cents) / 100.0);
+        billed += cents;
+    }
+    if (billed > 0 && rng.below(3) != 0) {
+        long long paid = rng.below(2) ? billed : billed / 2;
+        sys.addPayment(*p, rng.pick(PAYMENT_METHODS), static_cast<double>(paid) / 100.0);
+    }
+    if (rng.below(5) == 0) sys.discharge(*p);
+}
+
+int generate(const LoadOptions &opts) {
+    auto started = chrono::steady_clock::now();
+    HospitalSystem sys(opts.dataDir);
+    if (!sys.opened()) return 1;
+    sys.setDeferredSync(true);
+    // Each patient logs about ten records; a checkpoint a few times over
+    // the run instead of every 10000 keeps the snapshot rewrites linear
+    sys.setCheckpointInterval(max<size_t>(1000000, opts.patients * (opts.items + 6) / 4));
+
+    string credential = hashPassword(LOAD_PASSWORD);
+    for (const auto &role : LOAD_ROLES)
+        for (size_t n = 1; n <= opts.users; ++n) sys.addUser(loadUserName(role.first, n), credential, role.second);
+
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    atomic<size_t> next{0}, done{0};
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            Rng rng(t + 1);
+            constexpr size_t CHUNK = 256;
+            for (size_t start; (start = next.fetch_add(CHUNK)) < opts.patients;) {
+                size_t end = min(opts.patients, start + CHUNK);
+                for (size_t i = start; i < end; ++i) generatePatient(sys, rng, opts.items);
+                done.fetch_add(end - start);
+            }
+        });
+    }
+    for (size_t reported = 0; reported < opts.patients;) {
+        this_thread::sleep_for(chrono::seconds(1));
+        reported = done.load();
+        cout << "\r" << reported << " / " << opts.patients << " patients" << flush;
+    }
+    for (auto &w : workers) w.join();
+    sys.setDeferredSync(false);
+    sys.checkpoint();
+    cout << "\rGenerated " << opts.patients << " patients and " << opts.users * size(LOAD_ROLES) << " users in "
+         << fixed << setprecision(1) << chrono::duration<double>(chrono::steady_clock::now() - started).count()
+         << " s into " << opts.dataDir << "\n";
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Driving: each session is a scripted terminal. An operation sends all the
+// lines its menu asks for at once and ends when the next menu prompt
+// arrives, so its latency is what a user at that terminal would wait.
+// ---------------------------------------------------------------------------
+
+enum class Op { LOGIN, LOOKUP, CHARGE, PAYMENT, COUNT };
+const char *const OP_NAMES[] = {"login", "lookup", "charge", "payment"};
+constexpr size_t OP_COUNT = static_cast<size_t>(Op::COUNT);
+
+// "login=5,lookup=45,..." -> weights by Op; false on an unknown name
+bool parseMix(const string &mix, array<unsigned, OP_COUNT> &weights) {
+    weights.fill(0);
+    for (size_t at = 0; at < mix.size();) {
+        size_t comma = min(mix.find(',', at), mix.size());
+        string_view item = string_view(mix).substr(at, comma - at);
+        size_t eq = item.find('=');
+        unsigned w = 0;
+        if (eq == string_view::npos || !parseNumber(item.substr(eq + 1), w)) return false;
+        auto name = find(begin(OP_NAMES), end(OP_NAMES), item.substr(0, eq));
+        if (name == end(OP_NAMES)) return false;
+        weights[static_cast<size_t>(name - begin(OP_NAMES))] = w;
+        at = comma + 1;
+    }
+    return any_of(weights.begin(), weights.end(), [](unsigned w) { return w > 0; });
+}
+
+class ScriptedTerminal {
+public:
+    ~ScriptedTerminal() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool connectTo(const string &host, int port) {
+        addrinfo hints{}, *found = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (::getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found) != 0) return false;
+        fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        bool ok = fd >= 0 && ::connect(fd, found->ai_addr, found->ai_addrlen) == 0;
+        ::freeaddrinfo(found);
+        if (!ok) return false;
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        return awaitPrompt(); // the login screen
+    }
+
+    // Sends the lines and waits for the next "Choose an option: ". False if
+    // the server hung up.
+    bool exchange(const string &lines) {
+        for (size_t sent = 0; sent < lines.size();) {
+            ssize_t w = ::send(fd, lines.data() + sent, lines.size() - sent, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            sent += static_cast<size_t>(w);
+        }
+        return awaitPrompt();
+    }
+
+    // What the server printed in reply to the last exchange
+    string_view reply() const { return received; }
+
+private:
+    bool awaitPrompt() {
+        static constexpr string_view PROMPT = "Choose an option: ";
+        received.clear();
+        char buf[8192];
+        while (received.size() < PROMPT.size() ||
+               string_view(received).substr(received.size() - PROMPT.size()) != PROMPT) {
+            ssize_t r = ::recv(fd, buf, sizeof buf, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return false;
+            received.append(buf, static_cast<size_t>(r));
+        }
+        return true;
+    }
+
+    int fd = -1;
+    string received;
+};
+
+// Latencies in microseconds, per operation
+struct SessionStats {
+    array<vector<uint32_t>, OP_COUNT> latencies;
+    size_t failures = 0;
+};
+
+// The menu lines for one operation as the given role, or empty when that
+// role cannot do it (the session then logs in as one that can)
+string scriptFor(Op op, Role role, int patient, Rng &rng) {
+    string id = to_string(patient);
+    switch (op) {
+        case Op::LOOKUP:
+            if (role == Role::DOCTOR) return "2\n" + id + "\n";
+            if (role == Role::PHARMACIST || role == Role::ACCOUNTS) return "1\n" + id + "\n";
+            return {};
+        case Op::CHARGE:
+            if (role != Role::DOCTOR) return {};
+            return "6\n" + id + "\n" + rng.pick(CHARGES).first + "\n" + to_string(20 + rng.below(200)) + ".00\n";
+        case Op::PAYMENT:
+            if (role != Role::ACCOUNTS) return {};
+            return "2\n" + id + "\n" + rng.pick(PAYMENT_METHODS) + "\n" + to_string(5 + rng.below(50)) + ".00\n";
+        default:
+            return {};
+    }
+}
+
+Role roleFor(Op op, Rng &rng) {
+    switch (op) {
+        case Op::CHARGE: return Role::DOCTOR;
+        case Op::PAYMENT: return Role::ACCOUNTS;
+        case Op::LOOKUP: return rng.below(2) ? Role::DOCTOR : Role::ACCOUNTS;
+        default: return LOAD_ROLES[rng.below(size(LOAD_ROLES))].second;
+    }
+}
+
+string logoutLine(Role role) {
+    switch (role) {
+        case Role::DOCTOR: return "11\n";
+        case Role::NURSE: return "5\n";
+        case Role::PHARMACIST: return "7\n";
+        case Role::ACCOUNTS: return "6\n";
+        default: return "7\n";
+    }
+}
+
+void runSession(const LoadOptions &opts, const array<unsigned, OP_COUNT> &weights, unsigned seed,
+                chrono::steady_clock::time_point until, SessionStats &stats) {
+    using Clock = chrono::steady_clock;
+    Rng rng(seed);
+    unsigned total = 0;
+    for (unsigned w : weights) total += w;
+    ScriptedTerminal term;
+    if (!term.connectTo(opts.host, opts.port)) {
+        ++stats.failures;
+        return;
+    }
+    optional<Role> current;
+    auto timed = [&](Op op, const string &lines) {
+        auto start = Clock::now();
+        bool ok = term.exchange(lines);
+        auto us = chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count();
+        if (ok) stats.latencies[static_cast<size_t>(op)].push_back(static_cast<uint32_t>(min<int64_t>(us, UINT32_MAX)));
+        else ++stats.failures;
+        return ok;
+    };
+    auto login = [&](Role role) {
+        if (current && !term.exchange(logoutLine(*current))) return false;
+        current.reset();
+        const char *name = "doctor";
+        for (const auto &r : LOAD_ROLES)
+            if (r.second == role) name = r.first;
+        string user = loadUserName(name, 1 + rng.below(opts.users));
+        if (!timed(Op::LOGIN, "1\n" + user + "\n" + LOAD_PASSWORD + "\n")) return false;
+        if (term.reply().find("Login successful") == string_view::npos) {
+            ++stats.failures;
+            return true; // still at the login screen
+        }
+        current = role;
+        return true;
+    };
+    while (Clock::now() < until) {
+        unsigned roll = static_cast<unsigned>(rng.below(total));
+        size_t pick = 0;
+        while (roll >= weights[pick]) roll -= weights[pick++];
+        Op op = static_cast<Op>(pick);
+        if (op == Op::LOGIN) {
+            if (!login(roleFor(op, rng))) return;
+            continue;
+        }
+        int patient = 1 + static_cast<int>(rng.below(opts.patients));
+        string script = current ? scriptFor(op, *current, patient, rng) : string();
+        if (script.empty()) {
+            if (!login(roleFor(op, rng))) return;
+            if (!current) continue;
+            script = scriptFor(op, *current, patient, rng);
+        }
+        if (!timed(op, script)) return;
+    }
+    if (current) term.exchange(logoutLine(*current));
+}
+
+double percentileMs(const vector<uint32_t> &sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t at = min(sorted.size() - 1, static_cast<size_t>(q * static_cast<double>(sorted.size())));
+    return sorted[at] / 1000.0;
+}
+
+int drive(const LoadOptions &opts) {
+    array<unsigned, OP_COUNT> weights;
+    if (!parseMix(opts.mix, weights)) {
+        cerr << "Bad --mix '" << opts.mix << "'; use NAME=WEIGHT pairs of login, lookup, charge, payment\n";
+        return 1;
+    }
+    vector<SessionStats> stats(opts.sessions);
+    auto started = chrono::steady_clock::now();
+    auto until = started + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(opts.seconds));
+    vector<thread> sessions;
+    for (size_t i = 0; i < opts.sessions; ++i)
+        sessions.emplace_back([&, i] { runSession(opts, weights, static_cast<unsigned>(i + 1), until, stats[i]); });
+    for (auto &s : sessions) s.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    size_t failures = 0, all = 0;
+    cout << left << setw(10) << "operation" << right << setw(12) << "count" << setw(12) << "ops/s" << setw(10)
+         << "p50 ms" << setw(10) << "p99 ms" << setw(10) << "p999 ms" << setw(10) << "max ms" << "\n";
+    for (size_t op = 0; op < OP_COUNT; ++op) {
+        vector<uint32_t> merged;
+        for (auto &s : stats) merged.insert(merged.end(), s.latencies[op].begin(), s.latencies[op].end());
+        if (merged.empty()) continue;
+        sort(merged.begin(), merged.end());
+        all += merged.size();
+        cout << left << setw(10) << OP_NAMES[op] << right << setw(12) << merged.size() << fixed << setprecision(1)
+             << setw(12) << static_cast<double>(merged.size()) / elapsed << setprecision(2) << setw(10)
+             << percentileMs(merged, 0.5) << setw(10) << percentileMs(merged, 0.99) << setw(10)
+             << percentileMs(merged, 0.999) << setw(10) << merged.back() / 1000.0 << "\n";
+    }
+    for (auto &s : stats) failures += s.failures;
+    cout << all << " operations from " << opts.sessions << " sessions in " << fixed << setprecision(1) << elapsed
+         << " s: " << static_cast<double>(all) / elapsed << " ops/s, " << failures << " failed\n";
+    return failures ? 2 : 0;
+}
+
+int main(int argc, char **argv) {
+    LoadOptions opts;
+    string mode = argc > 1 ? argv[1] : "";
+    bool ok = mode == "generate" || mode == "drive";
+    for (int i = 2; ok && i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--data" && hasValue) opts.dataDir = argv[++i];
+        else if (arg == "--patients" && hasValue) ok = parseNumber(argv[++i], opts.patients) && opts.patients > 0;
+        else if (arg == "--users" && hasValue) ok = parseNumber(argv[++i], opts.users) && opts.users > 0;
+        else if (arg == "--items" && hasValue) ok = parseNumber(argv[++i], opts.items);
+        else if (arg == "--hash-cost" && hasValue) passwordCost().logN = atoi(argv[++i]);
+        else if (arg == "--host" && hasValue) opts.host = argv[++i];
+        else if (arg == "--port" && hasValue) opts.port = atoi(argv[++i]);
+        else if (arg == "--sessions" && hasValue) ok = parseNumber(argv[++i], opts.sessions) && opts.sessions > 0;
+        else if (arg == "--seconds" && hasValue) ok = parseNumber(argv[++i], opts.seconds) && opts.seconds > 0;
+        else if (arg == "--mix" && hasValue) opts.mix = argv[++i];
+        else ok = false;
+    }
+    if (!ok || (mode == "drive" && opts.port <= 0) || passwordCost().logN < 10 || passwordCost().logN > 20) {
+        cerr << "Usage: " << argv[0] << " generate [--data DIR] [--patients N] [--users N] [--items N] [--hash-cost LOGN]\n"
+             << "       " << argv[0] << " drive [--host ADDR] --port PORT [--patients N] [--users N] [--sessions N]"
+             << " [--seconds S] [--mix login=W,lookup=W,charge=W,payment=W]\n";
+        return 1;
+    }
+    ios::sync_with_stdio(false);
+    return mode == "generate" ? generate(opts) : drive(opts);
+}
@@ -1,63 +1,357 @@
 /*
  Hospital Management System - Single File
  Corrected: public inheritance, ordering, and using namespace std
- Build: g++ -std=c++17 -O2 -o hospital HospitalManagement.cpp
- Run: ./hospital
+ Build: g++ -std=c++17 -O2 -pthread -o hospital "Health Management System.cpp"
+        (benchmarks: see "Health Management System Benchmark.cpp"; synthetic
+        data and server load tests: "Health Management System Load Test.cpp";
+        allocation checks: "Health Management System Allocation Test.cpp")
+ Run: ./hospital [--data DIR | --in-memory] [--hash-cost LOGN]
+                 [--serve PORT [--bind ADDR] [--workers N] [--idle-timeout S] | --batch FILE |
+                  --census | --export FILE | --bench-login] [--metrics-out FILE] [--history-budget MB]
+                 [--facilities N[,N...]] [--replica-of DIR [--replica-poll MS] [--max-lag MS]]
+      State is kept in DIR (default ./hospital_data) as snapshot.bin + wal.log
+      with an append-only audit trail of every change in audit.log (see AuditLog)
+      --history-budget caps the memory for loaded patient histories (default
+      256); unchanged ones beyond it are re-read from the snapshot when needed
+      --serve accepts concurrent terminal sessions over TCP (e.g. nc HOST PORT);
+      a session with no input for --idle-timeout seconds (default 300, 0 for
+      none) is logged out so it does not hold one of the --workers threads
+      --batch applies a tab-separated command file ("-" for stdin), see BatchRunner
+      --census prints the full-history census report (for nightly jobs) and exits
+      --export writes patients and bill items to a columnar file, see ColumnarExporter
+      --hash-cost sets the scrypt cost for new password hashes (default 14, 16 MiB);
+      --bench-login prints login throughput at each cost to choose it
+      --metrics-out writes the operation metrics dump to FILE on exit (see
+      writeMetricsDump); admins can also view them from the Admin menu
+      --facilities runs one system per facility (data in DIR/facility-N, own
+      staff), patients routed by ID and reports covering all (see FacilityRouter)
+      --replica-of serves read-only sessions and reports from a primary's DIR,
+      applying its log every --replica-poll ms (default 50) and reporting the
+      lag, flagged beyond --max-lag ms (default 1000)
 */
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <deque>
+#include <string_view>
+#include <cstdint>
+#include <ctime>
+#include <unordered_map>
 #include <algorithm>
 #include <iomanip>
 #include <limits>
+#include <cmath>
+#include <type_traits>
+#include <new>
+#include <array>
+#include <charconv>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <random>
+#include <variant>
+#include <optional>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 using namespace std;
 
-// Forward declaration
+// Forward declarations
 class HospitalSystem;
+class User;
 
-// Utility input helpers
+// Buffered line input over a file descriptor (the terminal or a session
+// socket). Input is read in large chunks into one reused buffer and each line
+// is handed out as a view into it, so the menus parse without per-line copies
+// or iostream overhead. Pending output is flushed before every blocking read,
+// so prompts reach the terminal first.
+class InputReader {
+public:
+    explicit InputReader(int fd_) : fd(fd_), buf(64 * 1024) {}
+
+    // Next line without its "\n" (or "\r\n"); the view is valid until the next
+    // call. A last line with no newline is still returned. False at the end.
+    bool line(string_view &text) {
+        while (true) {
+            const char *start = buf.data() + head;
+            const void *nl = memchr(buf.data() + scanned, '\n', tail - scanned);
+            if (nl || (eof && head < tail)) {
+                size_t len = nl ? static_cast<size_t>(static_cast<const char*>(nl) - start) : tail - head;
+                head += nl ? len + 1 : len;
+                scanned = head;
+                if (len > 0 && start[len - 1] == '\r') --len;
+                text = string_view(start, len);
+                return true;
+            }
+            if (eof) return false;
+            scanned = tail;
+            fill();
+        }
+    }
+
+    // The input ended because nothing arrived within the descriptor's receive timeout
+    bool timedOut() const { return timedOut_; }
+
+private:
+    void fill() {
+        if (head > 0) { // keep the partial line at the front
+            memmove(buf.data(), buf.data() + head, tail - head);
+            tail -= head;
+            scanned -= head;
+            head = 0;
+        }
+        if (tail == buf.size()) buf.resize(buf.size() * 2); // one line longer than the buffer
+        out().flush();
+        ssize_t n;
+        do n = ::read(fd, buf.data() + tail, buf.size() - tail); while (n < 0 && errno == EINTR);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) timedOut_ = true; // receive timeout (SO_RCVTIMEO)
+        if (n <= 0) eof = true;
+        else tail += static_cast<size_t>(n);
+    }
+
+    static ostream &out();
+
+    int fd;
+    vector<char> buf;
+    size_t head = 0, tail = 0; // unread bytes are buf[head, tail)
+    size_t scanned = 0;        // buf[head, scanned) holds no newline
+    bool eof = false;
+    bool timedOut_ = false;
+};
+
+InputReader &stdinReader() {
+    static InputReader reader(STDIN_FILENO);
+    return reader;
+}
+
+// Per-session console. The interactive program talks to stdin/cout; each server
+// session points its thread at the input and output of its own connection.
+struct Console {
+    InputReader *in = &stdinReader();
+    ostream *out = &cout;
+    const User *user = nullptr; // logged-in user, recorded in the audit log
+};
+thread_local Console console;
+
+InputReader &in() { return *console.in; }
+ostream &out() { return *console.out; }
+ostream &InputReader::out() { return ::out(); }
+
+// Thrown by the input helpers when the session's input ends (EOF or hang-up),
+// so menus unwind instead of re-prompting forever
+struct InputClosed {};
+
+// Thrown by HospitalSystem's mutations on a read-only replica, before
+// anything is locked or changed; the role menus catch it and carry on
+struct ReadOnlyReplica {};
+
+// Thrown by HospitalSystem's mutations once the write-ahead log cannot be
+// written, before the change is applied; caught like ReadOnlyReplica
+struct StorageFailed {};
+
+// Money helpers: amounts are kept as integer cents so totals stay exact.
+// One amount is at most MAX_AMOUNT_CENTS, and a bill's charges and its
+// payments each add up to at most MAX_BILL_CENTS (see Bill), so sums over
+// every bill a patient ID can have still fit in a long long.
+constexpr long long MAX_AMOUNT_CENTS = 1000000000; // $10,000,000.00
+constexpr long long MAX_BILL_CENTS = 4000000000;   // $40,000,000.00
+static_assert(MAX_BILL_CENTS <= numeric_limits<long long>::max() / numeric_limits<int>::max(),
+              "hospital-wide billing totals could overflow");
+
+// Whole cents, or 0 unless amount is positive, at most MAX_AMOUNT_CENTS and
+// at least half a cent
+long long toCents(double amount) {
+    if (!(amount > 0.0) || amount > static_cast<double>(MAX_AMOUNT_CENTS) / 100.0) return 0;
+    return llround(amount * 100.0);
+}
+
+string formatCents(long long cents) {
+    string sign = cents < 0 ? "-" : "";
+    long long mag = cents < 0 ? -cents : cents;
+    string frac = to_string(mag % 100);
+    if (frac.size() < 2) frac = "0" + frac;
+    return sign + to_string(mag / 100) + "." + frac;
+}
+
+// Utility input helpers. They share the session's InputReader and parse with
+// from_chars straight from its buffer.
+
+// Next line (after printing the prompt); valid until the next read
+string_view readLineView(string_view prompt = {}) {
+    if (!prompt.empty()) out() << prompt;
+    string_view s;
+    if (!in().line(s)) throw InputClosed{};
+    return s;
+}
+
+string_view trimSpaces(string_view s) {
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.front()))) s.remove_prefix(1);
+    while (!s.empty() && isspace(static_cast<unsigned char>(s.back()))) s.remove_suffix(1);
+    return s;
+}
+
+// Parses the whole of s (surrounding spaces allowed) as a number
+template <typename T>
+bool parseNumber(string_view s, T &value) {
+    s = trimSpaces(s);
+    auto res = from_chars(s.data(), s.data() + s.size(), value);
+    return !s.empty() && res.ec == errc() && res.ptr == s.data() + s.size();
+}
+
+// Blank lines are skipped, as they were with cin >> x
 int readIntInRange(int minV, int maxV) {
-    int x;
     while (true) {
-        if (!(cin >> x)) {
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Invalid input. Enter a number: ";
+        string_view s = readLineView();
+        if (trimSpaces(s).empty()) continue;
+        int x;
+        if (!parseNumber(s, x)) {
+            out() << "Invalid input. Enter a number: ";
             continue;
         }
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
         if (x < minV || x > maxV) {
-            cout << "Enter a number between " << minV << " and " << maxV << ": ";
+            out() << "Enter a number between " << minV << " and " << maxV << ": ";
             continue;
         }
         return x;
     }
 }
 
-string readNonEmptyLine(const string &prompt = "") {
-    string s;
+// Prompts until an amount of money (e.g. 12.50) from $0.01 up to
+// MAX_AMOUNT_CENTS is entered
+double readAmount(string_view prompt) {
+    while (true) {
+        string_view s = readLineView(prompt);
+        double amount;
+        if (parseNumber(s, amount) && toCents(amount) > 0) return amount;
+        out() << "Invalid amount (from $0.01 to $" << formatCents(MAX_AMOUNT_CENTS) << ").\n";
+    }
+}
+
+string readNonEmptyLine(string_view prompt = {}) {
     while (true) {
-        if (!prompt.empty()) cout << prompt;
-        getline(cin, s);
+        string_view s = readLineView(prompt);
         if (s.empty()) {
-            cout << "Input cannot be empty. Try again.\n";
+            out() << "Input cannot be empty. Try again.\n";
             continue;
         }
-        return s;
+        return string(s);
     }
 }
 
-string readLineAllowEmpty(const string &prompt = "") {
-    string s;
-    if (!prompt.empty()) cout << prompt;
-    getline(cin, s);
-    return s;
+string readLineAllowEmpty(string_view prompt = {}) {
+    return string(readLineView(prompt));
 }
 
+// Chunked, pointer-stable container. Elements live in fixed-size chunks and are
+// never moved once constructed, so growing the container does not relocate
+// existing records or invalidate pointers/references handed out earlier.
+// Appends must be serialized by the caller, but reading any index below size()
+// is safe from other threads without a lock: chunk directories are published
+// with release stores and superseded directories are kept until destruction.
+template <typename T, size_t ChunkSize = 1024>
+class StableVector {
+    struct Chunk { alignas(T) unsigned char bytes[sizeof(T) * ChunkSize]; };
+
+public:
+    template <bool IsConst>
+    class Iter {
+    public:
+        using Owner = conditional_t<IsConst, const StableVector, StableVector>;
+        using reference = conditional_t<IsConst, const T&, T&>;
+        Iter(Owner *o, size_t i) : owner(o), idx(i) {}
+        reference operator*() const { return (*owner)[idx]; }
+        auto operator->() const { return &(*owner)[idx]; }
+        Iter &operator++() { ++idx; return *this; }
+        bool operator!=(const Iter &o) const { return idx != o.idx; }
+        bool operator==(const Iter &o) const { return idx == o.idx; }
+    private:
+        Owner *owner;
+        size_t idx;
+    };
+
+    StableVector() = default;
+    StableVector(const StableVector&) = delete;
+    StableVector &operator=(const StableVector&) = delete;
+    ~StableVector() { clear(); }
+
+    template <typename... Args>
+    T &emplace_back(Args&&... args) {
+        size_t n = count.load(memory_order_relaxed);
+        size_t c = n / ChunkSize;
+        if (n % ChunkSize == 0) {
+            if (c == capacity) growDirectory();
+            chunks.emplace_back(new Chunk); // storage only, no zero-fill
+            directories.back()[c] = chunks.back().get();
+        }
+        T *slot = reinterpret_cast<T*>(directories.back()[c]->bytes) + n % ChunkSize;
+        new (slot) T(forward<Args>(args)...);
+        count.store(n + 1, memory_order_release);
+        return *slot;
+    }
+
+    T &operator[](size_t i) { return *slotAt(i); }
+    const T &operator[](size_t i) const { return *slotAt(i); }
+
+    size_t size() const { return count.load(memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+
+    // Not safe against concurrent readers; only for teardown/reset
+    void clear() {
+        for (size_t i = 0, n = size(); i < n; ++i) slotAt(i)->~T();
+        count.store(0, memory_order_relaxed);
+        dir.store(nullptr, memory_order_relaxed);
+        directories.clear();
+        chunks.clear();
+        capacity = 0;
+    }
+
+    Iter<false> begin() { return {this, 0}; }
+    Iter<false> end() { return {this, size()}; }
+    Iter<true> begin() const { return {this, 0}; }
+    Iter<true> end() const { return {this, size()}; }
+
+private:
+    T *slotAt(size_t i) const {
+        Chunk *const *d = dir.load(memory_order_acquire);
+        return reinterpret_cast<T*>(d[i / ChunkSize]->bytes) + i % ChunkSize;
+    }
+
+    void growDirectory() {
+        size_t next = capacity ? capacity * 2 : 16;
+        unique_ptr<Chunk*[]> d(new Chunk*[next]());
+        for (size_t i = 0; i < capacity; ++i) d[i] = directories.back()[i];
+        directories.push_back(move(d));
+        capacity = next;
+        dir.store(directories.back().get(), memory_order_release);
+    }
+
+    atomic<Chunk**> dir{nullptr};
+    atomic<size_t> count{0};
+    size_t capacity = 0;                       // chunk slots in the current directory
+    vector<unique_ptr<Chunk*[]>> directories;  // every directory ever published
+    vector<unique_ptr<Chunk>> chunks;
+};
+
 // Role enumeration
 enum class Role { ADMIN, DOCTOR, NURSE, PHARMACIST, ACCOUNTS };
 
@@ -72,71 +366,431 @@ string roleToString(Role r) {
     }
 }
 
+// ---------------------------------------------------------------------------
+// Operation metrics: call counts and latency histograms for the hot paths and
+// for every role menu action. Each thread records into its own buffer, so a
+// probe costs two clock reads and a few uncontended stores; reports merge the
+// buffers. Calls are always counted, but the sub-microsecond operations are
+// timed on a sample of calls (see SAMPLE_SHIFT) so the clock reads do not
+// dominate them. Build with -DHMS_METRICS=0 to compile the probes out entirely.
+// ---------------------------------------------------------------------------
+#ifndef HMS_METRICS
+#define HMS_METRICS 1
+#endif
+
+enum class Metric { AUTHENTICATE, FIND_PATIENT, REGISTER_PATIENT, ADD_CHARGE, ADD_PAYMENT, COUNT };
+enum class Counter {
+    LOGIN_FAILURES, SNAPSHOT_LOADS, HISTORY_LOADS, HISTORY_EVICTIONS, LOG_RECORDS, LOG_BYTES, AUDIT_EVENTS,
+    AUDIT_SYNCS, REPLICATED_RECORDS, COUNT
+};
+
+#if HMS_METRICS
+constexpr size_t MENU_OPTIONS = 11;  // the longest role menu
+constexpr size_t ROLE_COUNT = 5;
+constexpr size_t TIMED_SLOTS = static_cast<size_t>(Metric::COUNT) + ROLE_COUNT * MENU_OPTIONS;
+
+const char *const METRIC_NAMES[] = {"authenticate", "findPatientById", "registerPatient", "addCharge", "addPayment"};
+const char *const COUNTER_NAMES[] = {"login_failures", "snapshot_loads", "history_loads", "history_evictions",
+                                     "log_records", "log_bytes", "audit_events", "audit_syncs",
+                                     "replicated_records"};
+const char *const MENU_NAMES[] = {"admin", "doctor", "nurse", "pharmacist", "accounts"};
+// Operation i is timed on one call in 2^SAMPLE_SHIFT[i]; menu actions on every call
+const int SAMPLE_SHIFT[] = {0, 6, 3, 3, 3};
+
+string slotName(size_t slot) {
+    if (slot < static_cast<size_t>(Metric::COUNT)) return METRIC_NAMES[slot];
+    slot -= static_cast<size_t>(Metric::COUNT);
+    return string("menu.") + MENU_NAMES[slot / MENU_OPTIONS] + "." + to_string(slot % MENU_OPTIONS + 1);
+}
+
+// Log-linear buckets (HDR style): 8 per power of two, so a bucket's bounds
+// are within 12.5% of any value in it. Values are nanoseconds, capped at 2^40.
+struct LatencyBuckets {
+    static constexpr int SUB_BITS = 3;
+    static constexpr int MAX_EXP = 40;
+    static constexpr size_t SIZE = static_cast<size_t>(MAX_EXP - SUB_BITS + 1) << SUB_BITS;
+
+    static size_t index(uint64_t ns) {
+        if (ns >= (uint64_t(1) << MAX_EXP)) ns = (uint64_t(1) << MAX_EXP) - 1;
+        if (ns < (uint64_t(1) << SUB_BITS)) return static_cast<size_t>(ns);
+        int exp = 63 - __builtin_clzll(ns);
+        uint64_t sub = (ns >> (exp - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+        return (static_cast<size_t>(exp - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+    // Largest value that falls in bucket i
+    static uint64_t upperBound(size_t i) {
+        if (i < (size_t(1) << SUB_BITS)) return i;
+        size_t group = i >> SUB_BITS, sub = i & ((1u << SUB_BITS) - 1);
+        return (((uint64_t(1) << SUB_BITS) + sub + 1) << (group - 1)) - 1;
+    }
+};
+
+// One thread's buffer. Only the owning thread writes, so plain load+store
+// on relaxed atomics is enough and readers never see torn values.
+struct ThreadMetrics {
+    struct Timed {
+        atomic<uint64_t> calls{0}, samples{0}, sumNs{0}, maxNs{0};
+        array<atomic<uint64_t>, LatencyBuckets::SIZE> buckets{};
+    };
+    array<Timed, TIMED_SLOTS> timed;
+    array<atomic<uint64_t>, static_cast<size_t>(Counter::COUNT)> counters{};
+
+    static void bump(atomic<uint64_t> &v, uint64_t n) { v.store(v.load(memory_order_relaxed) + n, memory_order_relaxed); }
+
+    // Counts a call; true if this one should be timed
+    bool call(size_t slot) {
+        uint64_t n = timed[slot].calls.load(memory_order_relaxed);
+        timed[slot].calls.store(n + 1, memory_order_relaxed);
+        int shift = slot < static_cast<size_t>(Metric::COUNT) ? SAMPLE_SHIFT[slot] : 0;
+        return (n & ((uint64_t(1) << shift) - 1)) == 0;
+    }
+
+    void record(size_t slot, uint64_t ns) {
+        Timed &t = timed[slot];
+        bump(t.samples, 1);
+        bump(t.sumNs, ns);
+        if (ns > t.maxNs.load(memory_order_relaxed)) t.maxNs.store(ns, memory_order_relaxed);
+        bump(t.buckets[LatencyBuckets::index(ns)], 1);
+    }
+};
+
+// Merged view of every thread's buffer
+struct MetricsSnapshot {
+    struct Timed {
+        uint64_t calls = 0, samples = 0, sumNs = 0, maxNs = 0;
+        vector<uint64_t> buckets = vector<uint64_t>(LatencyBuckets::SIZE);
+
+        uint64_t meanNs() const { return samples ? sumNs / samples : 0; }
+
+        // Upper bound of the bucket holding the q-th quantile of the samples
+        uint64_t quantile(double q) const {
+            uint64_t rank = static_cast<uint64_t>(ceil(q * static_cast<double>(samples)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets.size(); ++i) {
+                seen += buckets[i];
+                if (seen >= max<uint64_t>(rank, 1)) return min(LatencyBuckets::upperBound(i), maxNs);
+            }
+            return maxNs;
+        }
+    };
+    vector<Timed> timed = vector<Timed>(TIMED_SLOTS);
+    array<uint64_t, static_cast<size_t>(Counter::COUNT)> counters{};
+};
+
+// Buffers are handed out on a thread's first probe and returned to a free
+// list when it exits; their totals are kept, so nothing recorded is lost and
+// short-lived threads do not grow the registry.
+class MetricsRegistry {
+public:
+    ThreadMetrics &local() {
+        if (!current) {
+            thread_local Lease lease(*this);
+            current = lease.buffer;
+        }
+        return *current;
+    }
+
+    MetricsSnapshot collect() const {
+        MetricsSnapshot s;
+        lock_guard<mutex> lock(mtx);
+        for (const auto &b : buffers) {
+            for (size_t i = 0; i < TIMED_SLOTS; ++i) {
+                const ThreadMetrics::Timed &from = b->timed[i];
+                MetricsSnapshot::Timed &to = s.timed[i];
+                uint64_t n = from.calls.load(memory_order_relaxed);
+                if (n == 0) continue;
+                to.calls += n;
+                to.samples += from.samples.load(memory_order_relaxed);
+                to.sumNs += from.sumNs.load(memory_order_relaxed);
+                to.maxNs = max(to.maxNs, from.maxNs.load(memory_order_relaxed));
+                for (size_t k = 0; k < LatencyBuckets::SIZE; ++k) to.buckets[k] += from.buckets[k].load(memory_order_relaxed);
+            }
+            for (size_t i = 0; i < s.counters.size(); ++i) s.counters[i] += b->counters[i].load(memory_order_relaxed);
+        }
+        return s;
+    }
+
+private:
+    struct Lease {
+        MetricsRegistry &owner;
+        ThreadMetrics *buffer;
+        explicit Lease(MetricsRegistry &r) : owner(r), buffer(r.acquire()) {}
+        ~Lease() {
+            current = nullptr;
+            owner.release(buffer);
+        }
+    };
+    // Plain pointer so the probes skip the lease's initialization guard
+    static thread_local ThreadMetrics *current;
+
+    ThreadMetrics *acquire() {
+        lock_guard<mutex> lock(mtx);
+        if (!idle.empty()) {
+            ThreadMetrics *b = idle.back();
+            idle.pop_back();
+            return b;
+        }
+        buffers.push_back(make_unique<ThreadMetrics>());
+        return buffers.back().get();
+    }
+    void release(ThreadMetrics *b) {
+        lock_guard<mutex> lock(mtx);
+        idle.push_back(b);
+    }
+
+    mutable mutex mtx;
+    vector<unique_ptr<ThreadMetrics>> buffers;
+    vector<ThreadMetrics*> idle;
+};
+
+thread_local ThreadMetrics *MetricsRegistry::current = nullptr;
+
+MetricsRegistry &metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Counts a call and, if it is sampled, records the time from construction
+// to destruction
+class MetricTimer {
+public:
+    explicit MetricTimer(size_t slot_) : buffer(metrics().local()), slot(slot_), timing(buffer.call(slot)) {
+        if (timing) start = chrono::steady_clock::now();
+    }
+    ~MetricTimer() {
+        if (!timing) return;
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        buffer.record(slot, static_cast<uint64_t>(ns));
+    }
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer &operator=(const MetricTimer&) = delete;
+private:
+    ThreadMetrics &buffer;
+    size_t slot;
+    bool timing;
+    chrono::steady_clock::time_point start;
+};
+
+inline size_t menuSlot(Role role, int option) {
+    size_t opt = static_cast<size_t>(option > 0 ? option - 1 : 0);
+    return static_cast<size_t>(Metric::COUNT) + static_cast<size_t>(role) * MENU_OPTIONS + min(opt, MENU_OPTIONS - 1);
+}
+
+#define HMS_METRIC_CAT_(a, b) a##b
+#define HMS_METRIC_CAT(a, b) HMS_METRIC_CAT_(a, b)
+// Times the rest of the enclosing scope
+#define HMS_TIME(metric) MetricTimer HMS_METRIC_CAT(metricTimer_, __LINE__)(static_cast<size_t>(metric))
+// Times one role menu action: the rest of the loop iteration after the choice
+#define HMS_TIME_MENU(role, option) MetricTimer HMS_METRIC_CAT(metricTimer_, __LINE__)(menuSlot(role, option))
+#define HMS_COUNT(counter, n) ThreadMetrics::bump(metrics().local().counters[static_cast<size_t>(counter)], (n))
+
+// Tab-separated dump, one line per counter and per timed operation that has
+// been called. sum_ns and the percentiles cover the timed samples. Histogram lines end with the non-empty buckets as
+// "upper_ns:count" pairs so percentiles can be recomputed or merged elsewhere.
+void writeMetricsDump(ostream &os) {
+    MetricsSnapshot s = metrics().collect();
+    os << "# hms-metrics 1\n";
+    for (size_t i = 0; i < s.counters.size(); ++i) os << "counter\t" << COUNTER_NAMES[i] << '\t' << s.counters[i] << '\n';
+    os << "# histogram name calls samples sum_ns max_ns p50_ns p90_ns p99_ns p999_ns buckets\n";
+    for (size_t i = 0; i < TIMED_SLOTS; ++i) {
+        const MetricsSnapshot::Timed &t = s.timed[i];
+        if (t.calls == 0) continue;
+        os << "histogram\t" << slotName(i) << '\t' << t.calls << '\t' << t.samples << '\t' << t.sumNs << '\t' << t.maxNs << '\t'
+           << t.quantile(0.5) << '\t' << t.quantile(0.9) << '\t' << t.quantile(0.99) << '\t' << t.quantile(0.999) << '\t';
+        bool first = true;
+        for (size_t k = 0; k < t.buckets.size(); ++k) {
+            if (t.buckets[k] == 0) continue;
+            os << (first ? "" : ",") << LatencyBuckets::upperBound(k) << ':' << t.buckets[k];
+            first = false;
+        }
+        os << '\n';
+    }
+}
+
+void printMetricsReport() {
+    MetricsSnapshot s = metrics().collect();
+    auto us = [](uint64_t ns) {
+        ostringstream o;
+        o << fixed << setprecision(1) << static_cast<double>(ns) / 1000.0;
+        return o.str();
+    };
+    ostringstream report;
+    report << "---- Operation Metrics (microseconds) ----\n";
+    report << left << setw(22) << "operation" << right << setw(10) << "calls" << setw(11) << "mean"
+           << setw(11) << "p50" << setw(11) << "p99" << setw(11) << "p99.9" << setw(12) << "max" << "\n";
+    for (size_t i = 0; i < TIMED_SLOTS; ++i) {
+        const MetricsSnapshot::Timed &t = s.timed[i];
+        if (t.calls == 0) continue;
+        report << left << setw(22) << slotName(i) << right << setw(10) << t.calls << setw(11) << us(t.meanNs())
+               << setw(11) << us(t.quantile(0.5)) << setw(11) << us(t.quantile(0.99))
+               << setw(11) << us(t.quantile(0.999)) << setw(12) << us(t.maxNs) << "\n";
+    }
+    for (size_t i = 0; i < s.counters.size(); ++i)
+        report << left << setw(22) << COUNTER_NAMES[i] << right << setw(10) << s.counters[i] << "\n";
+    report << "Menu actions include the time spent at their prompts.\n";
+    out() << report.str();
+}
+#else
+#define HMS_TIME(metric) ((void)0)
+#define HMS_TIME_MENU(role, option) ((void)0)
+#define HMS_COUNT(counter, n) ((void)0)
+
+void writeMetricsDump(ostream &os) { os << "# hms-metrics 1 disabled\n"; }
+void printMetricsReport() { out() << "Metrics are not compiled into this build (HMS_METRICS=0).\n"; }
+#endif // HMS_METRICS
+
+// Interned text for bill line items. Descriptions and payment methods repeat a
+// lot ("Consultation", "Cash", ...), so each distinct string is stored once and
+// line items refer to it by id.
+// Safe to share between sessions: interning takes a lock, lookups do not.
+class StringTable {
+public:
+    StringTable(initializer_list<const char*> seed = {}) {
+        for (const char *s : seed) intern(s);
+    }
+
+    // No allocation when s is already interned
+    uint32_t intern(string_view s) {
+        lock_guard<mutex> lock(mtx);
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(names.size());
+        ids.emplace(names.emplace_back(s), id); // key views the stored string, which never moves
+        return id;
+    }
+
+    static constexpr uint32_t NONE = numeric_limits<uint32_t>::max();
+
+    // NONE if s has not been interned
+    uint32_t find(string_view s) const {
+        lock_guard<mutex> lock(mtx);
+        auto it = ids.find(s);
+        return it == ids.end() ? NONE : it->second;
+    }
+
+    const string &lookup(uint32_t id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+private:
+    StableVector<string, 256> names;
+    unordered_map<string_view, uint32_t> ids;
+    mutable mutex mtx;
+};
+
+StringTable &billText() {
+    static StringTable table{"Consultation", "X-ray", "Cash", "Card", "Insurance"};
+    return table;
+}
+
+// Patient genders; a handful of values shared by every record
+StringTable &genderText() {
+    static StringTable table;
+    return table;
+}
+
+// Bill line items in struct-of-arrays form: one contiguous column per field
+struct LineItems {
+    vector<uint32_t> textId;  // index into billText()
+    vector<long long> cents;
+    vector<int64_t> when;     // seconds since epoch
+
+    void push(uint32_t text, long long amountCents, int64_t at) {
+        textId.push_back(text);
+        cents.push_back(amountCents);
+        when.push_back(at);
+    }
+    size_t size() const { return cents.size(); }
+    bool empty() const { return cents.empty(); }
+};
+
 // Billing system
 class Bill {
 public:
     enum class Status { PENDING, PARTIALLY_PAID, FULLY_CLEARED };
 
-    void addCharge(const string &desc, double amount) {
-        if (amount <= 0) return;
-        charges.push_back({desc, amount});
-        updateStatus();
+    bool addCharge(const string &desc, double amount) {
+        return addChargeCents(desc, toCents(amount), time(nullptr));
     }
 
-    void addPayment(const string &method, double amount) {
-        if (amount <= 0) return;
-        payments.push_back({method, amount});
-        updateStatus();
+    bool addPayment(const string &method, double amount) {
+        return addPaymentCents(method, toCents(amount), time(nullptr));
     }
 
-    double totalCharges() const {
-        double sum = 0;
-        for (auto &c : charges) sum += c.second;
-        return sum;
+    // Exact forms used when replaying stored line items. False (and nothing
+    // added) unless the amount is positive and keeps the total within
+    // MAX_BILL_CENTS.
+    bool addChargeCents(const string &desc, long long cents, int64_t when) {
+        if (!fitsCharge(cents)) return false;
+        charges.push(billText().intern(desc), cents, when);
+        chargesCents += cents;
+        updateStatus();
+        return true;
     }
 
-    double totalPayments() const {
-        double sum = 0;
-        for (auto &p : payments) sum += p.second;
-        return sum;
+    bool addPaymentCents(const string &method, long long cents, int64_t when) {
+        if (!fitsPayment(cents)) return false;
+        payments.push(billText().intern(method), cents, when);
+        paymentsCents += cents;
+        updateStatus();
+        return true;
     }
 
-    double balance() const {
-        return totalCharges() - totalPayments();
-    }
+    bool fitsCharge(long long cents) const { return cents > 0 && cents <= MAX_BILL_CENTS - chargesCents; }
+    bool fitsPayment(long long cents) const { return cents > 0 && cents <= MAX_BILL_CENTS - paymentsCents; }
+
+    const LineItems &getCharges() const { return charges; }
+    const LineItems &getPayments() const { return payments; }
+
+    // Running sums are maintained on every mutation, so these are O(1)
+    long long totalChargesCents() const { return chargesCents; }
+    long long totalPaymentsCents() const { return paymentsCents; }
+    long long balanceCents() const { return chargesCents - paymentsCents; }
+
+    double totalCharges() const { return chargesCents / 100.0; }
+    double totalPayments() const { return paymentsCents / 100.0; }
+    double balance() const { return balanceCents() / 100.0; }
 
     Status getStatus() const { return status; }
     void setStatus(Status s) { status = s; }
+    // Settles the status from the balance, replacing a manual one (on discharge)
+    void finalize() { updateStatus(); }
 
     void printBillSummary() const {
-        cout << "---- Bill Summary ----\n";
-        cout << fixed << setprecision(2);
-        cout << "Charges:\n";
-        if (charges.empty()) cout << "  (none)\n";
-        for (auto &c : charges) cout << "  " << c.first << " : $" << c.second << "\n";
-        cout << "Payments:\n";
-        if (payments.empty()) cout << "  (none)\n";
-        for (auto &p : payments) cout << "  " << p.first << " : $" << p.second << "\n";
-        cout << "Total Charges: $" << totalCharges() << "\n";
-        cout << "Total Payments: $" << totalPayments() << "\n";
-        cout << "Balance: $" << balance() << "\n";
-        cout << "Status: " << statusToString(status) << "\n";
-        cout << "----------------------\n";
+        out() << "---- Bill Summary ----\n";
+        out() << "Charges:\n";
+        if (charges.empty()) out() << "  (none)\n";
+        printItems(charges);
+        out() << "Payments:\n";
+        if (payments.empty()) out() << "  (none)\n";
+        printItems(payments);
+        out() << "Total Charges: $" << formatCents(chargesCents) << "\n";
+        out() << "Total Payments: $" << formatCents(paymentsCents) << "\n";
+        out() << "Balance: $" << formatCents(balanceCents()) << "\n";
+        out() << "Status: " << statusToString(status) << "\n";
+        out() << "----------------------\n";
     }
 
 private:
-    vector<pair<string,double>> charges;
-    vector<pair<string,double>> payments;
+    LineItems charges;  // text = description
+    LineItems payments; // text = payment method
+    long long chargesCents = 0;
+    long long paymentsCents = 0;
     Status status = Status::PENDING;
 
     void updateStatus() {
-        double bal = balance();
-        if (bal <= 0.0) status = Status::FULLY_CLEARED;
-        else if (totalPayments() > 0.0) status = Status::PARTIALLY_PAID;
+        if (balanceCents() <= 0) status = Status::FULLY_CLEARED;
+        else if (paymentsCents > 0) status = Status::PARTIALLY_PAID;
         else status = Status::PENDING;
     }
 
-    string statusToString(Status s) const {
+    static void printItems(const LineItems &items) {
+        const StringTable &text = billText();
+        for (size_t i = 0; i < items.size(); ++i)
+            out() << "  " << text.lookup(items.textId[i]) << " : $" << formatCents(items.cents[i]) << "\n";
+    }
+
+public:
+    static string statusToString(Status s) {
         switch (s) {
             case Status::PENDING: return "Pending";
             case Status::PARTIALLY_PAID: return "Partially Paid";
@@ -144,262 +798,4729 @@ private:
             default: return "Unknown";
         }
     }
-};
+};
+
+// Clinical history and bill: the cold part of a patient record. Only the
+// basic fields stay resident for every patient; the history of a patient
+// read from the snapshot is loaded on first use and may be dropped again
+// while it matches the snapshot (see HospitalSystem::readHistory).
+struct PatientHistory {
+    vector<string> diagnoses;
+    vector<string> medicalNotes;
+    vector<string> prescriptions;
+    Bill bill;
+
+    // Approximate heap footprint, for the history memory budget
+    size_t bytes() const {
+        size_t n = sizeof(PatientHistory);
+        for (const vector<string> *list : {&diagnoses, &medicalNotes, &prescriptions})
+            for (const string &s : *list) n += sizeof(string) + (s.capacity() > 15 ? s.capacity() + 1 : 0);
+        return n + (bill.getCharges().size() + bill.getPayments().size()) * 20;
+    }
+};
+
+// Patient record
+class Patient {
+public:
+    // Strings are taken by value and moved in, so callers can hand theirs over.
+    // A new patient starts with an empty history that exists nowhere else
+    // (dirty); one read from the snapshot starts without its history.
+    Patient(int id_, string name_, int age_, string_view gender_,
+            string symptoms_, string admissionDate_, bool inSnapshot = false)
+        : id(id_), name(move(name_)), age(age_), genderId(genderText().intern(gender_)),
+          symptoms(move(symptoms_)), admissionDate(move(admissionDate_)) {
+        if (!inSnapshot) setHistory(make_shared<PatientHistory>());
+        dirty.store(!inSnapshot, memory_order_relaxed);
+    }
+
+    int getId() const { return id; }
+    const string &getName() const { return name; }
+    int getAge() const { return age; }
+    const string &getGender() const { return genderText().lookup(genderId); }
+    const string &getSymptoms() const { return symptoms; }
+    const string &getAdmissionDate() const { return admissionDate; }
+
+    // Set once, under the record lock; zero while admitted
+    bool isDischarged() const { return getDischargedAt() != 0; }
+    int64_t getDischargedAt() const { return dischargedAt.load(memory_order_acquire); }
+    void markDischarged(int64_t when) { dischargedAt.store(when ? when : 1, memory_order_release); }
+
+    // History accessors: the history must be resident and the record lock held
+    const vector<string> &getDiagnoses() const { return history->diagnoses; }
+    const vector<string> &getMedicalNotes() const { return history->medicalNotes; }
+    const vector<string> &getPrescriptions() const { return history->prescriptions; }
+
+    void addDiagnosis(const string &d) {
+        if (!d.empty()) history->diagnoses.push_back(d);
+    }
+
+    void addMedicalNote(const string &note) {
+        if (!note.empty()) history->medicalNotes.push_back(note);
+    }
+
+    void addPrescription(const string &presc) {
+        if (!presc.empty()) history->prescriptions.push_back(presc);
+    }
+
+    Bill &getBill() { return history->bill; }
+    const Bill &getBill() const { return history->bill; }
+
+    // Guards the history and bill; the basic fields above never change
+    shared_mutex &recordLock() const { return recordMtx; }
+
+    // Loading and dropping the history need the record lock held exclusively.
+    // historyResident is also readable without the lock, as a hint.
+    bool hasHistory() const { return history != nullptr; }
+    bool historyResident() const { return resident.load(memory_order_acquire); }
+    void setHistory(shared_ptr<PatientHistory> h) {
+        history = move(h);
+        resident.store(history != nullptr, memory_order_release);
+    }
+    shared_ptr<PatientHistory> takeHistory() {
+        resident.store(false, memory_order_release);
+        return move(history);
+    }
+    size_t historyBytes() const { return history ? history->bytes() : 0; }
+
+    // Copy-on-write versions. A reader (lock held shared) takes the current
+    // history as a version it may keep reading after unlocking; a writer
+    // (lock held exclusively) first copies a history some version still
+    // shares, so a version never changes once handed out. Versions are
+    // released under the shared lock (see HospitalSystem::HistoryView), which
+    // orders their last reads before the writer's use count check.
+    shared_ptr<const PatientHistory> historyVersion() const { return history; }
+    void unshareHistory() {
+        if (history && history.use_count() > 1) history = make_shared<PatientHistory>(*history);
+    }
+
+    // Dirty: the history has changed since the last snapshot, so it cannot
+    // be dropped. Referenced: used since the eviction sweep last passed.
+    bool isDirty() const { return dirty.load(memory_order_acquire); }
+    void setDirty(bool d) const { dirty.store(d, memory_order_release); }
+    void touch() const { referenced.store(true, memory_order_relaxed); }
+    bool clearReferenced() const { return referenced.exchange(false, memory_order_relaxed); }
+    size_t accountedBytes = 0; // this history's share of the budget, see HospitalSystem
+
+    void printBasicInfo() const {
+        printBasicFields(id, name, age, getGender(), symptoms, admissionDate);
+    }
+
+    // Shared with records printed straight out of the snapshot mapping
+    static void printBasicFields(int id, string_view name, int age, string_view gender,
+                                 string_view symptoms, string_view admissionDate) {
+        out() << "Patient ID: " << id << "\n";
+        out() << "Name: " << name << ", Age: " << age << ", Gender: " << gender << "\n";
+        out() << "Symptoms: " << symptoms << "\n";
+        out() << "Date of admission: " << admissionDate << "\n";
+    }
+
+    // Prints from h, a version of this patient's history, so the listed line
+    // items and the totals always come from the same point in time
+    void printFullRecord(const PatientHistory &h) const {
+        printBasicInfo();
+        out() << "Diagnoses:\n";
+        if (h.diagnoses.empty()) out() << "  (none)\n";
+        for (auto &d : h.diagnoses) out() << "  - " << d << "\n";
+        out() << "Medical Notes:\n";
+        if (h.medicalNotes.empty()) out() << "  (none)\n";
+        for (auto &n : h.medicalNotes) out() << "  - " << n << "\n";
+        out() << "Prescriptions:\n";
+        if (h.prescriptions.empty()) out() << "  (none)\n";
+        for (auto &p : h.prescriptions) out() << "  - " << p << "\n";
+        h.bill.printBillSummary();
+    }
+
+private:
+    int id;
+    string name;
+    int age;
+    uint32_t genderId; // few distinct values, so interned
+    string symptoms;
+    string admissionDate;
+
+    atomic<int64_t> dischargedAt{0};
+    shared_ptr<PatientHistory> history;
+    atomic<bool> resident{false};
+    mutable atomic<bool> dirty{false};
+    mutable atomic<bool> referenced{false};
+    mutable shared_mutex recordMtx;
+};
+
+// ---------------------------------------------------------------------------
+// Password hashing: scrypt (RFC 7914) over HMAC-SHA-256, with a per-user
+// random salt. Stored credentials look like
+//   $scrypt$ln=14,r=8,p=1$<salt hex>$<key hex>
+// and each hash needs 128 * r * 2^ln bytes of scratch memory, so the cost is
+// tuned by ln (see --hash-cost and --bench-login in main).
+// ---------------------------------------------------------------------------
+
+class Sha256 {
+public:
+    Sha256() { reset(); }
+
+    void reset() {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(h, init, sizeof h);
+        total = 0;
+        used = 0;
+    }
+
+    void update(const uint8_t *data, size_t n) {
+        total += n;
+        while (n > 0) {
+            size_t take = min(n, sizeof block - used);
+            memcpy(block + used, data, take);
+            used += take;
+            data += take;
+            n -= take;
+            if (used == sizeof block) {
+                compress(block);
+                used = 0;
+            }
+        }
+    }
+
+    void finish(uint8_t out[32]) {
+        uint64_t bits = total * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56) update(&pad, 1);
+        uint8_t len[8];
+        for (int i = 0; i < 8; ++i) len[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        update(len, 8);
+        for (int i = 0; i < 8; ++i)
+            for (int j = 0; j < 4; ++j) out[4 * i + j] = static_cast<uint8_t>(h[i] >> (24 - 8 * j));
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t *p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    uint32_t h[8];
+    uint8_t block[64];
+    uint64_t total;
+    size_t used;
+};
+
+// PBKDF2-HMAC-SHA-256; scrypt only ever uses one iteration
+void pbkdf2Sha256(const string &password, const uint8_t *salt, size_t saltLen, uint8_t *out, size_t outLen) {
+    uint8_t key[64] = {0};
+    if (password.size() > sizeof key) {
+        Sha256 kh;
+        kh.update(reinterpret_cast<const uint8_t*>(password.data()), password.size());
+        kh.finish(key);
+    } else {
+        memcpy(key, password.data(), password.size());
+    }
+    uint8_t ipad[64], opad[64];
+    for (int i = 0; i < 64; ++i) {
+        ipad[i] = key[i] ^ 0x36;
+        opad[i] = key[i] ^ 0x5c;
+    }
+    for (uint32_t blockNo = 1; outLen > 0; ++blockNo) {
+        uint8_t counter[4] = {uint8_t(blockNo >> 24), uint8_t(blockNo >> 16), uint8_t(blockNo >> 8), uint8_t(blockNo)};
+        uint8_t inner[32], mac[32];
+        Sha256 hs;
+        hs.update(ipad, 64);
+        hs.update(salt, saltLen);
+        hs.update(counter, 4);
+        hs.finish(inner);
+        hs.reset();
+        hs.update(opad, 64);
+        hs.update(inner, 32);
+        hs.finish(mac);
+        size_t take = min(outLen, sizeof mac);
+        memcpy(out, mac, take);
+        out += take;
+        outLen -= take;
+    }
+}
+
+struct PasswordCost {
+    int logN = 14;
+    uint32_t r = 8;
+    uint32_t p = 1;
+    size_t memoryBytes() const { return size_t(128) * r << logN; }
+};
+
+// Set once from the command line before any session starts
+PasswordCost &passwordCost() {
+    static PasswordCost cost;
+    return cost;
+}
+
+void salsa20_8(uint32_t b[16]) {
+    uint32_t x[16];
+    memcpy(x, b, sizeof x);
+    auto r = [](uint32_t a, int n) { return (a << n) | (a >> (32 - n)); };
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= r(x[0] + x[12], 7);   x[8] ^= r(x[4] + x[0], 9);
+        x[12] ^= r(x[8] + x[4], 13);  x[0] ^= r(x[12] + x[8], 18);
+        x[9] ^= r(x[5] + x[1], 7);    x[13] ^= r(x[9] + x[5], 9);
+        x[1] ^= r(x[13] + x[9], 13);  x[5] ^= r(x[1] + x[13], 18);
+        x[14] ^= r(x[10] + x[6], 7);  x[2] ^= r(x[14] + x[10], 9);
+        x[6] ^= r(x[2] + x[14], 13);  x[10] ^= r(x[6] + x[2], 18);
+        x[3] ^= r(x[15] + x[11], 7);  x[7] ^= r(x[3] + x[15], 9);
+        x[11] ^= r(x[7] + x[3], 13);  x[15] ^= r(x[11] + x[7], 18);
+        x[1] ^= r(x[0] + x[3], 7);    x[2] ^= r(x[1] + x[0], 9);
+        x[3] ^= r(x[2] + x[1], 13);   x[0] ^= r(x[3] + x[2], 18);
+        x[6] ^= r(x[5] + x[4], 7);    x[7] ^= r(x[6] + x[5], 9);
+        x[4] ^= r(x[7] + x[6], 13);   x[5] ^= r(x[4] + x[7], 18);
+        x[11] ^= r(x[10] + x[9], 7);  x[8] ^= r(x[11] + x[10], 9);
+        x[9] ^= r(x[8] + x[11], 13);  x[10] ^= r(x[9] + x[8], 18);
+        x[12] ^= r(x[15] + x[14], 7); x[13] ^= r(x[12] + x[15], 9);
+        x[14] ^= r(x[13] + x[12], 13); x[15] ^= r(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; ++i) b[i] += x[i];
+}
+
+// scrypt BlockMix over 2r 64-byte blocks; y is scratch of the same size
+void scryptBlockMix(uint32_t *b, uint32_t *y, uint32_t r) {
+    uint32_t x[16];
+    memcpy(x, b + (2 * r - 1) * 16, sizeof x);
+    for (uint32_t i = 0; i < 2 * r; ++i) {
+        for (int k = 0; k < 16; ++k) x[k] ^= b[i * 16 + k];
+        salsa20_8(x);
+        // Even blocks go to the first half of the output, odd to the second
+        memcpy(y + ((i & 1) * r + i / 2) * 16, x, sizeof x);
+    }
+    memcpy(b, y, size_t(128) * r);
+}
+
+// scrypt key derivation into a 32-byte key
+void scrypt(const string &password, const uint8_t *salt, size_t saltLen, const PasswordCost &cost, uint8_t out[32]) {
+    size_t words = size_t(32) * cost.r; // one 128*r byte block as 32-bit words
+    size_t n = size_t(1) << cost.logN;
+    vector<uint8_t> b(128 * cost.r * cost.p);
+    pbkdf2Sha256(password, salt, saltLen, b.data(), b.size());
+    vector<uint32_t> x(words), y(words), v(words * n);
+    for (uint32_t lane = 0; lane < cost.p; ++lane) {
+        uint8_t *chunk = b.data() + size_t(lane) * 128 * cost.r;
+        for (size_t i = 0; i < words; ++i)
+            x[i] = uint32_t(chunk[4 * i]) | uint32_t(chunk[4 * i + 1]) << 8 |
+                   uint32_t(chunk[4 * i + 2]) << 16 | uint32_t(chunk[4 * i + 3]) << 24;
+        for (size_t i = 0; i < n; ++i) {
+            memcpy(&v[i * words], x.data(), words * 4);
+            scryptBlockMix(x.data(), y.data(), cost.r);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            size_t j = x[(2 * cost.r - 1) * 16] & (n - 1);
+            for (size_t k = 0; k < words; ++k) x[k] ^= v[j * words + k];
+            scryptBlockMix(x.data(), y.data(), cost.r);
+        }
+        for (size_t i = 0; i < words; ++i)
+            for (int k = 0; k < 4; ++k) chunk[4 * i + k] = static_cast<uint8_t>(x[i] >> (8 * k));
+    }
+    pbkdf2Sha256(password, b.data(), b.size(), out, 32);
+}
+
+// Runs hashing on one thread per core, so a burst of logins queues here
+// instead of every session thread allocating scrypt scratch at once. Peak
+// memory is bounded by workers * PasswordCost::memoryBytes().
+class PasswordWorkers {
+public:
+    PasswordWorkers() {
+        size_t n = max(1u, thread::hardware_concurrency());
+        for (size_t i = 0; i < n; ++i) threads.emplace_back([this] { work(); });
+    }
+
+    ~PasswordWorkers() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+    // Blocks the calling session until the job has run on a worker
+    template <typename F>
+    auto run(F &&job) -> decltype(job()) {
+        auto task = make_shared<packaged_task<decltype(job())()>>(forward<F>(job));
+        auto result = task->get_future();
+        {
+            lock_guard<mutex> lock(mtx);
+            jobs.emplace_back([task] { (*task)(); });
+        }
+        ready.notify_one();
+        return result.get();
+    }
+
+private:
+    void work() {
+        while (true) {
+            function<void()> job;
+            {
+                unique_lock<mutex> lock(mtx);
+                ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    vector<thread> threads;
+    mutex mtx;
+    condition_variable ready;
+    deque<function<void()>> jobs;
+    bool stopping = false;
+};
+
+PasswordWorkers &passwordWorkers() {
+    static PasswordWorkers workers;
+    return workers;
+}
+
+// Compares without an early exit, so timing does not reveal the match length
+bool constantTimeEquals(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+string toHex(const uint8_t *data, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    string s;
+    for (size_t i = 0; i < n; ++i) {
+        s += digits[data[i] >> 4];
+        s += digits[data[i] & 15];
+    }
+    return s;
+}
+
+bool fromHex(string_view s, vector<uint8_t> &out) {
+    if (s.size() % 2 != 0) return false;
+    out.clear();
+    for (size_t i = 0; i < s.size(); i += 2) {
+        uint8_t v = 0;
+        if (from_chars(s.data() + i, s.data() + i + 2, v, 16).ptr != s.data() + i + 2) return false;
+        out.push_back(v);
+    }
+    return true;
+}
+
+constexpr const char *SCRYPT_PREFIX = "$scrypt$";
+
+string formatCredential(const PasswordCost &cost, const uint8_t *salt, size_t saltLen, const uint8_t key[32]) {
+    return string(SCRYPT_PREFIX) + "ln=" + to_string(cost.logN) + ",r=" + to_string(cost.r) +
+           ",p=" + to_string(cost.p) + "$" + toHex(salt, saltLen) + "$" + toHex(key, 32);
+}
+
+// Splits a stored credential; false for anything that is not a sane scrypt
+// hash (including plaintext passwords saved by older versions)
+bool parseCredential(const string &stored, PasswordCost &cost, vector<uint8_t> &salt, vector<uint8_t> &key) {
+    if (stored.compare(0, strlen(SCRYPT_PREFIX), SCRYPT_PREFIX) != 0) return false;
+    int consumed = 0;
+    if (sscanf(stored.c_str(), "$scrypt$ln=%d,r=%u,p=%u$%n", &cost.logN, &cost.r, &cost.p, &consumed) != 3 || consumed == 0)
+        return false;
+    if (cost.logN < 1 || cost.logN > 24 || cost.r < 1 || cost.r > 64 || cost.p < 1 || cost.p > 16) return false;
+    string_view rest = string_view(stored).substr(static_cast<size_t>(consumed));
+    size_t split = rest.find('$');
+    return split != string_view::npos && fromHex(rest.substr(0, split), salt) &&
+           fromHex(rest.substr(split + 1), key) && key.size() == 32 && !salt.empty();
+}
+
+// Salts and hashes a new password at the configured cost
+string hashPassword(const string &password) {
+    uint8_t salt[16];
+    random_device rd;
+    for (size_t i = 0; i < sizeof salt; i += 4) {
+        uint32_t v = rd();
+        memcpy(salt + i, &v, 4);
+    }
+    PasswordCost cost = passwordCost();
+    return passwordWorkers().run([&] {
+        uint8_t key[32];
+        scrypt(password, salt, sizeof salt, cost, key);
+        return formatCredential(cost, salt, sizeof salt, key);
+    });
+}
+
+bool verifyPassword(const string &password, const string &stored) {
+    PasswordCost cost;
+    vector<uint8_t> salt, key;
+    if (!parseCredential(stored, cost, salt, key)) {
+        // Plaintext left by an older version; it is rehashed on login
+        return stored.compare(0, strlen(SCRYPT_PREFIX), SCRYPT_PREFIX) != 0 && constantTimeEquals(password, stored);
+    }
+    return passwordWorkers().run([&] {
+        uint8_t derived[32];
+        scrypt(password, salt.data(), salt.size(), cost, derived);
+        return constantTimeEquals(string_view(reinterpret_cast<const char*>(derived), 32),
+                                  string_view(reinterpret_cast<const char*>(key.data()), 32));
+    });
+}
+
+// True for plaintext and for hashes made at a different cost than configured
+bool credentialNeedsRehash(const string &stored) {
+    PasswordCost cost;
+    vector<uint8_t> salt, key;
+    if (!parseCredential(stored, cost, salt, key)) return true;
+    const PasswordCost &want = passwordCost();
+    return cost.logN != want.logN || cost.r != want.r || cost.p != want.p;
+}
+
+// Base User class
+class User {
+public:
+    // credential_ is the stored hash (see hashPassword), never the password
+    User(const string &username_, const string &credential_, Role role_)
+        : username(username_), credential(credential_), role(role_) {}
+
+    const string &getUsername() const { return username; }
+    Role getRole() const { return role; }
+    const string &getCredential() const { return credential; }
+    void setCredential(const string &c) { credential = c; }
+
+protected:
+    string username;
+    string credential;
+    Role role;
+};
+
+// Derived role classes - declarations (definitions for showMenu after HospitalSystem)
+class AdminUser : public User {
+public:
+    AdminUser(const string &username_, const string &credential_)
+        : User(username_, credential_, Role::ADMIN) {}
+    void showMenu(HospitalSystem &sys);
+};
+
+class NurseUser : public User {
+public:
+    NurseUser(const string &username_, const string &credential_)
+        : User(username_, credential_, Role::NURSE) {}
+    void showMenu(HospitalSystem &sys);
+};
+
+class DoctorUser : public User {
+public:
+    DoctorUser(const string &username_, const string &credential_)
+        : User(username_, credential_, Role::DOCTOR) {}
+    void showMenu(HospitalSystem &sys);
+};
+
+class PharmacistUser : public User {
+public:
+    PharmacistUser(const string &username_, const string &credential_)
+        : User(username_, credential_, Role::PHARMACIST) {}
+    void showMenu(HospitalSystem &sys);
+};
+
+class AccountsUser : public User {
+public:
+    AccountsUser(const string &username_, const string &credential_)
+        : User(username_, credential_, Role::ACCOUNTS) {}
+    void showMenu(HospitalSystem &sys);
+};
+
+// Every role class in one value type, so the user table stores employees
+// inline and menus dispatch through visit instead of a virtual call
+using UserRecord = variant<AdminUser, DoctorUser, NurseUser, PharmacistUser, AccountsUser>;
+
+// Build the concrete user record for a role; nothing for an unknown role
+optional<UserRecord> makeUser(const string &username, const string &credential, Role role) {
+    switch (role) {
+        case Role::ADMIN: return UserRecord(in_place_type<AdminUser>, username, credential);
+        case Role::DOCTOR: return UserRecord(in_place_type<DoctorUser>, username, credential);
+        case Role::NURSE: return UserRecord(in_place_type<NurseUser>, username, credential);
+        case Role::PHARMACIST: return UserRecord(in_place_type<PharmacistUser>, username, credential);
+        case Role::ACCOUNTS: return UserRecord(in_place_type<AccountsUser>, username, credential);
+        default: return nullopt;
+    }
+}
+
+User &asUser(UserRecord &r) { return visit([](User &u) -> User& { return u; }, r); }
+const User &asUser(const UserRecord &r) { return visit([](const User &u) -> const User& { return u; }, r); }
+
+// Stable reference to an entry in the user table. Entries are never moved
+// or reused, so a handle stays valid for the life of the system.
+struct UserHandle {
+    static constexpr uint32_t NONE = numeric_limits<uint32_t>::max();
+    uint32_t slot = NONE;
+    explicit operator bool() const { return slot != NONE; }
+};
+
+// ---------------------------------------------------------------------------
+// Persistent storage: an append-only write-ahead log of mutations plus
+// periodic compact snapshots, so a restart only replays the log written since
+// the last snapshot. Integers are stored in native (little-endian) order.
+// ---------------------------------------------------------------------------
+
+// Binary encoding helpers shared by the log and snapshot formats
+class ByteWriter {
+public:
+    void u8(uint8_t v) { raw(&v, 1); }
+    void u32(uint32_t v) { raw(&v, 4); }
+    void i32(int32_t v) { raw(&v, 4); }
+    void i64(int64_t v) { raw(&v, 8); }
+    void u64(uint64_t v) { raw(&v, 8); }
+    void str(string_view s) {
+        u32(static_cast<uint32_t>(s.size()));
+        raw(s.data(), s.size());
+    }
+    void raw(const void *p, size_t n) {
+        const char *c = static_cast<const char*>(p);
+        buf.insert(buf.end(), c, c + n);
+    }
+
+    const char *data() const { return buf.data(); }
+    size_t size() const { return buf.size(); }
+    void clear() { buf.clear(); }
+
+private:
+    vector<char> buf;
+};
+
+// Bounds-checked reader; any overrun clears good() instead of reading past the end
+class ByteReader {
+public:
+    ByteReader(const char *data, size_t size) : p(data), end(data + size) {}
+
+    uint8_t u8() { uint8_t v = 0; take(&v, 1); return v; }
+    uint32_t u32() { uint32_t v = 0; take(&v, 4); return v; }
+    int32_t i32() { int32_t v = 0; take(&v, 4); return v; }
+    int64_t i64() { int64_t v = 0; take(&v, 8); return v; }
+    uint64_t u64() { uint64_t v = 0; take(&v, 8); return v; }
+    string str() {
+        uint32_t n = u32();
+        if (!ok || static_cast<size_t>(end - p) < n) { ok = false; return {}; }
+        string s(p, n);
+        p += n;
+        return s;
+    }
+
+    bool good() const { return ok; }
+    bool atEnd() const { return p == end; }
+
+private:
+    void take(void *dst, size_t n) {
+        if (!ok || static_cast<size_t>(end - p) < n) { ok = false; return; }
+        memcpy(dst, p, n);
+        p += n;
+    }
+
+    const char *p;
+    const char *end;
+    bool ok = true;
+};
+
+uint32_t crc32(const char *data, size_t n) {
+    static const auto table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; ++i) c = table[(c ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+// Mutation kinds recorded in the write-ahead log
+enum class LogOp : uint8_t {
+    REGISTER_PATIENT = 1, ADD_DIAGNOSIS, ADD_NOTE, ADD_PRESCRIPTION,
+    ADD_CHARGE, ADD_PAYMENT, SET_BILL_STATUS, ADD_USER, DELETE_USER, SET_PASSWORD, DISPENSE, DISCHARGE
+};
+
+// Small LZ77 block codec (LZ4-style sequences) for archived records, which
+// are mostly repetitive clinical text. A sequence is a token byte (literal
+// count << 4 | match length - 4; 15 means more follows in 255-run bytes),
+// the literals, then a 16-bit back-reference offset and the rest of the
+// match length. The last sequence has literals only.
+constexpr size_t LZ_MIN_MATCH = 4;
+
+inline void lzPutLength(string &out, size_t n) {
+    for (; n >= 255; n -= 255) out += static_cast<char>(255);
+    out += static_cast<char>(n);
+}
+
+inline void lzSequence(string &out, const char *literals, size_t count, size_t matchLen, size_t offset) {
+    size_t extra = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    out += static_cast<char>(min<size_t>(count, 15) << 4 | min<size_t>(extra, 15));
+    if (count >= 15) lzPutLength(out, count - 15);
+    out.append(literals, count);
+    if (!matchLen) return;
+    out += static_cast<char>(offset & 0xFF);
+    out += static_cast<char>(offset >> 8);
+    if (extra >= 15) lzPutLength(out, extra - 15);
+}
+
+inline string lzCompress(string_view in) {
+    constexpr unsigned HASH_BITS = 12;
+    vector<uint32_t> latest(size_t(1) << HASH_BITS); // position + 1 of the last 4 bytes with each hash
+    const char *s = in.data();
+    size_t n = in.size(), anchor = 0, i = 0;
+    auto read4 = [s](size_t at) { uint32_t v; memcpy(&v, s + at, 4); return v; };
+    string out;
+    out.reserve(n / 2 + 16);
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t seq = read4(i);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t candidate = latest[h];
+        latest[h] = static_cast<uint32_t>(i + 1);
+        if (candidate == 0 || i - (candidate - 1) > 0xFFFF || read4(candidate - 1) != seq) {
+            ++i;
+            continue;
+        }
+        size_t from = candidate - 1, len = LZ_MIN_MATCH;
+        while (i + len < n && s[from + len] == s[i + len]) ++len;
+        lzSequence(out, s + anchor, i - anchor, len, i - from);
+        i += len;
+        anchor = i;
+    }
+    lzSequence(out, s + anchor, n - anchor, 0, 0);
+    return out;
+}
+
+// False for input that is damaged or does not expand to exactly rawSize bytes
+inline bool lzDecompress(string_view in, size_t rawSize, string &out) {
+    out.clear();
+    out.reserve(rawSize);
+    size_t i = 0;
+    auto length = [&](size_t nibble, size_t &len) {
+        len = nibble;
+        if (nibble != 15) return true;
+        while (i < in.size()) {
+            uint8_t b = static_cast<uint8_t>(in[i++]);
+            len += b;
+            if (b != 255) return true;
+        }
+        return false;
+    };
+    while (i < in.size()) {
+        uint8_t token = static_cast<uint8_t>(in[i++]);
+        size_t count, match;
+        if (!length(token >> 4, count) || count > in.size() - i || count > rawSize - out.size()) return false;
+        out.append(in.data() + i, count);
+        i += count;
+        if (i == in.size()) break;
+        if (in.size() - i < 2) return false;
+        size_t offset = static_cast<uint8_t>(in[i]) | size_t(static_cast<uint8_t>(in[i + 1])) << 8;
+        i += 2;
+        if (!length(token & 15, match)) return false;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out.size() || match > rawSize - out.size()) return false;
+        for (size_t from = out.size() - offset, k = 0; k < match; ++k) out += out[from + k]; // may overlap
+    }
+    return out.size() == rawSize;
+}
+
+// ---------------------------------------------------------------------------
+// Snapshot file format (version 4), designed to be mmap'ed and read in place:
+//
+//   SnapHeader                      fixed 112 bytes at offset 0 (104 in
+//                                   version 3, 80 in version 2)
+//   string heap                     {u32 len, bytes} strings, list blocks
+//                                   {u32 count, u64 string offsets...},
+//                                   bill item blocks {u32 count, items...}
+//                                   and compressed archive blobs
+//   user table                      u32 count + {str, str, u8} per user
+//   text dictionary                 u64 heap offset per bill text id
+//   dispensing ledger               see DispensingLedger::encode (version 3)
+//   patient record table            SnapPatient[patientCount], sorted by id
+//   archive index                   SnapArchived[archiveCount], sorted by id
+//                                   (version 4)
+//
+// All offsets are absolute file offsets. Records are fixed width, so a
+// patient is found by binary search over the table and only the pages it
+// touches are faulted in. Discharged patients are kept out of the record
+// table: each is one lzCompress'ed blob (see encodeArchived) found through
+// the archive index. Version-2 and 3 files are still read.
+// ---------------------------------------------------------------------------
+
+struct SnapHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t headerCrc;      // crc32 of the header with this field zeroed
+    uint64_t epoch;
+    int32_t lastPatientId;
+    uint32_t patientCount;
+    uint64_t recordsOffset;
+    uint64_t usersOffset;
+    uint64_t usersSize;
+    uint64_t textOffset;
+    uint32_t textCount;
+    uint32_t usersCrc;
+    uint64_t fileSize;
+    // version 3
+    uint64_t ledgerOffset;
+    uint64_t ledgerSize;
+    uint32_t ledgerCrc;
+    uint32_t archiveCount;   // version 4 (zero in version 3)
+    uint64_t archiveOffset;  // version 4
+};
+static_assert(sizeof(SnapHeader) == 112, "snapshot header layout");
+
+// Bytes of SnapHeader present (and covered by headerCrc) in each version
+constexpr size_t snapHeaderSize(uint32_t version) {
+    return version <= 2 ? 80 : version == 3 ? 104 : sizeof(SnapHeader);
+}
+
+struct SnapPatient {
+    int32_t id;
+    int32_t age;
+    uint64_t name, gender, symptoms, admissionDate;  // heap strings
+    uint64_t diagnoses, medicalNotes, prescriptions; // heap list blocks
+    uint64_t charges, payments;                      // heap item blocks
+    int64_t chargesCents;
+    int64_t paymentsCents;
+    uint32_t status;
+    uint32_t reserved;
+};
+static_assert(sizeof(SnapPatient) == 104, "snapshot record layout");
+
+struct SnapArchived {
+    int32_t id;
+    uint32_t rawSize; // before compression
+    uint64_t blob;    // heap offset of the compressed bytes
+    uint32_t size;
+    uint32_t crc;     // of the compressed bytes
+};
+static_assert(sizeof(SnapArchived) == 24, "snapshot archive index layout");
+
+constexpr uint64_t SNAPSHOT_MAGIC = 0x32504E53534D48ull; // "HMSSNP2"
+constexpr uint32_t SNAPSHOT_VERSION = 4;
+constexpr size_t SNAP_ITEM_SIZE = 20;                  // u32 text id, i64 cents, i64 time
+
+// A discharged patient's whole record, as stored in the snapshot archive
+struct ArchivedPatient {
+    int id = 0;
+    int age = 0;
+    string name, gender, symptoms, admissionDate;
+    int64_t dischargedAt = 0;
+    PatientHistory history;
+};
+
+// Caller holds the patient's lock with its history resident
+inline void encodeArchived(ByteWriter &w, const Patient &p) {
+    w.i32(p.getId());
+    w.i32(p.getAge());
+    w.str(p.getName());
+    w.str(p.getGender());
+    w.str(p.getSymptoms());
+    w.str(p.getAdmissionDate());
+    w.i64(p.getDischargedAt());
+    for (const vector<string> *list : {&p.getDiagnoses(), &p.getMedicalNotes(), &p.getPrescriptions()}) {
+        w.u32(static_cast<uint32_t>(list->size()));
+        for (const string &s : *list) w.str(s);
+    }
+    const Bill &b = p.getBill();
+    const StringTable &text = billText();
+    for (const LineItems *items : {&b.getCharges(), &b.getPayments()}) {
+        w.u32(static_cast<uint32_t>(items->size()));
+        for (size_t i = 0; i < items->size(); ++i) {
+            w.str(text.lookup(items->textId[i]));
+            w.i64(items->cents[i]);
+            w.i64(items->when[i]);
+        }
+    }
+    w.u8(static_cast<uint8_t>(b.getStatus()));
+}
+
+inline bool decodeArchived(ByteReader &r, ArchivedPatient &a) {
+    a.id = r.i32();
+    a.age = r.i32();
+    a.name = r.str();
+    a.gender = r.str();
+    a.symptoms = r.str();
+    a.admissionDate = r.str();
+    a.dischargedAt = r.i64();
+    PatientHistory &h = a.history;
+    for (vector<string> *list : {&h.diagnoses, &h.medicalNotes, &h.prescriptions})
+        for (uint32_t n = r.u32(); n > 0 && r.good(); --n) list->push_back(r.str());
+    for (int kind = 0; kind < 2; ++kind) {
+        for (uint32_t n = r.u32(); n > 0 && r.good(); --n) {
+            string text = r.str();
+            long long cents = r.i64();
+            int64_t when = r.i64();
+            if (kind == 0) h.bill.addChargeCents(text, cents, when);
+            else h.bill.addPaymentCents(text, cents, when);
+        }
+    }
+    h.bill.setStatus(static_cast<Bill::Status>(r.u8()));
+    return r.good();
+}
+
+// Read-only mapping of a snapshot file. Every accessor bounds-checks against
+// the mapping and yields empty values for out-of-range offsets.
+class SnapshotView {
+public:
+    static shared_ptr<SnapshotView> open(const string &file) {
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapHeader)) {
+            ::close(fd);
+            return nullptr;
+        }
+        size_t len = static_cast<size_t>(st.st_size);
+        void *m = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) return nullptr;
+        shared_ptr<SnapshotView> v(new SnapshotView(static_cast<const char*>(m), len));
+        if (!v->validate()) {
+            cerr << "Storage: snapshot " << file << " fails validation\n";
+            return nullptr;
+        }
+        ::madvise(m, len, MADV_RANDOM);
+        return v;
+    }
+
+    ~SnapshotView() { ::munmap(const_cast<char*>(base), len); }
+    SnapshotView(const SnapshotView&) = delete;
+    SnapshotView &operator=(const SnapshotView&) = delete;
+
+    uint64_t epoch() const { return hdr.epoch; }
+    int lastPatientId() const { return hdr.lastPatientId; }
+    size_t patientCount() const { return hdr.patientCount; }
+
+    SnapPatient record(size_t i) const {
+        SnapPatient r;
+        memcpy(&r, base + hdr.recordsOffset + i * sizeof(SnapPatient), sizeof r);
+        return r;
+    }
+
+    // Record index for a patient ID, or -1. IDs are dense from the first
+    // record's, so the first probe usually hits; otherwise fall back to
+    // binary search over the sorted table.
+    long findRecord(int id) const {
+        size_t n = patientCount();
+        if (id <= 0 || n == 0) return -1;
+        size_t guess = static_cast<size_t>(id) - static_cast<size_t>(recordId(0));
+        if (guess < n && recordId(guess) == id) return static_cast<long>(guess);
+        size_t lo = 0, hi = n;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (recordId(mid) < id) lo = mid + 1;
+            else hi = mid;
+        }
+        return (lo < n && recordId(lo) == id) ? static_cast<long>(lo) : -1;
+    }
+
+    string_view str(uint64_t off) const {
+        uint32_t n = u32At(off);
+        if (off + 4 + n > len) return {};
+        return string_view(base + off + 4, n);
+    }
+
+    uint32_t listSize(uint64_t off) const {
+        uint32_t n = u32At(off);
+        return off + 4 + uint64_t(n) * 8 <= len ? n : 0;
+    }
+    string_view listItem(uint64_t off, uint32_t i) const { return str(u64At(off + 4 + uint64_t(i) * 8)); }
+
+    uint32_t itemCount(uint64_t off) const {
+        uint32_t n = u32At(off);
+        return off + 4 + uint64_t(n) * SNAP_ITEM_SIZE <= len ? n : 0;
+    }
+    void item(uint64_t off, uint32_t i, uint32_t &text, long long &cents, int64_t &when) const {
+        const char *p = base + off + 4 + uint64_t(i) * SNAP_ITEM_SIZE;
+        memcpy(&text, p, 4);
+        memcpy(&cents, p + 4, 8);
+        memcpy(&when, p + 12, 8);
+    }
+
+    size_t textCount() const { return hdr.textCount; }
+    string_view text(uint32_t i) const { return str(u64At(hdr.textOffset + uint64_t(i) * 8)); }
+
+    ByteReader users() const { return ByteReader(base + hdr.usersOffset, hdr.usersSize); }
+    ByteReader ledger() const { return ByteReader(base + hdr.ledgerOffset, hdr.ledgerSize); } // empty before version 3
+
+    // Archived (discharged) patients, by index into the archive
+    size_t archivedCount() const { return hdr.archiveCount; }
+    SnapArchived archivedEntry(size_t i) const {
+        SnapArchived e;
+        memcpy(&e, base + hdr.archiveOffset + i * sizeof(SnapArchived), sizeof e);
+        return e;
+    }
+    long findArchived(int id) const {
+        size_t lo = 0, hi = archivedCount();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (archivedEntry(mid).id < id) lo = mid + 1;
+            else hi = mid;
+        }
+        return (lo < archivedCount() && archivedEntry(lo).id == id) ? static_cast<long>(lo) : -1;
+    }
+    // The compressed bytes, empty if out of range or damaged
+    string_view archivedBlob(const SnapArchived &e) const {
+        if (e.blob > len || e.size > len - e.blob) return {};
+        string_view blob(base + e.blob, e.size);
+        return crc32(blob.data(), blob.size()) == e.crc ? blob : string_view{};
+    }
+    bool archived(size_t i, ArchivedPatient &a) const {
+        SnapArchived e = archivedEntry(i);
+        string_view blob = archivedBlob(e);
+        string raw;
+        if (blob.empty() || !lzDecompress(blob, e.rawSize, raw)) return false;
+        ByteReader r(raw.data(), raw.size());
+        return decodeArchived(r, a) && a.id == e.id;
+    }
+
+private:
+    SnapshotView(const char *b, size_t n) : base(b), len(n) {
+        memcpy(&hdr, b, snapHeaderSize(2));
+        size_t have = min(snapHeaderSize(hdr.version), n);
+        memcpy(&hdr, b, have);
+        memset(reinterpret_cast<char*>(&hdr) + have, 0, sizeof hdr - have);
+    }
+
+    bool validate() const {
+        if (hdr.magic != SNAPSHOT_MAGIC || hdr.version < 2 || hdr.version > SNAPSHOT_VERSION) return false;
+        SnapHeader h = hdr;
+        h.headerCrc = 0;
+        if (crc32(reinterpret_cast<const char*>(&h), snapHeaderSize(hdr.version)) != hdr.headerCrc || hdr.fileSize != len)
+            return false;
+        if (hdr.recordsOffset + uint64_t(hdr.patientCount) * sizeof(SnapPatient) > len ||
+            hdr.usersOffset + hdr.usersSize > len || hdr.textOffset + uint64_t(hdr.textCount) * 8 > len ||
+            hdr.ledgerOffset + hdr.ledgerSize > len ||
+            hdr.archiveOffset + uint64_t(hdr.archiveCount) * sizeof(SnapArchived) > len)
+            return false;
+        return crc32(base + hdr.usersOffset, hdr.usersSize) == hdr.usersCrc &&
+               crc32(base + hdr.ledgerOffset, hdr.ledgerSize) == hdr.ledgerCrc;
+    }
+
+    int32_t recordId(size_t i) const {
+        int32_t id;
+        memcpy(&id, base + hdr.recordsOffset + i * sizeof(SnapPatient), 4);
+        return id;
+    }
+    uint32_t u32At(uint64_t off) const {
+        uint32_t v = 0;
+        if (off + 4 <= len) memcpy(&v, base + off, 4);
+        return v;
+    }
+    uint64_t u64At(uint64_t off) const {
+        uint64_t v = 0;
+        if (off + 8 <= len) memcpy(&v, base + off, 8);
+        return v;
+    }
+
+    const char *base;
+    size_t len;
+    SnapHeader hdr;
+};
+
+// Streams a version-4 snapshot to a file descriptor. The heap is written as
+// patients are added; only the fixed-width record table is held in memory
+// until finish() appends it and writes the header.
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(int fd_) : fd(fd_) {
+        SnapHeader blank{};
+        buf.raw(&blank, sizeof blank);
+    }
+
+    void addUser(const string &username, const string &password, Role role) {
+        users.str(username);
+        users.str(password);
+        users.u8(static_cast<uint8_t>(role));
+        ++userCount;
+    }
+
+    // Section written by DispensingLedger::encode
+    ByteWriter &ledger() { return ledgerSection; }
+
+    void addPatient(const Patient &p) {
+        SnapPatient r{};
+        r.id = p.getId();
+        r.age = p.getAge();
+        r.name = putString(p.getName());
+        r.gender = putString(p.getGender());
+        r.symptoms = putString(p.getSymptoms());
+        r.admissionDate = putString(p.getAdmissionDate());
+        r.diagnoses = putList(p.getDiagnoses());
+        r.medicalNotes = putList(p.getMedicalNotes());
+        r.prescriptions = putList(p.getPrescriptions());
+        const Bill &b = p.getBill();
+        r.charges = putItems(b.getCharges().size(), [&](size_t i, uint32_t &t, long long &c, int64_t &w) {
+            t = b.getCharges().textId[i]; c = b.getCharges().cents[i]; w = b.getCharges().when[i];
+        });
+        r.payments = putItems(b.getPayments().size(), [&](size_t i, uint32_t &t, long long &c, int64_t &w) {
+            t = b.getPayments().textId[i]; c = b.getPayments().cents[i]; w = b.getPayments().when[i];
+        });
+        r.chargesCents = b.totalChargesCents();
+        r.paymentsCents = b.totalPaymentsCents();
+        r.status = static_cast<uint32_t>(b.getStatus());
+        records.push_back(r);
+    }
+
+    // Copies a record that was never loaded out of the previous snapshot.
+    // textIds maps that snapshot's bill text ids to billText() ids.
+    void copyPatient(const SnapshotView &v, size_t rec, const vector<uint32_t> &textIds) {
+        SnapPatient src = v.record(rec);
+        SnapPatient r = src;
+        r.name = putString(v.str(src.name));
+        r.gender = putString(v.str(src.gender));
+        r.symptoms = putString(v.str(src.symptoms));
+        r.admissionDate = putString(v.str(src.admissionDate));
+        r.diagnoses = copyList(v, src.diagnoses);
+        r.medicalNotes = copyList(v, src.medicalNotes);
+        r.prescriptions = copyList(v, src.prescriptions);
+        for (uint64_t SnapPatient::*field : {&SnapPatient::charges, &SnapPatient::payments}) {
+            uint64_t block = src.*field;
+            r.*field = putItems(v.itemCount(block), [&](size_t i, uint32_t &t, long long &c, int64_t &w) {
+                v.item(block, static_cast<uint32_t>(i), t, c, w);
+                t = t < textIds.size() ? textIds[t] : 0;
+            });
+        }
+        records.push_back(r);
+    }
+
+    // Discharged patients go to the archive, compressed; copyArchived keeps
+    // the previous snapshot's blob as it is
+    void addArchived(const Patient &p) {
+        ByteWriter raw;
+        encodeArchived(raw, p);
+        string packed = lzCompress(string_view(raw.data(), raw.size()));
+        putArchived(p.getId(), raw.size(), packed);
+    }
+
+    void copyArchived(const SnapshotView &v, size_t i) {
+        SnapArchived e = v.archivedEntry(i);
+        putArchived(e.id, e.rawSize, v.archivedBlob(e));
+    }
+
+    bool finish(uint64_t epoch, int lastPatientId) {
+        const StringTable &text = billText();
+        vector<uint64_t> textOffsets;
+        textOffsets.reserve(text.size());
+        for (uint32_t i = 0; i < text.size(); ++i) textOffsets.push_back(putString(text.lookup(i)));
+
+        SnapHeader h{};
+        h.magic = SNAPSHOT_MAGIC;
+        h.version = SNAPSHOT_VERSION;
+        h.epoch = epoch;
+        h.lastPatientId = lastPatientId;
+        h.patientCount = static_cast<uint32_t>(records.size());
+        ByteWriter usersSection;
+        usersSection.u32(userCount);
+        usersSection.raw(users.data(), users.size());
+        h.usersOffset = offset;
+        h.usersSize = usersSection.size();
+        h.usersCrc = crc32(usersSection.data(), usersSection.size());
+        put(usersSection.data(), usersSection.size());
+        h.textOffset = offset;
+        h.textCount = static_cast<uint32_t>(textOffsets.size());
+        put(textOffsets.data(), textOffsets.size() * 8);
+        h.ledgerOffset = offset;
+        h.ledgerSize = ledgerSection.size();
+        h.ledgerCrc = crc32(ledgerSection.data(), ledgerSection.size());
+        put(ledgerSection.data(), ledgerSection.size());
+        pad8();
+        h.recordsOffset = offset;
+        put(records.data(), records.size() * sizeof(SnapPatient));
+        h.archiveOffset = offset;
+        h.archiveCount = static_cast<uint32_t>(archive.size());
+        put(archive.data(), archive.size() * sizeof(SnapArchived));
+        h.fileSize = offset;
+        if (!flush()) return false;
+        h.headerCrc = crc32(reinterpret_cast<const char*>(&h), sizeof h);
+        return ::pwrite(fd, &h, sizeof h, 0) == static_cast<ssize_t>(sizeof h) && ok;
+    }
+
+private:
+    void putArchived(int id, size_t rawSize, string_view blob) {
+        SnapArchived e{id, static_cast<uint32_t>(rawSize), offset, static_cast<uint32_t>(blob.size()),
+                       crc32(blob.data(), blob.size())};
+        put(blob.data(), blob.size());
+        archive.push_back(e);
+    }
+
+    uint64_t putString(string_view s) {
+        uint64_t at = offset;
+        uint32_t n = static_cast<uint32_t>(s.size());
+        put(&n, 4);
+        put(s.data(), s.size());
+        return at;
+    }
+
+    uint64_t putList(const vector<string> &list) {
+        vector<uint64_t> offs;
+        offs.reserve(list.size());
+        for (auto &s : list) offs.push_back(putString(s));
+        return putOffsets(offs);
+    }
+
+    uint64_t copyList(const SnapshotView &v, uint64_t block) {
+        uint32_t n = v.listSize(block);
+        vector<uint64_t> offs;
+        offs.reserve(n);
+        for (uint32_t i = 0; i < n; ++i) offs.push_back(putString(v.listItem(block, i)));
+        return putOffsets(offs);
+    }
+
+    uint64_t putOffsets(const vector<uint64_t> &offs) {
+        uint64_t at = offset;
+        uint32_t n = static_cast<uint32_t>(offs.size());
+        put(&n, 4);
+        put(offs.data(), offs.size() * 8);
+        return at;
+    }
+
+    template <typename Get>
+    uint64_t putItems(size_t n, Get &&get) {
+        uint64_t at = offset;
+        uint32_t count = static_cast<uint32_t>(n);
+        put(&count, 4);
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t t; long long c; int64_t w;
+            get(i, t, c, w);
+            put(&t, 4);
+            put(&c, 8);
+            put(&w, 8);
+        }
+        return at;
+    }
+
+    void put(const void *p, size_t n) {
+        buf.raw(p, n);
+        offset += n;
+        if (buf.size() >= (1u << 20)) flush();
+    }
+
+    void pad8() {
+        static const char zeros[8] = {};
+        if (offset % 8) put(zeros, 8 - offset % 8);
+    }
+
+    bool flush() {
+        const char *p = buf.data();
+        size_t n = buf.size();
+        while (ok && n > 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0) { if (errno == EINTR) continue; ok = false; break; }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        buf.clear();
+        return ok;
+    }
+
+    int fd;
+    ByteWriter buf;
+    uint64_t offset = sizeof(SnapHeader);
+    ByteWriter users;
+    uint32_t userCount = 0;
+    ByteWriter ledgerSection;
+    vector<SnapPatient> records;
+    vector<SnapArchived> archive;
+    bool ok = true;
+};
+
+// Owns the files in the data directory:
+//   snapshot.bin - version-4 snapshot (see SnapHeader), mapped at startup
+//   wal.log      - header {magic, epoch} + records {size, crc, payload}
+// The log's epoch must match the snapshot's; a log from an older epoch is
+// already contained in the snapshot and is discarded.
+class DurableStore {
+public:
+    explicit DurableStore(const string &dir_, size_t compactEvery_ = 10000)
+        : dir(dir_), compactEvery(compactEvery_) {}
+    ~DurableStore() {
+        if (walFd >= 0) ::close(walFd);
+        if (readFd >= 0) ::close(readFd);
+    }
+    DurableStore(const DurableStore&) = delete;
+    DurableStore &operator=(const DurableStore&) = delete;
+
+    bool open() {
+        if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Storage: cannot create " << dir << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Maps the latest snapshot; records are read in place on demand. view is
+    // left null if there is no snapshot yet (fresh data directory). False if
+    // snapshot.bin exists but does not validate: nothing may be written over it.
+    bool mapSnapshot(shared_ptr<SnapshotView> &view) {
+        view = SnapshotView::open(path(SNAPSHOT));
+        if (view) {
+            epoch = view->epoch();
+            return true;
+        }
+        struct stat st;
+        if (::stat(path(SNAPSHOT).c_str(), &st) != 0 && errno == ENOENT) return true;
+        cerr << "Storage: " << path(SNAPSHOT) << " cannot be read; leaving " << dir << " untouched\n";
+        return false;
+    }
+
+    // Calls apply(ByteReader&) for every intact record logged since the loaded
+    // snapshot, truncates a torn tail left by a crash, and opens the log for appends.
+    // A fresh log is only started in an empty directory, or over a log the
+    // snapshot already contains (a crash right after a checkpoint). Any other
+    // mismatch returns false with both files left as they are.
+    template <typename Apply>
+    bool replayLog(Apply &&apply) {
+        vector<char> file;
+        if (!readWholeFile(path(WAL), file)) {
+            struct stat st;
+            bool missing = ::stat(path(WAL).c_str(), &st) != 0 && errno == ENOENT;
+            if (missing && epoch == 0 && ::stat(path(SNAPSHOT).c_str(), &st) != 0) return startLog(0);
+            cerr << "Storage: " << path(WAL) << (missing ? " is missing" : " cannot be read")
+                 << "; leaving " << dir << " untouched\n";
+            return false;
+        }
+        ByteReader h(file.data(), file.size());
+        uint64_t magic = h.u64(), logEpoch = h.u64();
+        if (file.size() < WAL_HEADER || magic != WAL_MAGIC) {
+            cerr << "Storage: " << path(WAL) << " has no valid header; leaving " << dir << " untouched\n";
+            return false;
+        }
+        if (logEpoch + 1 == epoch) return startLog(epoch);
+        if (logEpoch != epoch) {
+            cerr << "Storage: " << path(WAL) << " is from epoch " << logEpoch << " but the snapshot is from "
+                 << epoch << "; leaving " << dir << " untouched\n";
+            return false;
+        }
+        size_t good = WAL_HEADER, count = 0;
+        while (file.size() - good >= 8) {
+            ByteReader f(file.data() + good, 8);
+            uint32_t len = f.u32(), crc = f.u32();
+            if (file.size() - good - 8 < len) break;
+            const char *payload = file.data() + good + 8;
+            if (crc32(payload, len) != crc) break;
+            ByteReader r(payload, len);
+            apply(r);
+            good += 8 + len;
+            ++count;
+        }
+        pending = count;
+        if (good < file.size()) {
+            cerr << "Storage: discarding " << (file.size() - good) << " bytes of torn log tail\n";
+            if (::truncate(path(WAL).c_str(), static_cast<off_t>(good)) != 0)
+                cerr << "Storage: truncate failed: " << strerror(errno) << "\n";
+        }
+        walFd = ::open(path(WAL).c_str(), O_WRONLY | O_APPEND);
+        if (walFd < 0) {
+            cerr << "Storage: cannot open log: " << strerror(errno) << "\n";
+            return false;
+        }
+        walEnd = good;
+        return true;
+    }
+
+    // Safe to call from concurrent sessions; records are framed and written
+    // whole. False if the record is not in the log: a failed write or sync
+    // is cut back off the log, so later records never follow a torn frame,
+    // and every append fails from then on until a checkpoint starts a new log.
+    bool append(const ByteWriter &rec) {
+        lock_guard<mutex> lock(appendMtx);
+        if (walFd < 0 || logFailed) return false;
+        frame.clear();
+        frame.u32(static_cast<uint32_t>(rec.size()));
+        frame.u32(crc32(rec.data(), rec.size()));
+        frame.raw(rec.data(), rec.size());
+        if (!writeAll(walFd, frame.data(), frame.size()) || (syncWrites && ::fdatasync(walFd) != 0)) {
+            cerr << "Storage: log write failed: " << strerror(errno) << "\n";
+            if (::ftruncate(walFd, static_cast<off_t>(walEnd)) != 0)
+                cerr << "Storage: cannot cut back the log: " << strerror(errno) << "\n";
+            logFailed = true;
+            return false;
+        }
+        walEnd += frame.size();
+        ++pending;
+        return true;
+    }
+
+    // An append has failed; nothing more is logged until the next snapshot
+    bool failed() const { return logFailed; }
+
+    // After a failed snapshot the next attempt waits for another compactEvery
+    // records, rather than rewriting everything on each append (e.g. ENOSPC)
+    bool shouldCompact() const { return pending >= max(compactEvery, retryAt.load()); }
+    // Before any concurrent use
+    void setCompactEvery(size_t records) { compactEvery = records; }
+
+    // Atomically replaces the snapshot with whatever fill(SnapshotWriter&)
+    // adds and starts an empty log for the next epoch. Crash-safe: the next
+    // startup sees either the old snapshot+log or the new snapshot.
+    template <typename Fill>
+    bool writeSnapshot(Fill &&fill, int lastPatientId) {
+        uint64_t next = epoch + 1;
+        string tmp = path(SNAPSHOT) + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0;
+        if (ok) {
+            SnapshotWriter w(fd);
+            fill(w);
+            ok = w.finish(next, lastPatientId) && ::fsync(fd) == 0;
+        }
+        if (fd >= 0) ::close(fd);
+        if (!ok || ::rename(tmp.c_str(), path(SNAPSHOT).c_str()) != 0) {
+            cerr << "Storage: snapshot failed: " << strerror(errno) << "\n";
+            ::unlink(tmp.c_str());
+            retryAt = pending + compactEvery;
+            return false;
+        }
+        syncDir();
+        epoch = next;
+        pending = 0;
+        retryAt = 0;
+        return startLog(next);
+    }
+
+    // With sync off, appends only reach the page cache until the next sync()
+    void setSyncWrites(bool on) {
+        lock_guard<mutex> lock(appendMtx);
+        syncWrites = on;
+    }
+
+    void sync() {
+        lock_guard<mutex> lock(appendMtx);
+        if (walFd >= 0 && ::fdatasync(walFd) != 0)
+            cerr << "Storage: log sync failed: " << strerror(errno) << "\n";
+    }
+
+    // Replica side: follows the log of a primary working in dir, without
+    // writing anything there. Opens the current log and maps the snapshot
+    // it continues into view. False if there is no log yet, or the primary
+    // is between writing a snapshot and starting its log (try again).
+    bool followLog(shared_ptr<SnapshotView> &view) {
+        uint64_t logEpoch;
+        if (!openFollowed(logEpoch)) return false;
+        view = SnapshotView::open(path(SNAPSHOT));
+        if ((view ? view->epoch() : 0) != logEpoch) {
+            view.reset();
+            return false;
+        }
+        epoch = followedEpoch = logEpoch;
+        return true;
+    }
+
+    // Calls apply(ByteReader&) for each record the primary has appended
+    // since the last call. A record still being written is left for the
+    // next call. Returns the number applied.
+    template <typename Apply>
+    size_t tailLog(Apply &&apply) {
+        struct stat st;
+        if (readFd < 0 || damaged || ::fstat(readFd, &st) != 0) return 0;
+        size_t end = static_cast<size_t>(st.st_size), readTo = tailPos + tailBuf.size();
+        if (end < readTo) { // the primary cut its log back (crash recovery): our place is gone
+            damaged = true;
+            return 0;
+        }
+        size_t had = tailBuf.size();
+        tailBuf.resize(had + (end - readTo));
+        for (size_t got = had; got < tailBuf.size();) {
+            ssize_t r = ::pread(readFd, tailBuf.data() + got, tailBuf.size() - got, static_cast<off_t>(readTo + got - had));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { tailBuf.resize(got); break; }
+            got += static_cast<size_t>(r);
+        }
+        size_t used = 0, count = 0;
+        while (tailBuf.size() - used >= 8) {
+            ByteReader f(tailBuf.data() + used, 8);
+            uint32_t len = f.u32(), crc = f.u32();
+            if (tailBuf.size() - used - 8 < len) break;
+            const char *payload = tailBuf.data() + used + 8;
+            if (crc32(payload, len) != crc) {
+                damaged = true;
+                break;
+            }
+            ByteReader r(payload, len);
+            apply(r);
+            used += 8 + len;
+            ++count;
+        }
+        tailBuf.erase(tailBuf.begin(), tailBuf.begin() + static_cast<ptrdiff_t>(used));
+        tailPos += used;
+        return count;
+    }
+
+    // Log bytes not yet applied (a partial record) as of the last tailLog
+    size_t tailPending() const { return tailBuf.size(); }
+    // A record failed its check or the log shrank; nothing more is applied
+    bool tailDamaged() const { return damaged; }
+
+    // True once the primary has started a newer log. The followed one is
+    // complete then, since checkpoints run with no mutation in flight.
+    bool logRotated() const {
+        struct stat followed, current;
+        return readFd >= 0 && ::fstat(readFd, &followed) == 0 && ::stat(path(WAL).c_str(), &current) == 0 &&
+               (followed.st_ino != current.st_ino || followed.st_dev != current.st_dev);
+    }
+
+    // Moves on to the primary's newer log, after the old one has been
+    // tailed to its end. view is set to the snapshot the new log continues,
+    // or left null if the primary has checkpointed again since (the old
+    // mapping stays valid, and the log still applies on top of it). False
+    // if a whole log was missed: the replica cannot catch up then.
+    bool followNextLog(shared_ptr<SnapshotView> &view) {
+        uint64_t logEpoch;
+        if (!openFollowed(logEpoch) || logEpoch != followedEpoch + 1) {
+            damaged = true;
+            return false;
+        }
+        followedEpoch = logEpoch;
+        view = SnapshotView::open(path(SNAPSHOT));
+        if (view && view->epoch() == logEpoch) epoch = logEpoch;
+        else view.reset();
+        return true;
+    }
+
+private:
+    bool openFollowed(uint64_t &logEpoch) {
+        if (readFd >= 0) ::close(readFd);
+        readFd = ::open(path(WAL).c_str(), O_RDONLY);
+        char header[WAL_HEADER];
+        if (readFd < 0 || ::pread(readFd, header, WAL_HEADER, 0) != static_cast<ssize_t>(WAL_HEADER)) return false;
+        ByteReader h(header, WAL_HEADER);
+        if (h.u64() != WAL_MAGIC) return false;
+        logEpoch = h.u64();
+        tailPos = WAL_HEADER;
+        tailBuf.clear();
+        return true;
+    }
+
+    static constexpr const char *SNAPSHOT = "snapshot.bin";
+    static constexpr const char *WAL = "wal.log";
+    static constexpr uint64_t WAL_MAGIC = 0x314C4157534D48ull;      // "HMSWAL1"
+    static constexpr size_t WAL_HEADER = 16;
+
+    string path(const char *name) const { return dir + "/" + name; }
+
+    bool startLog(uint64_t ep) {
+        if (walFd >= 0) ::close(walFd);
+        ByteWriter header;
+        header.u64(WAL_MAGIC);
+        header.u64(ep);
+        string tmp = path(WAL) + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && writeAll(fd, header.data(), header.size()) && ::fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+        if (!ok || ::rename(tmp.c_str(), path(WAL).c_str()) != 0) {
+            cerr << "Storage: cannot start log: " << strerror(errno) << "\n";
+            walFd = -1;
+            return false;
+        }
+        syncDir();
+        walFd = ::open(path(WAL).c_str(), O_WRONLY | O_APPEND);
+        walEnd = WAL_HEADER;
+        logFailed = walFd < 0;
+        return walFd >= 0;
+    }
+
+    void syncDir() {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) { ::fsync(fd); ::close(fd); }
+    }
+
+    static bool writeAll(int fd, const char *p, size_t n) {
+        while (n > 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0) { if (errno == EINTR) continue; return false; }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        return true;
+    }
+
+    static bool readWholeFile(const string &file, vector<char> &out) {
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0;
+        if (ok) {
+            out.resize(static_cast<size_t>(st.st_size));
+            size_t got = 0;
+            while (ok && got < out.size()) {
+                ssize_t r = ::read(fd, out.data() + got, out.size() - got);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) ok = false;
+                else got += static_cast<size_t>(r);
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    string dir;
+    size_t compactEvery;
+    uint64_t epoch = 0;
+    int walFd = -1;
+    size_t walEnd = 0;  // length of the log's intact records, under appendMtx
+    atomic<bool> logFailed{false};
+    atomic<size_t> pending{0}; // records appended since the last snapshot
+    atomic<size_t> retryAt{0}; // pending count for the next attempt after a failed one
+    mutex appendMtx;
+    bool syncWrites = true;
+    ByteWriter frame; // reused by append, under appendMtx
+
+    // Replica side, used by one follower thread only
+    int readFd = -1;
+    uint64_t followedEpoch = 0;
+    size_t tailPos = 0;    // file offset just past the last applied record
+    vector<char> tailBuf;  // read but not yet applied
+    bool damaged = false;
+};
+
+// ---------------------------------------------------------------------------
+// Audit trail: who changed which record, when. Every clinical, billing and
+// account mutation appends an event to audit.log in the data directory, one
+// tab-separated line per event:
+//   time(UTC, ms)  user  role  patient(0 = none)  action  text  amount
+// Sessions push events onto a lock-free queue and return; a background
+// writer drains it, writes each batch at once and syncs the file once per
+// batch (group commit), so a mutation pays for a push, not a disk write.
+// Events still queued when the process dies are lost; the WAL remains the
+// record of the data itself.
+// ---------------------------------------------------------------------------
+enum class AuditAction : uint8_t {
+    REGISTER_PATIENT, ADD_DIAGNOSIS, ADD_NOTE, ADD_PRESCRIPTION, ADD_CHARGE, ADD_PAYMENT,
+    SET_BILL_STATUS, ADD_USER, DELETE_USER, CHANGE_PASSWORD, DISPENSE, DISCHARGE
+};
+
+const char *auditActionName(AuditAction a) {
+    static const char *const names[] = {"register_patient", "add_diagnosis", "add_note", "add_prescription",
+                                        "add_charge", "add_payment", "set_bill_status", "add_user",
+                                        "delete_user", "change_password", "dispense", "discharge"};
+    return names[static_cast<size_t>(a)];
+}
+
+// Name recorded for a change made by actor (a session's logged-in user)
+string_view actorName(const User *actor) { return actor ? string_view(actor->getUsername()) : "(system)"; }
+
+struct AuditEvent {
+    atomic<AuditEvent*> next{nullptr};
+    int64_t timeMs = 0;
+    const User *actor = nullptr; // null for batch imports and other non-session callers
+    int patientId = 0;
+    AuditAction action = AuditAction::REGISTER_PATIENT;
+    string text;
+    long long cents = 0;
+};
+
+// Multi-producer, single-consumer queue (Vyukov's intrusive list): a push is
+// one exchange and one store, and never waits for another producer or the
+// consumer. The list always holds a stub node, so it is never empty.
+class AuditQueue {
+public:
+    AuditQueue() : head(&stub), tail(&stub) {}
+    ~AuditQueue() {
+        while (AuditEvent *e = pop()) delete e;
+    }
+
+    void push(AuditEvent *e) {
+        e->next.store(nullptr, memory_order_relaxed);
+        AuditEvent *prev = head.exchange(e, memory_order_acq_rel);
+        prev->next.store(e, memory_order_release);
+    }
+
+    // Consumer only. Null when empty, or when a push is halfway through (its
+    // event then shows up on a later call).
+    AuditEvent *pop() {
+        AuditEvent *t = tail;
+        AuditEvent *next = t->next.load(memory_order_acquire);
+        if (t == &stub) {
+            if (!next) return nullptr;
+            tail = next;
+            t = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return t;
+        }
+        if (t != head.load(memory_order_acquire)) return nullptr;
+        push(&stub);
+        next = t->next.load(memory_order_acquire);
+        if (!next) return nullptr;
+        tail = next;
+        return t;
+    }
+
+    bool empty() const {
+        return tail->next.load(memory_order_acquire) == nullptr && tail == head.load(memory_order_acquire);
+    }
+
+private:
+    AuditEvent stub;
+    atomic<AuditEvent*> head; // producers push here
+    AuditEvent *tail;         // consumer pops here
+};
+
+class AuditLog {
+public:
+    explicit AuditLog(const string &file) {
+        fd = ::open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            cerr << "Audit: cannot open " << file << ": " << strerror(errno) << "\n";
+            return;
+        }
+        writer = thread([this] { writeLoop(); });
+    }
+    ~AuditLog() {
+        stopping.store(true);
+        {
+            lock_guard<mutex> lock(mtx);
+            wakeup.notify_one();
+        }
+        if (writer.joinable()) writer.join();
+        if (fd >= 0) ::close(fd);
+    }
+    AuditLog(const AuditLog&) = delete;
+    AuditLog &operator=(const AuditLog&) = delete;
+
+    void record(const User *actor, AuditAction action, int patientId, string_view text = {}, long long cents = 0) {
+        if (fd < 0) return;
+        auto *e = new AuditEvent;
+        e->timeMs = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        e->actor = actor;
+        e->patientId = patientId;
+        e->action = action;
+        e->text = text;
+        e->cents = cents;
+        queue.push(e);
+        wake();
+    }
+
+    // Blocks until everything recorded so far is written and synced
+    void flush() {
+        if (fd < 0) return;
+        unique_lock<mutex> lock(mtx);
+        uint64_t target = recorded.load();
+        wakeup.notify_one();
+        synced.wait(lock, [&] { return durable >= target; });
+    }
+
+private:
+    // Producers only take the mutex when the writer is asleep. The writer
+    // sets idle before its final emptiness check and a producer reads it
+    // after its push, so one of them always sees the other.
+    void wake() {
+        recorded.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (idle.load()) {
+            lock_guard<mutex> lock(mtx);
+            wakeup.notify_one();
+        }
+    }
+
+    void writeLoop() {
+        string batch;
+        uint64_t taken = 0;
+        while (true) {
+            batch.clear();
+            size_t events = 0;
+            while (AuditEvent *e = queue.pop()) {
+                format(*e, batch);
+                delete e;
+                ++events;
+            }
+            if (events > 0) {
+                if (!writeAll(batch) || ::fdatasync(fd) != 0)
+                    cerr << "Audit: write failed: " << strerror(errno) << "\n";
+                taken += events;
+                HMS_COUNT(Counter::AUDIT_EVENTS, events);
+                HMS_COUNT(Counter::AUDIT_SYNCS, 1);
+            }
+            unique_lock<mutex> lock(mtx);
+            durable = taken;
+            synced.notify_all();
+            idle.store(true);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (queue.empty()) {
+                if (stopping.load()) break;
+                wakeup.wait_for(lock, chrono::milliseconds(200));
+            }
+            idle.store(false);
+        }
+    }
+
+    static void format(const AuditEvent &e, string &out) {
+        time_t secs = static_cast<time_t>(e.timeMs / 1000);
+        tm utc;
+        gmtime_r(&secs, &utc);
+        char stamp[80];
+        snprintf(stamp, sizeof stamp, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", utc.tm_year + 1900, utc.tm_mon + 1,
+                 utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, static_cast<int>(e.timeMs % 1000));
+        out += stamp;
+        out += '\t';
+        out += actorName(e.actor);
+        out += '\t';
+        out += e.actor ? roleToString(e.actor->getRole()) : "-";
+        out += '\t';
+        out += to_string(e.patientId);
+        out += '\t';
+        out += auditActionName(e.action);
+        out += '\t';
+        for (char c : e.text) { // keep one event per line
+            if (c == '\t') out += "\\t";
+            else if (c == '\n') out += "\\n";
+            else if (c == '\r') out += "\\r";
+            else if (c == '\\') out += "\\\\";
+            else out += c;
+        }
+        out += '\t';
+        if (e.cents) out += formatCents(e.cents);
+        out += '\n';
+    }
+
+    bool writeAll(const string &data) {
+        const char *p = data.data();
+        size_t n = data.size();
+        while (n > 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0) { if (errno == EINTR) continue; return false; }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        return true;
+    }
+
+    int fd = -1;
+    AuditQueue queue;
+    atomic<uint64_t> recorded{0}; // events pushed
+    uint64_t durable = 0;         // events written and synced, under mtx
+    atomic<bool> idle{false};
+    atomic<bool> stopping{false};
+    mutex mtx;
+    condition_variable wakeup, synced;
+    thread writer;
+};
+
+// Registration-time fields of a patient, viewed in place (resident record or
+// snapshot mapping). Valid while the system and the snapshot view are alive.
+struct BasicFields {
+    int id = 0;
+    int age = 0;
+    string_view name, gender, symptoms, admissionDate;
+};
+
+// Secondary indexes for finding patients without knowing their ID:
+//  - name tokens, lower-cased, in a sorted map for case-insensitive prefix search
+//  - admission date strings in a sorted map for range queries
+//  - symptom word postings (sorted patient IDs) for AND queries
+// Each query predicate yields a sorted ID list and the lists are intersected.
+class PatientSearchIndex {
+public:
+    struct Query {
+        string name;        // words, each a prefix of some name word
+        string dateFrom;    // inclusive, empty = unbounded
+        string dateTo;      // inclusive, empty = unbounded
+        string symptoms;    // words that must all appear
+    };
+
+    // firstId is the ID before a facility's first patient (see FACILITY_ID_SPAN)
+    explicit PatientSearchIndex(int firstId = 0) : idBase(firstId) {}
+
+    static vector<string> tokens(string_view text) {
+        vector<string> out;
+        string cur;
+        for (char ch : text) {
+            unsigned char c = static_cast<unsigned char>(ch);
+            if (isalnum(c)) cur += static_cast<char>(tolower(c));
+            else if (!cur.empty()) out.push_back(move(cur)), cur.clear();
+        }
+        if (!cur.empty()) out.push_back(move(cur));
+        return out;
+    }
+
+    // Ignores patients that are already indexed, so a build racing with
+    // registrations cannot add anyone twice
+    void add(const BasicFields &f) {
+        if (f.id <= idBase) return;
+        size_t id = static_cast<size_t>(f.id - idBase);
+        if (indexed.size() <= id) indexed.resize(id + 1, false);
+        if (indexed[id]) return;
+        indexed[id] = true;
+        for (auto &t : tokens(f.name)) nameTokens.emplace(move(t), f.id);
+        byDate.emplace(string(f.admissionDate), f.id);
+        vector<string> words = tokens(f.symptoms);
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+        for (auto &w : words) {
+            vector<int> &post = symptomPostings[w];
+            post.insert(upper_bound(post.begin(), post.end(), f.id), f.id);
+        }
+    }
+
+    vector<int> search(const Query &q) const {
+        vector<int> result;
+        bool constrained = false;
+        auto narrow = [&](vector<int> ids) {
+            sort(ids.begin(), ids.end());
+            ids.erase(unique(ids.begin(), ids.end()), ids.end());
+            if (!constrained) result = move(ids);
+            else {
+                vector<int> both;
+                set_intersection(result.begin(), result.end(), ids.begin(), ids.end(), back_inserter(both));
+                result = move(both);
+            }
+            constrained = true;
+        };
+        for (auto &prefix : tokens(q.name)) {
+            vector<int> ids;
+            for (auto it = nameTokens.lower_bound(prefix);
+                 it != nameTokens.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+                ids.push_back(it->second);
+            narrow(move(ids));
+        }
+        if (!q.dateFrom.empty() || !q.dateTo.empty()) {
+            auto lo = q.dateFrom.empty() ? byDate.begin() : byDate.lower_bound(q.dateFrom);
+            auto hi = q.dateTo.empty() ? byDate.end() : byDate.upper_bound(q.dateTo);
+            vector<int> ids;
+            for (auto it = lo; it != hi && it != byDate.end(); ++it) ids.push_back(it->second);
+            narrow(move(ids));
+        }
+        for (auto &w : tokens(q.symptoms)) {
+            auto it = symptomPostings.find(w);
+            narrow(it == symptomPostings.end() ? vector<int>{} : it->second);
+        }
+        return result;
+    }
+
+private:
+    multimap<string, int> nameTokens;
+    multimap<string, int> byDate;
+    unordered_map<string, vector<int>> symptomPostings;
+    int idBase;
+    vector<bool> indexed; // by patient ID - idBase
+};
+
+enum class ClinicalField : uint8_t { DIAGNOSIS, NOTE, PRESCRIPTION };
+
+// Full-text index over diagnoses, medical notes and prescriptions. Every
+// entry is one document; each term keeps its postings in a single byte
+// string of varints:
+//   doc delta, position count, position deltas...
+// Documents are numbered in the order they are added, so postings only ever
+// grow at the end and the deltas stay small.
+//
+// Queries: words are ANDed, "quoted words" must appear consecutively, a
+// leading '-' excludes a word or phrase, and OR separates alternatives:
+//   amoxicillin -allergy
+//   "chest pain" OR angina
+class ClinicalTextIndex {
+public:
+    static constexpr unsigned ALL_FIELDS = 7;
+    static unsigned fieldBit(ClinicalField f) { return 1u << static_cast<unsigned>(f); }
+
+    void add(int patientId, ClinicalField field, string_view text) {
+        vector<string> words = PatientSearchIndex::tokens(text);
+        if (words.empty()) return;
+        uint32_t doc = static_cast<uint32_t>(docs.size());
+        docs.push_back(Doc{patientId, field});
+        // Collect each term's positions first so a repeated word gets one posting
+        vector<pair<string, uint32_t>> occ;
+        occ.reserve(words.size());
+        for (uint32_t pos = 0; pos < words.size(); ++pos) occ.emplace_back(move(words[pos]), pos);
+        sort(occ.begin(), occ.end());
+        for (size_t i = 0; i < occ.size();) {
+            size_t j = i;
+            while (j < occ.size() && occ[j].first == occ[i].first) ++j;
+            Postings &p = terms[occ[i].first];
+            putVarint(p.bytes, p.docCount ? doc - p.lastDoc : doc);
+            putVarint(p.bytes, static_cast<uint32_t>(j - i));
+            uint32_t prev = 0;
+            for (size_t k = i; k < j; ++k) {
+                putVarint(p.bytes, occ[k].second - prev);
+                prev = occ[k].second;
+            }
+            p.lastDoc = doc;
+            ++p.docCount;
+            i = j;
+        }
+    }
+
+    // Patients whose history has been fed to the index, by facility-local ID
+    // (see HospitalSystem)
+    bool covers(int id) const { return id > 0 && static_cast<size_t>(id) < covered.size() && covered[id]; }
+    void markCovered(int id) {
+        if (id <= 0) return;
+        if (covered.size() <= static_cast<size_t>(id)) covered.resize(static_cast<size_t>(id) + 1, false);
+        covered[id] = true;
+    }
+
+    // Returns the sorted IDs of patients with a matching entry in the fields
+    vector<int> search(string_view query, unsigned fields) const {
+        vector<uint32_t> matched;
+        for (const Clause &c : parse(query)) {
+            vector<uint32_t> docsHere = evaluate(c);
+            vector<uint32_t> merged;
+            set_union(matched.begin(), matched.end(), docsHere.begin(), docsHere.end(), back_inserter(merged));
+            matched = move(merged);
+        }
+        vector<int> ids;
+        for (uint32_t d : matched)
+            if (fields & fieldBit(docs[d].field)) ids.push_back(docs[d].patientId);
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+
+private:
+    struct Doc { int patientId; ClinicalField field; };
+    struct Postings {
+        string bytes;
+        uint32_t lastDoc = 0;
+        uint32_t docCount = 0;
+    };
+    // A word is a one-word phrase
+    struct Term { vector<string> words; bool negated = false; };
+    using Clause = vector<Term>;
+
+    static void putVarint(string &out, uint32_t v) {
+        while (v >= 0x80) {
+            out += static_cast<char>((v & 0x7F) | 0x80);
+            v >>= 7;
+        }
+        out += static_cast<char>(v);
+    }
+    static uint32_t getVarint(const string &in, size_t &at) {
+        uint32_t v = 0;
+        for (int shift = 0; at < in.size(); shift += 7) {
+            unsigned char b = static_cast<unsigned char>(in[at++]);
+            v |= uint32_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+
+    static vector<Clause> parse(string_view q) {
+        vector<Clause> clauses(1);
+        size_t i = 0;
+        while (i < q.size()) {
+            if (isspace(static_cast<unsigned char>(q[i]))) { ++i; continue; }
+            bool negated = q[i] == '-';
+            if (negated) ++i;
+            string_view chunk;
+            if (i < q.size() && q[i] == '"') {
+                size_t end = q.find('"', i + 1);
+                if (end == string_view::npos) end = q.size();
+                chunk = q.substr(i + 1, end - i - 1);
+                i = end + 1;
+            } else {
+                size_t end = i;
+                while (end < q.size() && !isspace(static_cast<unsigned char>(q[end]))) ++end;
+                chunk = q.substr(i, end - i);
+                i = end;
+                if (chunk == "OR" && !negated) {
+                    if (!clauses.back().empty()) clauses.emplace_back();
+                    continue;
+                }
+            }
+            Term t{PatientSearchIndex::tokens(chunk), negated};
+            if (!t.words.empty()) clauses.back().push_back(move(t));
+        }
+        if (clauses.back().empty()) clauses.pop_back();
+        return clauses;
+    }
+
+    // Docs (sorted) containing the term; positions are decoded only for phrases
+    void decode(const string &word, vector<uint32_t> &docList, vector<vector<uint32_t>> *positions) const {
+        auto it = terms.find(word);
+        if (it == terms.end()) return;
+        const Postings &p = it->second;
+        docList.reserve(p.docCount);
+        if (positions) positions->reserve(p.docCount);
+        size_t at = 0;
+        uint32_t doc = 0;
+        for (uint32_t n = 0; n < p.docCount; ++n) {
+            doc += getVarint(p.bytes, at);
+            docList.push_back(doc);
+            uint32_t count = getVarint(p.bytes, at);
+            vector<uint32_t> pos;
+            uint32_t cur = 0;
+            for (uint32_t k = 0; k < count; ++k) {
+                cur += getVarint(p.bytes, at);
+                if (positions) pos.push_back(cur);
+            }
+            if (positions) positions->push_back(move(pos));
+        }
+    }
+
+    vector<uint32_t> matchTerm(const Term &t) const {
+        if (t.words.size() == 1) {
+            vector<uint32_t> docList;
+            decode(t.words[0], docList, nullptr);
+            return docList;
+        }
+        size_t n = t.words.size();
+        vector<vector<uint32_t>> docLists(n);
+        vector<vector<vector<uint32_t>>> posLists(n);
+        for (size_t k = 0; k < n; ++k) {
+            decode(t.words[k], docLists[k], &posLists[k]);
+            if (docLists[k].empty()) return {};
+        }
+        vector<uint32_t> result;
+        for (size_t i = 0; i < docLists[0].size(); ++i) {
+            uint32_t doc = docLists[0][i];
+            vector<const vector<uint32_t>*> pos(n);
+            pos[0] = &posLists[0][i];
+            bool inAll = true;
+            for (size_t k = 1; k < n && inAll; ++k) {
+                auto at = lower_bound(docLists[k].begin(), docLists[k].end(), doc);
+                inAll = at != docLists[k].end() && *at == doc;
+                if (inAll) pos[k] = &posLists[k][static_cast<size_t>(at - docLists[k].begin())];
+            }
+            if (!inAll) continue;
+            for (uint32_t start : *pos[0]) {
+                bool phrase = true;
+                for (size_t k = 1; k < n && phrase; ++k)
+                    phrase = binary_search(pos[k]->begin(), pos[k]->end(), start + static_cast<uint32_t>(k));
+                if (phrase) { result.push_back(doc); break; }
+            }
+        }
+        return result;
+    }
+
+    vector<uint32_t> evaluate(const Clause &c) const {
+        vector<uint32_t> result;
+        bool constrained = false;
+        for (const Term &t : c) {
+            if (t.negated) continue;
+            vector<uint32_t> hits = matchTerm(t);
+            if (!constrained) result = move(hits);
+            else {
+                vector<uint32_t> both;
+                set_intersection(result.begin(), result.end(), hits.begin(), hits.end(), back_inserter(both));
+                result = move(both);
+            }
+            constrained = true;
+        }
+        // A clause of only exclusions matches nothing rather than everything
+        if (!constrained) return {};
+        for (const Term &t : c) {
+            if (!t.negated) continue;
+            vector<uint32_t> hits = matchTerm(t), kept;
+            set_difference(result.begin(), result.end(), hits.begin(), hits.end(), back_inserter(kept));
+            result = move(kept);
+        }
+        return result;
+    }
+
+    vector<Doc> docs;
+    unordered_map<string, Postings> terms;
+    vector<bool> covered; // by patient ID
+};
+
+// Hospital-wide billing totals for the Accounts reports. Each bill change is
+// applied as a delta (old state out, new state in), so reading the totals
+// never walks the bills. Per-description and per-method sums are indexed by
+// billText() ID.
+class FinancialRollup {
+public:
+    struct BillState {
+        long long charges = 0;
+        long long payments = 0;
+        Bill::Status status = Bill::Status::PENDING;
+    };
+    static BillState stateOf(const Bill &b) { return {b.totalChargesCents(), b.totalPaymentsCents(), b.getStatus()}; }
+
+    void addBill(const BillState &b) { apply(b, 1); }
+    void changeBill(const BillState &before, const BillState &after) {
+        apply(before, -1);
+        apply(after, 1);
+    }
+    void addCharge(uint32_t textId, long long cents) { slot(byDescription, textId) += cents; }
+    void addPayment(uint32_t textId, long long cents) { slot(byMethod, textId) += cents; }
+
+    long long billedCents() const { return billed; }
+    long long collectedCents() const { return collected; }
+    long long outstandingCents() const { return outstanding; } // unpaid balances only
+    long long creditCents() const { return credit; }           // overpayments
+    long long billCount() const { return bills; }
+    long long countWithStatus(Bill::Status s) const { return statusCounts[static_cast<size_t>(s)]; }
+    const vector<long long> &revenueByDescription() const { return byDescription; }
+    const vector<long long> &collectedByMethod() const { return byMethod; }
+
+    // Patients whose bill is already counted, by facility-local ID (see
+    // HospitalSystem)
+    bool covers(int id) const { return id > 0 && static_cast<size_t>(id) < covered.size() && covered[id]; }
+    void markCovered(int id) {
+        if (id <= 0) return;
+        if (covered.size() <= static_cast<size_t>(id)) covered.resize(static_cast<size_t>(id) + 1, false);
+        covered[id] = true;
+    }
+
+private:
+    void apply(const BillState &b, int sign) {
+        billed += sign * b.charges;
+        collected += sign * b.payments;
+        long long balance = b.charges - b.payments;
+        if (balance > 0) outstanding += sign * balance;
+        else credit -= sign * balance;
+        statusCounts[static_cast<size_t>(b.status)] += sign;
+        bills += sign;
+    }
+
+    static long long &slot(vector<long long> &sums, uint32_t textId) {
+        if (sums.size() <= textId) sums.resize(textId + 1, 0);
+        return sums[textId];
+    }
+
+    long long billed = 0, collected = 0, outstanding = 0, credit = 0, bills = 0;
+    array<long long, 3> statusCounts{};
+    vector<long long> byDescription;
+    vector<long long> byMethod;
+    vector<bool> covered; // by patient ID
+};
+
+// Ad-hoc census filter; unset fields match every patient
+struct CensusFilter {
+    int minAge = 0;
+    int maxAge = numeric_limits<int>::max();
+    string gender;   // case-insensitive exact match
+    string dateFrom; // admission dates, inclusive
+    string dateTo;
+    bool owingOnly = false; // only bills with an outstanding balance
+
+    bool matches(const BasicFields &f, const FinancialRollup::BillState &b) const {
+        if (f.age < minAge || f.age > maxAge) return false;
+        if (!gender.empty() && !equalsIgnoreCase(f.gender, gender)) return false;
+        if (!dateFrom.empty() && f.admissionDate < dateFrom) return false;
+        if (!dateTo.empty() && f.admissionDate > dateTo) return false;
+        return !owingOnly || b.charges > b.payments;
+    }
+
+    static bool equalsIgnoreCase(string_view a, string_view b) {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y));
+        });
+    }
+};
+
+// Aggregates for one census run. Each scan thread fills its own copy and
+// the copies are merged once at the end, so the scan shares nothing. Map
+// keys point into the records; snapshot keeps the mapping they may be in.
+struct CensusTotals {
+    static constexpr int AGE_BANDS[] = {18, 40, 65}; // band i holds ages below AGE_BANDS[i]
+
+    long long patients = 0;
+    long long ageSum = 0;
+    long long chargesCents = 0;
+    long long paymentsCents = 0;
+    long long outstandingCents = 0;
+    array<long long, 4> byAgeBand{};
+    array<long long, 3> byStatus{};
+    unordered_map<string_view, long long> byGender;
+    unordered_map<string_view, long long> byMonth; // admission YYYY-MM
+    vector<shared_ptr<SnapshotView>> snapshots;    // keep the keys above valid
+
+    void add(const BasicFields &f, const FinancialRollup::BillState &b) {
+        ++patients;
+        ageSum += f.age;
+        chargesCents += b.charges;
+        paymentsCents += b.payments;
+        if (b.charges > b.payments) outstandingCents += b.charges - b.payments;
+        size_t band = 0;
+        while (band < 3 && f.age >= AGE_BANDS[band]) ++band;
+        ++byAgeBand[band];
+        ++byStatus[static_cast<size_t>(b.status)];
+        ++byGender[f.gender];
+        ++byMonth[f.admissionDate.substr(0, 7)];
+    }
+
+    void merge(const CensusTotals &o) {
+        patients += o.patients;
+        ageSum += o.ageSum;
+        chargesCents += o.chargesCents;
+        paymentsCents += o.paymentsCents;
+        outstandingCents += o.outstandingCents;
+        for (size_t i = 0; i < byAgeBand.size(); ++i) byAgeBand[i] += o.byAgeBand[i];
+        for (size_t i = 0; i < byStatus.size(); ++i) byStatus[i] += o.byStatus[i];
+        for (auto &g : o.byGender) byGender[g.first] += g.second;
+        for (auto &m : o.byMonth) byMonth[m.first] += m.second;
+        snapshots.insert(snapshots.end(), o.snapshots.begin(), o.snapshots.end());
+    }
+};
+
+// Totals behind the financial report; the summaries of several facilities
+// add up to the hospital-wide one
+struct FinancialSummary {
+    long long bills = 0;
+    array<long long, 3> byStatus{};
+    long long billedCents = 0, collectedCents = 0, outstandingCents = 0, creditCents = 0;
+    vector<long long> revenueByDescription, collectedByMethod; // by billText() id
+
+    void merge(const FinancialSummary &o) {
+        bills += o.bills;
+        for (size_t i = 0; i < byStatus.size(); ++i) byStatus[i] += o.byStatus[i];
+        billedCents += o.billedCents;
+        collectedCents += o.collectedCents;
+        outstandingCents += o.outstandingCents;
+        creditCents += o.creditCents;
+        auto add = [](vector<long long> &to, const vector<long long> &from) {
+            if (to.size() < from.size()) to.resize(from.size());
+            for (size_t i = 0; i < from.size(); ++i) to[i] += from[i];
+        };
+        add(revenueByDescription, o.revenueByDescription);
+        add(collectedByMethod, o.collectedByMethod);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Columnar export for analytics ("HMSCOL1"), written in one streaming pass.
+// Rows are buffered per table and written out every EXPORT_ROWS rows, so
+// memory stays bounded whatever the patient count. Little-endian layout:
+//   u64 magic
+//   row group*  u8 table, u32 rows, u16 columns, then per column
+//               u16 column, u8 encoding, u32 crc32, u64 length, data
+//   footer      u16 tables, each: str name, u16 columns, each: str name, u8 encoding, u8 width
+//               u32 row groups, each: u8 table, u32 rows, u64 file offset
+//   u64 footer offset, u64 magic
+// (str = u32 length + bytes.) Column encodings:
+//   FIXED   width bytes per row
+//   STRING  u32 end offset per row, then the bytes
+//   DICT    u32 new entries, u32 end offset per entry, entry bytes, then a
+//           u32 code per row. Codes index the column's dictionary built up
+//           over all earlier row groups, so each distinct value is stored once.
+// Tables: patients (one row per patient) and bill_items (one row per charge
+// or payment, kind 0 = charge, 1 = payment).
+// ---------------------------------------------------------------------------
+
+enum class ColumnEncoding : uint8_t { FIXED = 1, STRING = 2, DICT = 3 };
+
+struct ColumnSpec {
+    const char *name;
+    ColumnEncoding encoding;
+    uint8_t width; // FIXED only
+};
+
+// One table's columns for the row group being filled
+class ColumnTable {
+public:
+    ColumnTable(const char *name_, vector<ColumnSpec> specs_) : name(name_), specs(move(specs_)), columns(specs.size()) {}
+
+    template <typename T>
+    void fixed(size_t col, T v) { columns[col].bytes.raw(&v, sizeof v); }
+
+    void text(size_t col, string_view s) {
+        Column &c = columns[col];
+        c.bytes.raw(s.data(), s.size());
+        c.ends.push_back(static_cast<uint32_t>(c.bytes.size()));
+    }
+
+    void dict(size_t col, string_view s) {
+        Column &c = columns[col];
+        auto found = c.dictionary.find(string(s));
+        uint32_t code;
+        if (found != c.dictionary.end()) code = found->second;
+        else {
+            code = static_cast<uint32_t>(c.dictionary.size());
+            c.dictionary.emplace(string(s), code);
+            c.bytes.raw(s.data(), s.size()); // new entries for this row group
+            c.ends.push_back(static_cast<uint32_t>(c.bytes.size()));
+        }
+        c.codes.push_back(code);
+    }
+
+    void endRow() { ++rows; }
+    uint32_t rowCount() const { return rows; }
+    const char *getName() const { return name; }
+    const vector<ColumnSpec> &getSpecs() const { return specs; }
+
+    // Encodes the buffered rows as one row group and starts the next;
+    // dictionaries carry over
+    void encode(uint8_t tableId, ByteWriter &out) {
+        out.u8(tableId);
+        out.u32(rows);
+        uint16_t n = static_cast<uint16_t>(specs.size());
+        out.raw(&n, 2);
+        ByteWriter data;
+        for (uint16_t i = 0; i < n; ++i) {
+            Column &c = columns[i];
+            data.clear();
+            if (specs[i].encoding == ColumnEncoding::DICT) data.u32(static_cast<uint32_t>(c.ends.size()));
+            if (specs[i].encoding != ColumnEncoding::FIXED) data.raw(c.ends.data(), c.ends.size() * 4);
+            data.raw(c.bytes.data(), c.bytes.size());
+            if (specs[i].encoding == ColumnEncoding::DICT) data.raw(c.codes.data(), c.codes.size() * 4);
+            out.raw(&i, 2);
+            out.u8(static_cast<uint8_t>(specs[i].encoding));
+            out.u32(crc32(data.data(), data.size()));
+            out.u64(data.size());
+            out.raw(data.data(), data.size());
+            c.bytes.clear();
+            c.ends.clear();
+            c.codes.clear();
+        }
+        rows = 0;
+    }
+
+private:
+    struct Column {
+        ByteWriter bytes;
+        vector<uint32_t> ends;
+        vector<uint32_t> codes;
+        unordered_map<string, uint32_t> dictionary;
+    };
+
+    const char *name;
+    vector<ColumnSpec> specs;
+    vector<Column> columns;
+    uint32_t rows = 0;
+};
+
+class ColumnarExporter {
+public:
+    static constexpr uint32_t EXPORT_ROWS = 65536;
+
+    ColumnarExporter()
+        : patients("patients", {{"id", ColumnEncoding::FIXED, 4}, {"name", ColumnEncoding::STRING, 0},
+                                {"age", ColumnEncoding::FIXED, 4}, {"gender", ColumnEncoding::DICT, 0},
+                                {"symptoms", ColumnEncoding::STRING, 0}, {"admission_date", ColumnEncoding::STRING, 0},
+                                {"charges_cents", ColumnEncoding::FIXED, 8}, {"payments_cents", ColumnEncoding::FIXED, 8},
+                                {"status", ColumnEncoding::FIXED, 1}}),
+          items("bill_items", {{"patient_id", ColumnEncoding::FIXED, 4}, {"kind", ColumnEncoding::FIXED, 1},
+                               {"description", ColumnEncoding::DICT, 0}, {"cents", ColumnEncoding::FIXED, 8},
+                               {"when", ColumnEncoding::FIXED, 8}}) {}
+
+    ~ColumnarExporter() {
+        if (fd >= 0) {
+            ::close(fd);
+            ::unlink(tmpPath.c_str());
+        }
+    }
+
+    // Writes to a temporary file that finish() renames into place
+    bool open(const string &file) {
+        path = file;
+        tmpPath = file + ".tmp";
+        fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        buf.u64(EXPORT_MAGIC);
+        return true;
+    }
+
+    void addPatient(const BasicFields &f, const FinancialRollup::BillState &b) {
+        patients.fixed<int32_t>(0, f.id);
+        patients.text(1, f.name);
+        patients.fixed<int32_t>(2, f.age);
+        patients.dict(3, f.gender);
+        patients.text(4, f.symptoms);
+        patients.text(5, f.admissionDate);
+        patients.fixed<int64_t>(6, b.charges);
+        patients.fixed<int64_t>(7, b.payments);
+        patients.fixed<uint8_t>(8, static_cast<uint8_t>(b.status));
+        endRow(PATIENTS, patients);
+        ++patientRows;
+    }
+
+    void addItem(int patientId, bool payment, string_view description, long long cents, int64_t when) {
+        items.fixed<int32_t>(0, patientId);
+        items.fixed<uint8_t>(1, payment ? 1 : 0);
+        items.dict(2, description);
+        items.fixed<int64_t>(3, cents);
+        items.fixed<int64_t>(4, when);
+        endRow(ITEMS, items);
+        ++itemRows;
+    }
+
+    bool finish() {
+        if (patients.rowCount()) writeGroup(PATIENTS, patients);
+        if (items.rowCount()) writeGroup(ITEMS, items);
+        uint64_t footerOffset = offset + buf.size();
+        ByteWriter footer;
+        uint16_t tables = 2;
+        footer.raw(&tables, 2);
+        for (const ColumnTable *t : {&patients, &items}) {
+            footer.str(t->getName());
+            uint16_t n = static_cast<uint16_t>(t->getSpecs().size());
+            footer.raw(&n, 2);
+            for (auto &c : t->getSpecs()) {
+                footer.str(c.name);
+                footer.u8(static_cast<uint8_t>(c.encoding));
+                footer.u8(c.width);
+            }
+        }
+        footer.u32(static_cast<uint32_t>(groups.size()));
+        for (auto &g : groups) {
+            footer.u8(g.table);
+            footer.u32(g.rows);
+            footer.u64(g.offset);
+        }
+        footer.u64(footerOffset);
+        footer.u64(EXPORT_MAGIC);
+        buf.raw(footer.data(), footer.size());
+        bool ok = flush() && ::fsync(fd) == 0;
+        ::close(fd);
+        fd = -1;
+        if (!ok || ::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    size_t patientCount() const { return patientRows; }
+    size_t itemCount() const { return itemRows; }
+
+private:
+    static constexpr uint64_t EXPORT_MAGIC = 0x314C4F43534D48ull; // "HMSCOL1"
+    static constexpr uint8_t PATIENTS = 0, ITEMS = 1;
+
+    struct Group { uint8_t table; uint32_t rows; uint64_t offset; };
+
+    void endRow(uint8_t table, ColumnTable &t) {
+        t.endRow();
+        if (t.rowCount() >= EXPORT_ROWS) writeGroup(table, t);
+    }
+
+    void writeGroup(uint8_t table, ColumnTable &t) {
+        groups.push_back(Group{table, t.rowCount(), offset + buf.size()});
+        t.encode(table, buf);
+        flush();
+    }
+
+    bool flush() {
+        const char *p = buf.data();
+        size_t n = buf.size();
+        while (ok && n > 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0) { if (errno == EINTR) continue; ok = false; break; }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        offset += buf.size();
+        buf.clear();
+        return ok;
+    }
+
+    ColumnTable patients, items;
+    vector<Group> groups;
+    ByteWriter buf;
+    uint64_t offset = 0;
+    string path, tmpPath;
+    int fd = -1;
+    bool ok = true;
+    size_t patientRows = 0, itemRows = 0;
+};
+
+// ---------------------------------------------------------------------------
+// Dispensing ledger: medication handed out by pharmacists, kept apart from
+// the free-text prescriptions. Drug codes are upper-cased and interned; each
+// drug keeps its entries as parallel columns in dispensing order, so usage
+// questions about a drug read a few contiguous arrays instead of parsing every
+// patient's history. A per-patient index finds a patient's entries for the
+// full record. Not thread-safe; HospitalSystem guards it with ledgerMtx.
+// ---------------------------------------------------------------------------
+class DispensingLedger {
+public:
+    struct Entry {
+        string_view drug;
+        int patientId;
+        uint32_t quantity;
+        long long unitCents;
+        string_view pharmacist;
+        int64_t at;
+    };
+    struct DrugUsage {
+        string_view drug;
+        size_t dispenses;
+        uint64_t units;
+        long long cents;
+        int64_t last;
+    };
+
+    // Upper case, surrounding spaces dropped; empty if nothing is left
+    static string normalizeCode(string_view code) {
+        string c(trimSpaces(code));
+        for (char &ch : c) ch = static_cast<char>(toupper(static_cast<unsigned char>(ch)));
+        return c;
+    }
+
+    void add(string_view drug, int patientId, uint32_t quantity, long long unitCents, string_view pharmacist,
+             int64_t at) {
+        uint32_t d = drugs.intern(drug);
+        if (d >= columns.size()) columns.resize(d + 1);
+        Columns &c = columns[d];
+        c.patient.push_back(patientId);
+        c.quantity.push_back(quantity);
+        c.unitCents.push_back(unitCents);
+        c.pharmacist.push_back(staff.intern(pharmacist));
+        c.at.push_back(at);
+        c.units += quantity;
+        c.cents += static_cast<long long>(quantity) * unitCents;
+        byPatient[patientId].push_back({d, static_cast<uint32_t>(c.patient.size() - 1)});
+    }
+
+    bool empty() const { return byPatient.empty(); }
+
+    vector<Entry> forPatient(int patientId) const {
+        vector<Entry> list;
+        auto found = byPatient.find(patientId);
+        if (found == byPatient.end()) return list;
+        for (const Ref &r : found->second) list.push_back(entry(r.drug, r.row));
+        return list;
+    }
+
+    // The most recent entries for one drug, newest first
+    vector<Entry> forDrug(string_view drug, size_t limit) const {
+        vector<Entry> list;
+        uint32_t d = drugs.find(drug);
+        if (d == StringTable::NONE || d >= columns.size()) return list;
+        for (size_t row = columns[d].patient.size(); row > 0 && list.size() < limit; --row)
+            list.push_back(entry(d, static_cast<uint32_t>(row - 1)));
+        return list;
+    }
+
+    // Totals per drug, in code order; with a date window [from, to) only the
+    // entries inside it count
+    vector<DrugUsage> usage(int64_t from = numeric_limits<int64_t>::min(),
+                            int64_t to = numeric_limits<int64_t>::max()) const {
+        vector<DrugUsage> list;
+        for (uint32_t d = 0; d < columns.size(); ++d) {
+            const Columns &c = columns[d];
+            DrugUsage u{drugs.lookup(d), 0, 0, 0, 0};
+            bool whole = from == numeric_limits<int64_t>::min() && to == numeric_limits<int64_t>::max();
+            if (whole) {
+                u.dispenses = c.patient.size();
+                u.units = c.units;
+                u.cents = c.cents;
+                u.last = c.at.empty() ? 0 : c.at.back();
+            } else {
+                for (size_t row = 0; row < c.at.size(); ++row) {
+                    if (c.at[row] < from || c.at[row] >= to) continue;
+                    ++u.dispenses;
+                    u.units += c.quantity[row];
+                    u.cents += static_cast<long long>(c.quantity[row]) * c.unitCents[row];
+                    u.last = max(u.last, c.at[row]);
+                }
+            }
+            if (u.dispenses) list.push_back(u);
+        }
+        sort(list.begin(), list.end(), [](const DrugUsage &a, const DrugUsage &b) { return a.drug < b.drug; });
+        return list;
+    }
+
+    // Snapshot section: staff names, then per drug its code and columns
+    void encode(ByteWriter &w) const {
+        w.u32(static_cast<uint32_t>(staff.size()));
+        for (uint32_t i = 0; i < staff.size(); ++i) w.str(staff.lookup(i));
+        w.u32(static_cast<uint32_t>(columns.size()));
+        for (uint32_t d = 0; d < columns.size(); ++d) {
+            const Columns &c = columns[d];
+            w.str(drugs.lookup(d));
+            w.u32(static_cast<uint32_t>(c.patient.size()));
+            w.raw(c.patient.data(), c.patient.size() * sizeof(int32_t));
+            w.raw(c.quantity.data(), c.quantity.size() * sizeof(uint32_t));
+            w.raw(c.unitCents.data(), c.unitCents.size() * sizeof(int64_t));
+            w.raw(c.pharmacist.data(), c.pharmacist.size() * sizeof(uint32_t));
+            w.raw(c.at.data(), c.at.size() * sizeof(int64_t));
+        }
+    }
+
+    // Adds the entries of a section written by encode (none for an empty
+    // one); false if it is malformed
+    bool decode(ByteReader r) {
+        if (r.atEnd()) return true;
+        vector<string> names(r.u32());
+        for (string &n : names) n = r.str();
+        for (uint32_t d = r.u32(); d > 0 && r.good(); --d) {
+            string drug = r.str();
+            uint32_t rows = r.u32();
+            if (!r.good()) break;
+            vector<int32_t> patient(rows);
+            vector<uint32_t> quantity(rows), pharmacist(rows);
+            vector<int64_t> unitCents(rows), at(rows);
+            for (auto &v : patient) v = r.i32();
+            for (auto &v : quantity) v = r.u32();
+            for (auto &v : unitCents) v = r.i64();
+            for (auto &v : pharmacist) v = r.u32();
+            for (auto &v : at) v = r.i64();
+            if (!r.good()) break;
+            for (uint32_t row = 0; row < rows; ++row) {
+                string_view who = pharmacist[row] < names.size() ? string_view(names[pharmacist[row]]) : "?";
+                add(drug, patient[row], quantity[row], unitCents[row], who, at[row]);
+            }
+        }
+        return r.good();
+    }
+
+private:
+    struct Columns {
+        vector<int32_t> patient;
+        vector<uint32_t> quantity;
+        vector<int64_t> unitCents;
+        vector<uint32_t> pharmacist; // staff id
+        vector<int64_t> at;
+        uint64_t units = 0;
+        long long cents = 0;
+    };
+    struct Ref {
+        uint32_t drug;
+        uint32_t row;
+    };
+
+    Entry entry(uint32_t d, uint32_t row) const {
+        const Columns &c = columns[d];
+        return {drugs.lookup(d), c.patient[row], c.quantity[row], c.unitCents[row], staff.lookup(c.pharmacist[row]),
+                c.at[row]};
+    }
+
+    StringTable drugs, staff;
+    vector<Columns> columns;                       // by drug id
+    unordered_map<int, vector<Ref>> byPatient;
+};
+
+// Patient IDs are unique across facilities: facility F hands out
+// F * FACILITY_ID_SPAN + 1, + 2, ... so the ID alone names the facility that
+// holds the record. Facility 0 is a standalone system with plain IDs 1, 2, ...
+constexpr int FACILITY_ID_SPAN = 10000000;
+constexpr int MAX_FACILITY = numeric_limits<int>::max() / FACILITY_ID_SPAN - 1;
+constexpr int MAX_PATIENT_ID = numeric_limits<int>::max();
+
+inline int facilityOf(int patientId) { return patientId / FACILITY_ID_SPAN; }
+
+class FacilityRouter;
+
+// How a read-only replica follows its primary (see HospitalSystem)
+struct ReplicaOptions {
+    chrono::milliseconds poll{50};      // how often the primary's log is read
+    chrono::milliseconds maxLag{1000};  // lag beyond this is flagged in reports
+};
+
+// HospitalSystem coordinates everything
+//
+// Concurrency: many sessions share one system.
+//  - Patient lookups are lock-free (pointer-stable tables, atomic ID index).
+//  - Each patient has its own reader/writer lock guarding its history and
+//    bill, so work on different patients never contends.
+//  - Histories read from the snapshot are loaded on first use and dropped
+//    again, oldest use first, while they are unchanged and the loaded total
+//    is over the history budget (see readHistory and evictHistories).
+//  - Discharged patients are flagged in dischargedBits, so active-census
+//    scans skip them; their records move to the snapshot archive.
+//  - In a multi-facility deployment each facility is one HospitalSystem
+//    (see FacilityRouter); the per-ID tables are indexed by localId.
+//  - A replica opens a primary's data directory read-only and applies its
+//    log as it grows, taking the same locks the mutations do, so its
+//    sessions read while records arrive. Mutations throw ReadOnlyReplica.
+//  - If the log cannot be written, mutations throw StorageFailed before
+//    applying anything, until a checkpoint has started a new log.
+//  - Users are guarded by usersMtx; inserts into the patient table by tableMtx.
+//    Sessions hold a UserHandle, whose username and role read without a lock.
+//  - Every mutation holds checkpointGate shared; checkpoint() takes it
+//    exclusively so the snapshot and the log cut over at a consistent point.
+//    Automatic checkpoints run on the compactor thread, not in a session.
+// Lock order: checkpointGate -> usersMtx | patient lock -> tableMtx -> searchMtx,
+// patient lock -> textMtx, patient lock | tableMtx -> financeMtx, and
+// patient lock -> ledgerMtx.
+class HospitalSystem {
+    friend class FacilityRouter;
+
+public:
+    // In-memory system (nothing survives a restart)
+    explicit HospitalSystem(int facility = 0)
+        : facilityId(facility), idBase(facility * FACILITY_ID_SPAN), lastPatientId(idBase) {
+        seedDefaultAdmin();
+    }
+
+    // Durable system backed by the snapshot + write-ahead log in dataDir
+    explicit HospitalSystem(const string &dataDir, int facility = 0)
+        : facilityId(facility), idBase(facility * FACILITY_ID_SPAN), lastPatientId(idBase),
+          store(make_unique<DurableStore>(dataDir)) {
+        if (!store->open() || !store->mapSnapshot(snapshot)) {
+            failOpen();
+            return;
+        }
+        replaying = true;
+        if (!snapshotMatchesFacility(dataDir)) return;
+        liveSnapshot.store(snapshot.get(), memory_order_release);
+        if (snapshot) adoptSnapshot(true);
+        if (!store->replayLog([this](ByteReader &r) { applyLogRecord(r); })) {
+            failOpen();
+            return;
+        }
+        replaying = false;
+        if (activeUsers == 0) seedDefaultAdmin();
+        hashLegacyPasswords();
+        audit = make_unique<AuditLog>(dataDir + "/audit.log");
+        compactor = thread([this] { compactInBackground(); });
+    }
+
+    // Read-only replica of the primary working in primaryDir (on the same
+    // machine or a shared filesystem): loads its snapshot and log, then a
+    // follower thread applies what the primary logs from then on. Nothing
+    // is written to primaryDir.
+    HospitalSystem(const string &primaryDir, const ReplicaOptions &options, int facility = 0)
+        : facilityId(facility), idBase(facility * FACILITY_ID_SPAN), lastPatientId(idBase),
+          store(make_unique<DurableStore>(primaryDir)), isReplica(true), replicaOptions(options) {
+        for (int attempt = 0; !store->followLog(snapshot); ++attempt) {
+            if (attempt == 100) {
+                cerr << "Replica: no primary log in " << primaryDir << "\n";
+                failOpen();
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10)); // the primary may be mid-checkpoint
+        }
+        if (!snapshotMatchesFacility(primaryDir)) return;
+        liveSnapshot.store(snapshot.get(), memory_order_release);
+        if (snapshot) adoptSnapshot(true);
+        replaying = true;
+        pollPrimary();
+        replaying = false;
+        follower = thread([this] { followPrimary(); });
+    }
+
+    ~HospitalSystem() {
+        if (compactor.joinable()) {
+            {
+                lock_guard<mutex> lock(compactMtx);
+                compactStop = true;
+            }
+            compactWake.notify_all();
+            compactor.join();
+        }
+        if (!follower.joinable()) return;
+        {
+            lock_guard<mutex> lock(followMtx);
+            followStop = true;
+        }
+        followWake.notify_all();
+        follower.join();
+    }
+
+    void run();
+    void runSession();
+
+    bool createdDefaultAdmin() const { return seededAdmin; }
+    // False if the data directory could not be used: it belongs to another
+    // facility, or (for a replica) holds no primary log. Nothing was loaded.
+    bool opened() const { return !openFailed; }
+
+    bool replica() const { return isReplica; }
+
+    struct ReplicationStatus {
+        bool inSync = true;     // false once a log record could not be applied
+        uint64_t records = 0;   // applied since startup
+        int64_t lagMs = 0;      // everything the primary logged longer ago than this is applied
+        bool overLimit = false; // lagMs is beyond ReplicaOptions::maxLag
+    };
+    ReplicationStatus replicationStatus() const {
+        ReplicationStatus st;
+        if (!isReplica) return st;
+        st.inSync = replicaInSync.load(memory_order_relaxed);
+        st.records = replicatedRecords.load(memory_order_relaxed);
+        auto now = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch());
+        st.lagMs = now.count() - caughtUpAtMs.load(memory_order_relaxed);
+        st.overLimit = !st.inSync || st.lagMs > replicaOptions.maxLag.count();
+        return st;
+    }
+
+    // One line for the login screen and the reports; empty on a primary
+    string replicationNote() const {
+        if (!isReplica) return {};
+        ReplicationStatus st = replicationStatus();
+        if (!st.inSync) return "Read-only replica, OUT OF SYNC with the primary: restart it\n";
+        string note = "Read-only replica, " + to_string(st.lagMs) + " ms behind the primary";
+        if (st.overLimit) note += " (over the " + to_string(replicaOptions.maxLag.count()) + " ms limit)";
+        return note + "\n";
+    }
+
+    int facility() const { return facilityId; }
+    bool ownsPatientId(int id) const { return facilityId == 0 ? id > 0 : id > idBase && id - idBase < FACILITY_ID_SPAN; }
+    // This facility and, when it is part of a multi-facility deployment, all the others
+    vector<HospitalSystem*> allFacilities();
+
+    // Bulk loads turn off the per-mutation log sync; turning it back on
+    // syncs everything written in between
+    void setDeferredSync(bool deferred) {
+        if (!store) return;
+        store->setSyncWrites(!deferred);
+        if (!deferred) store->sync();
+    }
+
+    // Approximate memory allowed for loaded patient histories. Over it,
+    // histories unchanged since the last snapshot are dropped until they are
+    // next used; changed ones stay until a checkpoint has written them.
+    void setHistoryBudget(size_t bytes) { historyBudget.store(bytes, memory_order_relaxed); }
+    size_t historyBytesInUse() const { return historyBytes.load(memory_order_relaxed); }
+
+    // Logged changes between automatic checkpoints (default 10000). Bulk
+    // loads raise it so the snapshot is not rewritten every few thousand
+    // records; set it before sessions start.
+    void setCheckpointInterval(size_t records) {
+        if (store) store->setCompactEvery(max<size_t>(records, 1));
+    }
+
+    // Writes a compact snapshot and starts a fresh log (no-op when in-memory)
+    void checkpoint() {
+        unique_lock<shared_mutex> gate(checkpointGate);
+        writeCheckpoint();
+    }
+
+    // User management
+    bool usernameExists(const string &uname) const {
+        shared_lock<shared_mutex> lock(usersMtx);
+        return usersByName.count(uname) != 0;
+    }
+
+    // credential is a stored hash (see hashPassword). False for an unknown
+    // role or a taken username.
+    bool addUser(const string &username, const string &credential, Role role) {
+        requireWritable();
+        return addUserRecord(username, credential, role);
+    }
+
+    bool deleteUser(const string &username) {
+        requireWritable();
+        return deleteUserRecord(username);
+    }
+
+    // Username and role never change, so these need no lock
+    const User &user(UserHandle h) const { return asUser(userTable[h.slot].record); }
+
+    // Runs the role menu for a logged-in user (dispatched on the variant).
+    // On a replica a change the user picks is refused and the menu shown again.
+    void showMenu(UserHandle h) {
+        while (true) {
+            try {
+                visit([this](auto &u) { u.showMenu(*this); }, userTable[h.slot].record);
+                return;
+            } catch (const ReadOnlyReplica&) {
+                out() << "This is a read-only replica; make changes on the primary.\n";
+            } catch (const StorageFailed&) {
+                out() << "Changes cannot be saved (storage failure); nothing was changed.\n";
+            }
+        }
+    }
+
+    // Hashes before taking any lock; only the hash is logged
+    void changePassword(User &user, const string &pw) {
+        requireWritable();
+        setCredential(user, hashPassword(pw));
+        auditEvent(AuditAction::CHANGE_PASSWORD, 0, user.getUsername());
+    }
+
+    // One page of employees in registration order, formatted into a single
+    // buffer and written once. offset is a position in the user table;
+    // returns the position for the next page, or 0 if this was the last one.
+    size_t listEmployees(size_t offset, size_t limit) const {
+        string page;
+        size_t next = 0;
+        {
+            shared_lock<shared_mutex> lock(usersMtx);
+            if (offset == 0) page += "---- Registered Employees ----\n";
+            size_t i = offset, shown = 0;
+            for (; i < userTable.size() && shown < limit; ++i) {
+                if (userTable[i].deleted) continue;
+                const User &u = asUser(userTable[i].record);
+                page += "Username: ";
+                page += u.getUsername();
+                page += " | Role: ";
+                page += roleToString(u.getRole());
+                page += '\n';
+                ++shown;
+            }
+            while (i < userTable.size() && userTable[i].deleted) ++i;
+            if (i < userTable.size()) next = i;
+            else page += "------------------------------\n";
+        }
+        out().write(page.data(), static_cast<streamsize>(page.size()));
+        return next;
+    }
+
+    // The hash is checked on the password workers with no lock held. A
+    // plaintext or outdated hash is replaced after a successful login.
+    UserHandle authenticate(const string &username, const string &password) {
+        HMS_TIME(Metric::AUTHENTICATE);
+        UserHandle h;
+        string stored;
+        {
+            shared_lock<shared_mutex> lock(usersMtx);
+            auto found = usersByName.find(username);
+            if (found != usersByName.end()) {
+                h.slot = found->second;
+                stored = asUser(userTable[h.slot].record).getCredential();
+            }
+        }
+        // Unknown users still pay for a hash, so timing does not reveal them
+        if (!h) {
+            verifyPassword(password, dummyCredential());
+            HMS_COUNT(Counter::LOGIN_FAILURES, 1);
+            return h;
+        }
+        if (!verifyPassword(password, stored)) {
+            HMS_COUNT(Counter::LOGIN_FAILURES, 1);
+            return UserHandle{};
+        }
+        if (!isReplica && credentialNeedsRehash(stored)) {
+            try {
+                setCredential(asUser(userTable[h.slot].record), hashPassword(password), &stored);
+            } catch (const StorageFailed&) {
+                // the old hash still verifies; a later login rehashes
+            }
+        }
+        return h;
+    }
+
+    // Patient management
+    // The strings are moved into the new record. Returns the new ID, or 0
+    // once the facility's ID range is used up.
+    int registerPatient(string name, int age, string_view gender, string symptoms, string date) {
+        HMS_TIME(Metric::REGISTER_PATIENT);
+        requireWritable();
+        MutationScope scope(*this);
+        int id = lastPatientId.load(); // concurrent registrations get distinct IDs
+        do {
+            if (id == MAX_PATIENT_ID || !ownsPatientId(id + 1)) return 0;
+        } while (!lastPatientId.compare_exchange_weak(id, id + 1));
+        ++id;
+        logMutation(LogOp::REGISTER_PATIENT, [&](ByteWriter &w) {
+            w.i32(id);
+            w.str(name);
+            w.i32(age);
+            w.str(gender);
+            w.str(symptoms);
+            w.str(date);
+        });
+        auditEvent(AuditAction::REGISTER_PATIENT, id, name);
+        addRegisteredPatient(id, move(name), age, gender, move(symptoms), move(date));
+        return id;
+    }
+
+    // IDs are handed out densely from lastPatientId, so patientSlot maps an ID
+    // straight to its position in patients without scanning or locking.
+    // Records still sitting in the snapshot mapping are loaded on first access
+    // (basic fields only; the history follows when something reads it).
+    Patient* findPatientById(int id) {
+        HMS_TIME(Metric::FIND_PATIENT);
+        if (Patient *p = residentPatient(id)) return p;
+        if (HospitalSystem *owner = foreignOwner(id)) return owner->findPatientById(id);
+        auto view = currentSnapshot();
+        long rec = view ? view->findRecord(id) : -1;
+        long archived = rec < 0 && view ? view->findArchived(id) : -1;
+        if (rec < 0 && archived < 0) return nullptr;
+        lock_guard<mutex> lock(tableMtx);
+        if (Patient *p = residentPatient(id)) return p; // loaded by another session meanwhile
+        HMS_COUNT(Counter::SNAPSHOT_LOADS, 1);
+        return rec >= 0 ? &materialize(*view, rec) : materializeArchived(*view, archived);
+    }
+
+    // Prints basic info without loading the patient's history. These fields
+    // never change after registration, so no lock is needed.
+    bool printBasicInfo(int id) const {
+        if (const HospitalSystem *owner = foreignOwner(id)) return owner->printBasicInfo(id);
+        auto view = currentSnapshot();
+        BasicFields f;
+        if (!basicFields(id, view.get(), f)) return false;
+        Patient::printBasicFields(f.id, f.name, f.age, f.gender, f.symptoms, f.admissionDate);
+        return true;
+    }
+
+    // One page of admitted patients with IDs above afterId (keyset
+    // pagination), built in a single buffer and written once, so the cost is
+    // O(limit) whatever the size of the hospital. Returns the cursor for the
+    // next page (the last ID listed), or 0 once the last patient has been
+    // listed. Reads only immutable fields, so it never blocks (or is blocked
+    // by) writers.
+    // Sharded, the page runs on across the facilities in ID order.
+    int listPatientsBrief(int afterId, size_t limit) const;
+
+    // This facility's part of a page: rows for admitted patients above
+    // afterId until shown reaches limit. Returns the last ID listed
+    // (afterId if none was).
+    int appendPatientsBrief(string &page, int afterId, size_t limit, size_t &shown) const {
+        auto view = currentSnapshot();
+        int last = lastPatientId.load();
+        int id = max(afterId, idBase), listed = afterId;
+        char num[16];
+        while (shown < limit && (id = nextActiveId(id, last)) <= last) {
+            BasicFields f;
+            if (!basicFields(id, view.get(), f)) continue;
+            page += "ID: ";
+            page.append(num, to_chars(num, num + sizeof num, id).ptr);
+            page += " | Name: ";
+            page += f.name;
+            page += '\n';
+            ++shown;
+            listed = id;
+        }
+        return listed;
+    }
+
+    bool hasPatientsAfter(int id) const {
+        int last = lastPatientId.load();
+        return nextActiveId(max(id, idBase), last) <= last;
+    }
+
+    // Finds patients by name prefix, admission date range and symptom words,
+    // at every facility when sharded.
+    vector<int> searchPatients(const PatientSearchIndex::Query &q) const;
+    vector<int> searchClinicalText(string_view query, unsigned fields) const;
+
+    // This facility's part of searchPatients. The indexes are built on the
+    // first search (so startup never scans the snapshot) and kept current by
+    // registerPatient from then on.
+    vector<int> searchFacility(const PatientSearchIndex::Query &q) const {
+        {
+            shared_lock<shared_mutex> lock(searchMtx);
+            if (searchBuilt) return admittedOnly(search.search(q));
+        }
+        unique_lock<shared_mutex> lock(searchMtx);
+        if (!searchBuilt) {
+            auto view = currentSnapshot();
+            int last = lastPatientId.load();
+            for (int id = nextActiveId(idBase, last); id <= last; id = nextActiveId(id, last)) {
+                BasicFields f;
+                if (basicFields(id, view.get(), f)) search.add(f);
+            }
+            searchBuilt = true;
+        }
+        return admittedOnly(search.search(q));
+    }
+
+    // This facility's part of searchClinicalText: patients by words and
+    // phrases in their clinical history (see ClinicalTextIndex for the
+    // syntax). Like the search above, the index is built from existing
+    // records on first use and fed by every later entry.
+    vector<int> searchFacilityText(string_view query, unsigned fields) const {
+        buildTextIndex();
+        shared_lock<shared_mutex> lock(textMtx);
+        return admittedOnly(textIndex.search(query, fields));
+    }
+
+    // Hospital-wide billing report for Accounts, discharged patients' bills
+    // included. The rollup is built from the existing bills on first use; from then on every charge, payment and
+    // status change updates it, so the report is a read of the totals.
+    void printFinancialReport() const {
+        FinancialSummary sum = hospitalFinancialSummary();
+        string report = replicationNote();
+        auto money = [&](const char *label, long long cents) {
+            report += label;
+            report += formatCents(cents);
+            report += '\n';
+        };
+        auto byAmount = [&](const char *title, const vector<long long> &sums) {
+            vector<pair<long long, uint32_t>> rows;
+            for (uint32_t id = 0; id < sums.size(); ++id)
+                if (sums[id] != 0) rows.emplace_back(sums[id], id);
+            sort(rows.begin(), rows.end(), greater<>());
+            report += title;
+            if (rows.empty()) report += "  (none)\n";
+            for (auto &row : rows) {
+                report += "  " + billText().lookup(row.second) + " : $";
+                report += formatCents(row.first);
+                report += '\n';
+            }
+        };
+        report += "---- Hospital Financial Summary ----\n";
+        report += "Bills: " + to_string(sum.bills);
+        const Bill::Status statuses[] = {Bill::Status::PENDING, Bill::Status::PARTIALLY_PAID, Bill::Status::FULLY_CLEARED};
+        for (size_t i = 0; i < 3; ++i) {
+            report += i == 0 ? " (" : ", ";
+            report += Bill::statusToString(statuses[i]) + ": " + to_string(sum.byStatus[static_cast<size_t>(statuses[i])]);
+        }
+        report += ")\n";
+        money("Total Billed: $", sum.billedCents);
+        money("Total Collected: $", sum.collectedCents);
+        money("Outstanding Balance: $", sum.outstandingCents);
+        money("Overpaid Credit: $", sum.creditCents);
+        byAmount("Revenue by charge description:\n", sum.revenueByDescription);
+        byAmount("Payments by method:\n", sum.collectedByMethod);
+        report += "------------------------------------\n";
+        out().write(report.data(), static_cast<streamsize>(report.size()));
+    }
+
+    // This facility's billing totals, read from the rollup
+    FinancialSummary financialSummary() const {
+        buildFinancialRollup();
+        FinancialSummary sum;
+        shared_lock<shared_mutex> lock(financeMtx);
+        sum.bills = static_cast<long long>(rollup.billCount());
+        for (auto st : {Bill::Status::PENDING, Bill::Status::PARTIALLY_PAID, Bill::Status::FULLY_CLEARED})
+            sum.byStatus[static_cast<size_t>(st)] = static_cast<long long>(rollup.countWithStatus(st));
+        sum.billedCents = rollup.billedCents();
+        sum.collectedCents = rollup.collectedCents();
+        sum.outstandingCents = rollup.outstandingCents();
+        sum.creditCents = rollup.creditCents();
+        sum.revenueByDescription = rollup.revenueByDescription();
+        sum.collectedByMethod = rollup.collectedByMethod();
+        return sum;
+    }
+
+    // Every facility's together when sharded, else this one's (see FacilityRouter)
+    FinancialSummary hospitalFinancialSummary() const;
+    CensusTotals hospitalCensus(const CensusFilter &filter) const;
+
+    // Scans every admitted patient of this facility for reports that cannot
+    // be precomputed (hospitalCensus covers all facilities). IDs are
+    // handed out to the threads in chunks from a shared counter, so a thread
+    // that lands on cheap records just takes more chunks; each thread
+    // aggregates privately and the partials are merged at the end.
+    CensusTotals census(const CensusFilter &filter, unsigned threads = 0) const {
+        constexpr int CHUNK = 2048;
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        auto view = currentSnapshot();
+        int last = lastPatientId.load();
+        threads = static_cast<unsigned>(min<long>(threads, (last - idBase) / CHUNK + 1));
+        atomic<int> next{idBase + 1};
+        vector<CensusTotals> partial(threads);
+        auto scan = [&](unsigned t) {
+            for (int start; (start = next.fetch_add(CHUNK)) <= last;) {
+                int end = min(last, start + CHUNK - 1);
+                for (int id = nextActiveId(start - 1, end); id <= end; id = nextActiveId(id, end)) {
+                    BasicFields f;
+                    FinancialRollup::BillState bill;
+                    if (basicFields(id, view.get(), f, &bill) && filter.matches(f, bill)) partial[t].add(f, bill);
+                }
+            }
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; ++t) pool.emplace_back(scan, t);
+        scan(0);
+        for (auto &th : pool) th.join();
+        for (unsigned t = 1; t < threads; ++t) partial[0].merge(partial[t]);
+        partial[0].snapshots.push_back(move(view));
+        return move(partial[0]);
+    }
+
+    void printCensusReport(const CensusFilter &filter) const {
+        auto started = chrono::steady_clock::now();
+        CensusTotals c = hospitalCensus(filter);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        string report = replicationNote() + "---- Census Report ----\n";
+        report += "Matching patients: " + to_string(c.patients) + "\n";
+        if (c.patients > 0) {
+            char avg[32];
+            snprintf(avg, sizeof avg, "%.1f", static_cast<double>(c.ageSum) / static_cast<double>(c.patients));
+            report += "Average age: " + string(avg) + "\n";
+            static const char *bands[] = {"0-17", "18-39", "40-64", "65+"};
+            report += "By age:";
+            for (size_t i = 0; i < 4; ++i) report += string(i ? ", " : " ") + bands[i] + ": " + to_string(c.byAgeBand[i]);
+            report += "\nBy gender:";
+            map<string, long long> genders(c.byGender.begin(), c.byGender.end());
+            for (auto &g : genders) report += " " + g.first + ": " + to_string(g.second) + ";";
+            report += "\nBy bill status:";
+            const Bill::Status statuses[] = {Bill::Status::PENDING, Bill::Status::PARTIALLY_PAID, Bill::Status::FULLY_CLEARED};
+            for (auto st : statuses)
+                report += " " + Bill::statusToString(st) + ": " + to_string(c.byStatus[static_cast<size_t>(st)]) + ";";
+            report += "\nCharges: $" + formatCents(c.chargesCents) + ", Payments: $" + formatCents(c.paymentsCents) +
+                      ", Outstanding: $" + formatCents(c.outstandingCents) + "\n";
+            report += "Admissions by month:\n";
+            map<string, long long> months(c.byMonth.begin(), c.byMonth.end());
+            for (auto &m : months) report += "  " + m.first + " : " + to_string(m.second) + "\n";
+        }
+        char took[64];
+        snprintf(took, sizeof took, "(scanned in %.1f ms)\n", ms);
+        report += took;
+        report += "-----------------------\n";
+        out().write(report.data(), static_cast<streamsize>(report.size()));
+    }
+
+    // Streams every patient (archived ones too) and bill line item to a
+    // columnar file (see ColumnarExporter). Records are read in place; a
+    // resident patient is held under its shared lock only while its own rows
+    // are added.
+    // Sharded, every facility's records go to the one file.
+    bool exportColumnar(const string &file, size_t &patientRows, size_t &itemRows) {
+        ColumnarExporter exporter;
+        if (!exporter.open(file)) return false;
+        for (HospitalSystem *facility : allFacilities()) facility->exportRows(exporter);
+        patientRows = exporter.patientCount();
+        itemRows = exporter.itemCount();
+        return exporter.finish();
+    }
+
+    void exportRows(ColumnarExporter &exporter) const {
+        auto view = currentSnapshot();
+        shared_ptr<SnapshotView> latest;
+        int last = lastPatientId.load();
+        for (int id = idBase + 1; id <= last; ++id) {
+            const Patient *p = residentPatient(id);
+            shared_lock<shared_mutex> lock;
+            if (p) lock = shared_lock<shared_mutex>(p->recordLock());
+            const SnapshotView *v = p ? latestSnapshot(view.get(), latest) : view.get();
+            auto addBill = [&](const BasicFields &f, const Bill &bill) {
+                exporter.addPatient(f, FinancialRollup::stateOf(bill));
+                const StringTable &text = billText();
+                for (const LineItems *items : {&bill.getCharges(), &bill.getPayments()}) {
+                    bool payment = items == &bill.getPayments();
+                    for (size_t i = 0; i < items->size(); ++i)
+                        exporter.addItem(id, payment, text.lookup(items->textId[i]), items->cents[i], items->when[i]);
+                }
+            };
+            ArchivedPatient a;
+            if (p && p->hasHistory()) {
+                addBill({id, p->getAge(), p->getName(), p->getGender(), p->getSymptoms(), p->getAdmissionDate()},
+                        p->getBill());
+            } else if (long arch = readArchived(v, id, a); arch >= 0) {
+                addBill({id, a.age, a.name, a.gender, a.symptoms, a.admissionDate}, a.history.bill);
+            } else if (long rec = v ? v->findRecord(id) : -1; rec >= 0) {
+                SnapPatient r = v->record(rec);
+                BasicFields f{id, r.age, v->str(r.name), v->str(r.gender), v->str(r.symptoms), v->str(r.admissionDate)};
+                exporter.addPatient(f, {r.chargesCents, r.paymentsCents, static_cast<Bill::Status>(r.status)});
+                for (int kind = 0; kind < 2; ++kind) {
+                    uint64_t block = kind == 0 ? r.charges : r.payments;
+                    for (uint32_t i = 0, n = v->itemCount(block); i < n; ++i) {
+                        uint32_t text; long long cents; int64_t when;
+                        v->item(block, i, text, cents, when);
+                        exporter.addItem(id, kind == 1, v->text(text), cents, when);
+                    }
+                }
+            }
+        }
+    }
+
+    // Prints ID, name and admission date for each listed patient, in one write
+    void listPatients(const vector<int> &ids) const {
+        auto view = currentSnapshot();
+        string page;
+        for (int id : ids) {
+            BasicFields f;
+            const HospitalSystem *owner = foreignOwner(id);
+            if (owner ? !owner->basicFields(id, owner->currentSnapshot().get(), f) : !basicFields(id, view.get(), f))
+                continue;
+            page += "ID: " + to_string(id) + " | Name: ";
+            page += f.name;
+            page += " | Admitted: ";
+            page += f.admissionDate;
+            page += '\n';
+        }
+        out().write(page.data(), static_cast<streamsize>(page.size()));
+    }
+
+    // Clinical and billing updates go through the system so they are logged.
+    // Each one locks only the patient it touches. A patient held by another
+    // facility is updated there.
+    void addDiagnosis(Patient &p, const string &d) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->addDiagnosis(p, d);
+        if (d.empty()) return;
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        logMutation(LogOp::ADD_DIAGNOSIS, [&](ByteWriter &w) { w.i32(p.getId()); w.str(d); });
+        auditEvent(AuditAction::ADD_DIAGNOSIS, p.getId(), d);
+        p.addDiagnosis(d);
+        indexClinicalText(p.getId(), ClinicalField::DIAGNOSIS, d);
+    }
+
+    void addMedicalNote(Patient &p, const string &note) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->addMedicalNote(p, note);
+        if (note.empty()) return;
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        logMutation(LogOp::ADD_NOTE, [&](ByteWriter &w) { w.i32(p.getId()); w.str(note); });
+        auditEvent(AuditAction::ADD_NOTE, p.getId(), note);
+        p.addMedicalNote(note);
+        indexClinicalText(p.getId(), ClinicalField::NOTE, note);
+    }
+
+    void addPrescription(Patient &p, const string &presc) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->addPrescription(p, presc);
+        if (presc.empty()) return;
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        logMutation(LogOp::ADD_PRESCRIPTION, [&](ByteWriter &w) { w.i32(p.getId()); w.str(presc); });
+        auditEvent(AuditAction::ADD_PRESCRIPTION, p.getId(), presc);
+        p.addPrescription(presc);
+        indexClinicalText(p.getId(), ClinicalField::PRESCRIPTION, presc);
+    }
+
+    // False for an amount toCents rejects, one that would take the bill past
+    // MAX_BILL_CENTS, or once p is discharged (the bill is final then)
+    bool addCharge(Patient &p, const string &desc, double amount) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->addCharge(p, desc, amount);
+        HMS_TIME(Metric::ADD_CHARGE);
+        long long cents = toCents(amount);
+        if (cents <= 0) return false;
+        int64_t when = time(nullptr);
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        if (p.isDischarged() || !p.getBill().fitsCharge(cents)) return false;
+        logMutation(LogOp::ADD_CHARGE, [&](ByteWriter &w) {
+            w.i32(p.getId()); w.str(desc); w.i64(cents); w.i64(when);
+        });
+        auditEvent(AuditAction::ADD_CHARGE, p.getId(), desc, cents);
+        auto before = FinancialRollup::stateOf(p.getBill());
+        p.getBill().addChargeCents(desc, cents, when);
+        rollupBillChange(p, before, &p.getBill().getCharges());
+        return true;
+    }
+
+    // False for an amount toCents rejects or one that would take the bill's
+    // payments past MAX_BILL_CENTS. A discharged patient can still pay.
+    bool addPayment(Patient &p, const string &method, double amount) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->addPayment(p, method, amount);
+        HMS_TIME(Metric::ADD_PAYMENT);
+        long long cents = toCents(amount);
+        if (cents <= 0) return false;
+        int64_t when = time(nullptr);
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        if (!p.getBill().fitsPayment(cents)) return false;
+        logMutation(LogOp::ADD_PAYMENT, [&](ByteWriter &w) {
+            w.i32(p.getId()); w.str(method); w.i64(cents); w.i64(when);
+        });
+        auditEvent(AuditAction::ADD_PAYMENT, p.getId(), method, cents);
+        auto before = FinancialRollup::stateOf(p.getBill());
+        p.getBill().addPaymentCents(method, cents, when);
+        rollupBillChange(p, before, &p.getBill().getPayments());
+        return true;
+    }
+
+    // False once p is discharged: the bill is final and cannot be reopened
+    bool setBillStatus(Patient &p, Bill::Status s) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->setBillStatus(p, s);
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        if (p.isDischarged()) return false;
+        logMutation(LogOp::SET_BILL_STATUS, [&](ByteWriter &w) {
+            w.i32(p.getId()); w.u8(static_cast<uint8_t>(s));
+        });
+        auditEvent(AuditAction::SET_BILL_STATUS, p.getId(), Bill::statusToString(s));
+        auto before = FinancialRollup::stateOf(p.getBill());
+        p.getBill().setStatus(s);
+        rollupBillChange(p, before, nullptr);
+        return true;
+    }
+
+    // Records medication handed out by the session's pharmacist in the
+    // dispensing ledger and posts quantity x unit cost to the patient's bill,
+    // as one logged change. False for an empty code, a zero quantity, a cost
+    // toCents rejects, a total the bill cannot take or a discharged patient.
+    bool dispense(Patient &p, string_view drugCode, uint32_t quantity, double unitCost) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->dispense(p, drugCode, quantity, unitCost);
+        string code = DispensingLedger::normalizeCode(drugCode);
+        long long unitCents = toCents(unitCost);
+        if (code.empty() || quantity == 0 || unitCents <= 0 ||
+            unitCents > numeric_limits<long long>::max() / quantity)
+            return false;
+        int64_t when = time(nullptr);
+        string_view pharmacist = actorName(console.user);
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        if (p.isDischarged() || !p.getBill().fitsCharge(quantity * unitCents)) return false;
+        logMutation(LogOp::DISPENSE, [&](ByteWriter &w) {
+            w.i32(p.getId()); w.str(code); w.u32(quantity); w.i64(unitCents); w.str(pharmacist); w.i64(when);
+        });
+        auditEvent(AuditAction::DISPENSE, p.getId(), code + " x " + to_string(quantity), quantity * unitCents);
+        auto before = FinancialRollup::stateOf(p.getBill());
+        p.getBill().addChargeCents(dispenseChargeText(code), quantity * unitCents, when);
+        rollupBillChange(p, before, &p.getBill().getCharges());
+        unique_lock<shared_mutex> ledgerLock(ledgerMtx);
+        ledger.add(code, p.getId(), quantity, unitCents, pharmacist, when);
+        return true;
+    }
+
+    // Discharges p: the bill is finalized (its status settled from the
+    // balance, and no further charges) and from the next checkpoint the
+    // record is kept compressed in the snapshot archive. Listings, searches
+    // and the census leave it out from now on; it stays retrievable by ID.
+    // False if p was discharged already.
+    bool discharge(Patient &p) {
+        requireWritable();
+        if (HospitalSystem *owner = foreignOwner(p.getId())) return owner->discharge(p);
+        int64_t when = time(nullptr);
+        MutationScope scope(*this);
+        auto lock = writeHistory(p);
+        if (p.isDischarged()) return false;
+        logMutation(LogOp::DISCHARGE, [&](ByteWriter &w) { w.i32(p.getId()); w.i64(when); });
+        auto before = FinancialRollup::stateOf(p.getBill());
+        applyDischarge(p, when);
+        auditEvent(AuditAction::DISCHARGE, p.getId(), Bill::statusToString(p.getBill().getStatus()),
+                   p.getBill().balanceCents());
+        rollupBillChange(p, before, nullptr);
+        return true;
+    }
+
+    // Per-drug totals from the dispensing ledger; with a drug code, that
+    // drug's most recent entries as well
+    void printDispensingReport(string_view drugCode) const {
+        string code = DispensingLedger::normalizeCode(drugCode);
+        string report = replicationNote();
+        {
+            shared_lock<shared_mutex> lock(ledgerMtx);
+            report += "---- Medication Dispensed ----\n";
+            size_t drugs = 0;
+            for (const auto &u : ledger.usage()) {
+                if (!code.empty() && u.drug != code) continue;
+                report += string(u.drug) + ": " + to_string(u.units) + " units in " + to_string(u.dispenses) +
+                          " dispenses, $" + formatCents(u.cents) + ", last " + formatDate(u.last) + "\n";
+                ++drugs;
+            }
+            if (drugs == 0) report += code.empty() ? "(nothing dispensed yet)\n" : "(nothing dispensed for " + code + ")\n";
+            if (!code.empty() && drugs) {
+                report += "Most recent:\n";
+                for (const auto &e : ledger.forDrug(code, RECENT_DISPENSES))
+                    report += "  " + formatDate(e.at) + "  patient " + to_string(e.patientId) + "  x" +
+                              to_string(e.quantity) + " @ $" + formatCents(e.unitCents) + "  by " + string(e.pharmacist) + "\n";
+            }
+            report += "------------------------------\n";
+        }
+        out() << report;
+    }
+
+    // Read-only views for the role menus. They print a point-in-time version
+    // of the history without the patient's lock, so a slow terminal never
+    // holds up that patient's charges and payments.
+    void printFullRecord(const Patient &p) const {
+        if (const HospitalSystem *owner = foreignOwner(p.getId())) return owner->printFullRecord(p);
+        HistoryView history = viewHistory(p);
+        p.printFullRecord(*history);
+        if (p.isDischarged()) out() << "Discharged: " << formatDate(p.getDischargedAt()) << "\n";
+        shared_lock<shared_mutex> ledgerLock(ledgerMtx);
+        vector<DispensingLedger::Entry> dispensed = ledger.forPatient(p.getId());
+        if (dispensed.empty()) return;
+        out() << "Medication Dispensed:\n";
+        for (const auto &e : dispensed)
+            out() << "  - " << formatDate(e.at) << " " << e.drug << " x" << e.quantity << " @ $"
+                  << formatCents(e.unitCents) << " (by " << e.pharmacist << ")\n";
+    }
+
+    void printBillSummary(const Patient &p) const {
+        if (const HospitalSystem *owner = foreignOwner(p.getId())) return owner->printBillSummary(p);
+        viewHistory(p)->bill.printBillSummary();
+    }
+
+private:
+    static constexpr uint32_t NO_SLOT = numeric_limits<uint32_t>::max();
+    static constexpr size_t RECENT_DISPENSES = 20; // listed by the per-drug report
+
+    static string dispenseChargeText(string_view code) { return "Medication: " + string(code); }
+
+    static string formatDate(int64_t when) {
+        time_t t = static_cast<time_t>(when);
+        tm local;
+        localtime_r(&t, &local);
+        char date[16];
+        strftime(date, sizeof date, "%Y-%m-%d", &local);
+        return date;
+    }
+
+    // Held for the duration of a mutation: keeps checkpointGate shared, then
+    // wakes the compactor if the log is due for a checkpoint.
+    class MutationScope {
+    public:
+        explicit MutationScope(HospitalSystem &s) : sys(s), gate(s.checkpointGate) {}
+        ~MutationScope() {
+            gate.unlock();
+            sys.requestCompaction();
+            sys.evictHistories();
+        }
+    private:
+        HospitalSystem &sys;
+        shared_lock<shared_mutex> gate;
+    };
+
+    void requestCompaction() {
+        if (!store || replaying || !store->shouldCompact()) return;
+        {
+            lock_guard<mutex> lock(compactMtx);
+            compactRequested = true;
+        }
+        compactWake.notify_one();
+    }
+
+    // Compactor thread: writes checkpoints when requested, until destruction.
+    // Sessions wait on checkpointGate meanwhile, but no session runs it.
+    void compactInBackground() {
+        unique_lock<mutex> lock(compactMtx);
+        while (true) {
+            compactWake.wait(lock, [this] { return compactStop || compactRequested; });
+            if (compactStop) return;
+            compactRequested = false;
+            lock.unlock();
+            {
+                unique_lock<shared_mutex> gate(checkpointGate);
+                if (store->shouldCompact()) writeCheckpoint();
+            }
+            evictHistories(); // histories the checkpoint wrote out may now be dropped
+            lock.lock();
+        }
+    }
+
+    // Caller holds checkpointGate exclusively, so no mutation is in flight
+    void writeCheckpoint() {
+        if (!store || isReplica) return;
+        auto view = currentSnapshot();
+        int last = lastPatientId.load();
+        bool ok;
+        {
+            shared_lock<shared_mutex> lock(usersMtx);
+            ok = store->writeSnapshot([&](SnapshotWriter &w) {
+                for (const UserEntry &e : userTable) {
+                    if (e.deleted) continue;
+                    const User &u = asUser(e.record);
+                    w.addUser(u.getUsername(), u.getCredential(), u.getRole());
+                }
+                for (int id = idBase + 1; id <= last; ++id) {
+                    const Patient *p = residentPatient(id);
+                    shared_lock<shared_mutex> record;
+                    if (p) record = shared_lock<shared_mutex>(p->recordLock()); // against loads and evictions
+                    if (p && p->hasHistory()) {
+                        if (p->isDischarged()) w.addArchived(*p);
+                        else w.addPatient(*p);
+                    } else if (long rec = view ? view->findRecord(id) : -1; rec >= 0) {
+                        w.copyPatient(*view, rec, snapTextIds);
+                    } else if (long arch = view ? view->findArchived(id) : -1; arch >= 0) {
+                        w.copyArchived(*view, static_cast<size_t>(arch));
+                    }
+                }
+                shared_lock<shared_mutex> ledgerLock(ledgerMtx);
+                ledger.encode(w.ledger());
+            }, last);
+        }
+        if (!ok) return;
+        shared_ptr<SnapshotView> fresh;
+        if (store->mapSnapshot(fresh) && fresh) switchSnapshot(move(fresh), last);
+    }
+
+    // Unloaded records are read from fresh from now on. Every loaded
+    // history matches it (it was just written, or the replica has applied
+    // the log up to it), so all of them may be dropped from here on.
+    void switchSnapshot(shared_ptr<SnapshotView> fresh, int last) {
+        {
+            lock_guard<mutex> lock(tableMtx);
+            atomic_store(&snapshot, fresh);
+            liveSnapshot.store(fresh.get(), memory_order_release);
+            adoptSnapshot(false);
+        }
+        for (int id = idBase + 1; id <= last; ++id) {
+            Patient *p = residentPatient(id);
+            if (!p) continue;
+            shared_lock<shared_mutex> record(p->recordLock());
+            if (!p->hasHistory()) continue;
+            size_t bytes = p->historyBytes();
+            historyBytes.fetch_add(bytes - p->accountedBytes, memory_order_relaxed); // wraps back when smaller
+            p->accountedBytes = bytes;
+            p->setDirty(false);
+        }
+    }
+
+    // Locks p's record for reading with its history resident, reading the
+    // history back from the snapshot first if it has been dropped
+    shared_lock<shared_mutex> readHistory(const Patient &p) const {
+        for (;;) {
+            shared_lock<shared_mutex> lock(p.recordLock());
+            if (p.hasHistory()) {
+                p.touch();
+                return lock;
+            }
+            lock.unlock();
+            evictHistories(); // makes room first; the new history is then safe from the next sweep
+            unique_lock<shared_mutex> load(p.recordLock());
+            if (!p.hasHistory()) loadHistory(const_cast<Patient&>(p));
+        }
+    }
+
+    // A version of p's history, readable without the record lock. The lock is
+    // taken again only to release it, see Patient::unshareHistory.
+    class HistoryView {
+    public:
+        HistoryView(const Patient &p_, shared_ptr<const PatientHistory> h) : p(p_), version(move(h)) {}
+        HistoryView(const HistoryView &) = delete;
+        HistoryView &operator=(const HistoryView &) = delete;
+        ~HistoryView() {
+            shared_lock<shared_mutex> lock(p.recordLock());
+            version.reset();
+        }
+        const PatientHistory &operator*() const { return *version; }
+        const PatientHistory *operator->() const { return version.get(); }
+
+    private:
+        const Patient &p;
+        shared_ptr<const PatientHistory> version;
+    };
+
+    HistoryView viewHistory(const Patient &p) const {
+        auto lock = readHistory(p);
+        return HistoryView(p, p.historyVersion());
+    }
+
+    // Locks p's record for a change, with its history resident and shared
+    // with no version. The history stays dirty (never dropped) until a
+    // checkpoint has written it.
+    unique_lock<shared_mutex> writeHistory(Patient &p) {
+        unique_lock<shared_mutex> lock(p.recordLock());
+        if (!p.hasHistory()) loadHistory(p);
+        p.unshareHistory();
+        p.touch();
+        p.setDirty(true);
+        return lock;
+    }
+
+    // Caller holds p's lock exclusively. The snapshot and snapTextIds are
+    // read under tableMtx, so a checkpoint cannot swap them mid-record.
+    void loadHistory(Patient &p) const {
+        auto h = make_shared<PatientHistory>();
+        {
+            lock_guard<mutex> lock(tableMtx);
+            long rec = snapshot ? snapshot->findRecord(p.getId()) : -1;
+            ArchivedPatient a;
+            if (rec >= 0) readHistoryRecord(*snapshot, rec, *h);
+            else if (readArchived(snapshot.get(), p.getId(), a) >= 0) *h = move(a.history);
+        }
+        p.accountedBytes = h->bytes();
+        historyBytes.fetch_add(p.accountedBytes, memory_order_relaxed);
+        p.setHistory(move(h));
+        p.touch();
+        HMS_COUNT(Counter::HISTORY_LOADS, 1);
+    }
+
+    // Caller holds tableMtx (for snapTextIds)
+    void readHistoryRecord(const SnapshotView &v, long rec, PatientHistory &h) const {
+        SnapPatient r = v.record(rec);
+        for (uint32_t i = 0, n = v.listSize(r.diagnoses); i < n; ++i) h.diagnoses.emplace_back(v.listItem(r.diagnoses, i));
+        for (uint32_t i = 0, n = v.listSize(r.medicalNotes); i < n; ++i) h.medicalNotes.emplace_back(v.listItem(r.medicalNotes, i));
+        for (uint32_t i = 0, n = v.listSize(r.prescriptions); i < n; ++i) h.prescriptions.emplace_back(v.listItem(r.prescriptions, i));
+        for (int kind = 0; kind < 2; ++kind) {
+            uint64_t block = kind == 0 ? r.charges : r.payments;
+            for (uint32_t i = 0, n = v.itemCount(block); i < n; ++i) {
+                uint32_t text; long long cents; int64_t when;
+                v.item(block, i, text, cents, when);
+                const string &t = billText().lookup(text < snapTextIds.size() ? snapTextIds[text] : 0);
+                if (kind == 0) h.bill.addChargeCents(t, cents, when);
+                else h.bill.addPaymentCents(t, cents, when);
+            }
+        }
+        h.bill.setStatus(static_cast<Bill::Status>(r.status));
+    }
+
+    // Drops clean histories while the loaded total is over the budget. A
+    // clock sweep over the patient table approximates least-recently-used:
+    // a history used since the hand last passed gets another round, and one
+    // sweep goes round at most once, so it never drops what was just used. Records
+    // are only try-locked, so a sweep never waits on (or for) a session, and
+    // one sweep runs at a time; the others just carry on.
+    void evictHistories() const {
+        size_t budget = historyBudget.load(memory_order_relaxed);
+        if (!store || replaying || historyBytes.load(memory_order_relaxed) <= budget) return;
+        unique_lock<mutex> sweep(evictMtx, try_to_lock);
+        if (!sweep) return;
+        size_t target = budget - budget / 8; // some slack, so the next load does not sweep again
+        size_t n = patients.size();
+        for (size_t step = 0; step < n && historyBytes.load(memory_order_relaxed) > target; ++step) {
+            if (evictHand >= n) evictHand = 0;
+            Patient &p = const_cast<Patient&>(patients[evictHand++]);
+            if (!p.historyResident() || p.isDirty() || p.clearReferenced()) continue;
+            unique_lock<shared_mutex> record(p.recordLock(), try_to_lock);
+            if (!record || !p.hasHistory() || p.isDirty()) continue;
+            shared_ptr<PatientHistory> dropped = p.takeHistory(); // a version may still share it
+            historyBytes.fetch_sub(p.accountedBytes, memory_order_relaxed);
+            p.accountedBytes = 0;
+            record.unlock();
+            HMS_COUNT(Counter::HISTORY_EVICTIONS, 1);
+        }
+    }
+
+    // Decodes patient id from v's archive into a; its index, or -1 if it is
+    // not archived there (or the blob is damaged)
+    static long readArchived(const SnapshotView *v, int id, ArchivedPatient &a) {
+        long i = v ? v->findArchived(id) : -1;
+        if (i < 0) return -1;
+        if (v->archived(static_cast<size_t>(i), a)) return i;
+        cerr << "Storage: archived record of patient " << id << " is damaged\n";
+        return -1;
+    }
+
+    // Caller holds p's lock exclusively, with its history resident
+    void applyDischarge(Patient &p, int64_t when) {
+        p.getBill().finalize();
+        p.markDischarged(when);
+        int local = localId(p.getId());
+        dischargedBits[static_cast<size_t>(local) >> 6].fetch_or(uint64_t(1) << (local & 63), memory_order_release);
+    }
+
+    bool isDischargedId(int id) const {
+        int local = localId(id);
+        size_t word = static_cast<size_t>(local) >> 6;
+        return local > 0 && word < dischargedBits.size() &&
+               (dischargedBits[word].load(memory_order_acquire) >> (local & 63) & 1);
+    }
+
+    // The first ID above id that is not discharged, or above last if none is.
+    // Skips 64 discharged patients per step, without touching their records.
+    // FACILITY_ID_SPAN is a multiple of 64, so the words line up with IDs.
+    int nextActiveId(int id, int last) const {
+        for (++id; id <= last;) {
+            size_t word = static_cast<size_t>(localId(id)) >> 6;
+            if (word >= dischargedBits.size()) return id;
+            uint64_t admitted = ~dischargedBits[word].load(memory_order_acquire) >> (id & 63);
+            if (admitted) return id + __builtin_ctzll(admitted);
+            id = idBase + static_cast<int>((word + 1) << 6);
+        }
+        return id;
+    }
+
+    vector<int> admittedOnly(vector<int> ids) const {
+        ids.erase(remove_if(ids.begin(), ids.end(), [this](int id) { return isDischargedId(id); }), ids.end());
+        return ids;
+    }
+
+    // The snapshot that holds the current content of dropped histories: view,
+    // unless a checkpoint has replaced it since (then held in latest). Caller
+    // holds the patient's lock, so its history cannot be dropped meanwhile.
+    const SnapshotView *latestSnapshot(const SnapshotView *view, shared_ptr<SnapshotView> &latest) const {
+        const SnapshotView *live = liveSnapshot.load(memory_order_acquire);
+        if (live == view || (latest && live == latest.get())) return live;
+        latest = currentSnapshot();
+        return latest.get();
+    }
+
+    // With expected set, leaves the user alone if the credential has changed
+    // since it was read (a rehash must not undo a concurrent password change)
+    void setCredential(User &user, const string &credential, const string *expected = nullptr) {
+        MutationScope scope(*this);
+        unique_lock<shared_mutex> lock(usersMtx);
+        if (expected && user.getCredential() != *expected) return;
+        logMutation(LogOp::SET_PASSWORD, [&](ByteWriter &w) {
+            w.str(user.getUsername());
+            w.str(credential);
+        });
+        user.setCredential(credential);
+    }
+
+    // Data written before passwords were hashed holds them in plaintext;
+    // hash them once at startup so they are gone after the next checkpoint
+    void hashLegacyPasswords() {
+        try {
+            for (UserEntry &e : userTable) {
+                User &u = asUser(e.record);
+                string stored = u.getCredential();
+                if (!e.deleted && stored.compare(0, strlen(SCRYPT_PREFIX), SCRYPT_PREFIX) != 0)
+                    setCredential(u, hashPassword(stored), &stored);
+            }
+        } catch (const StorageFailed&) {
+            // the rest stay as they are until the next startup
+        }
+    }
+
+    static const string &dummyCredential() {
+        static const string credential = hashPassword("");
+        return credential;
+    }
+
+    void seedDefaultAdmin() {
+        addUser("admin", hashPassword("admin123"), Role::ADMIN);
+        seededAdmin = true;
+    }
+
+    shared_ptr<SnapshotView> currentSnapshot() const { return atomic_load(&snapshot); }
+
+    // Entries are indexed while the patient lock is still held, so they reach
+    // the index in the order they were added and never overlap the build.
+    void indexClinicalText(int id, ClinicalField field, string_view text) {
+        lock_guard<shared_mutex> lock(textMtx);
+        if (textBuilt.load(memory_order_relaxed) || textIndex.covers(localId(id))) textIndex.add(id, field, text);
+    }
+
+    // Feeds each patient's history to the index, marking it covered in the
+    // same critical section so later entries are picked up by
+    // indexClinicalText and not read twice. Runs until it has caught up with
+    // registrations that arrive meanwhile.
+    void buildTextIndex() const {
+        if (textBuilt.load(memory_order_acquire)) return;
+        lock_guard<mutex> once(textBuildMtx);
+        if (textBuilt.load()) return;
+        auto view = currentSnapshot();
+        shared_ptr<SnapshotView> latest;
+        for (int id = idBase + 1;; ++id) {
+            unique_lock<shared_mutex> lock(textMtx);
+            if (id > lastPatientId.load()) {
+                textBuilt.store(true, memory_order_release);
+                return;
+            }
+            if (isDischargedId(id)) { // discharged: searches leave it out anyway
+                textIndex.markCovered(localId(id));
+                continue;
+            }
+            const Patient *p = residentPatient(id);
+            shared_lock<shared_mutex> record;
+            if (p) {
+                lock.unlock();
+                record = shared_lock<shared_mutex>(p->recordLock());
+                lock.lock();
+            }
+            const SnapshotView *v = p ? latestSnapshot(view.get(), latest) : view.get();
+            if (p && p->hasHistory()) {
+                for (auto &d : p->getDiagnoses()) textIndex.add(id, ClinicalField::DIAGNOSIS, d);
+                for (auto &n : p->getMedicalNotes()) textIndex.add(id, ClinicalField::NOTE, n);
+                for (auto &rx : p->getPrescriptions()) textIndex.add(id, ClinicalField::PRESCRIPTION, rx);
+            } else if (long rec = v ? v->findRecord(id) : -1; rec >= 0) {
+                SnapPatient r = v->record(rec);
+                auto addList = [&](uint64_t list, ClinicalField field) {
+                    for (uint32_t i = 0, n = v->listSize(list); i < n; ++i)
+                        textIndex.add(id, field, v->listItem(list, i));
+                };
+                addList(r.diagnoses, ClinicalField::DIAGNOSIS);
+                addList(r.medicalNotes, ClinicalField::NOTE);
+                addList(r.prescriptions, ClinicalField::PRESCRIPTION);
+            }
+            // Not registered yet means no history yet
+            textIndex.markCovered(localId(id));
+        }
+    }
+
+    // Caller holds the patient lock. grew is the item list that just gained
+    // an entry, or null for a status change.
+    void rollupBillChange(const Patient &p, const FinancialRollup::BillState &before, const LineItems *grew) {
+        lock_guard<shared_mutex> lock(financeMtx);
+        if (!financeBuilt.load(memory_order_relaxed) && !rollup.covers(localId(p.getId()))) return;
+        const Bill &bill = p.getBill();
+        rollup.changeBill(before, FinancialRollup::stateOf(bill));
+        if (!grew || grew->empty()) return;
+        size_t last = grew->size() - 1;
+        if (grew == &bill.getCharges()) rollup.addCharge(grew->textId[last], grew->cents[last]);
+        else rollup.addPayment(grew->textId[last], grew->cents[last]);
+    }
+
+    // Counts every existing bill once, by the same covered-ID scheme as
+    // buildTextIndex: a patient's bill joins under financeMtx and later
+    // changes are applied by rollupBillChange
+    void buildFinancialRollup() const {
+        if (financeBuilt.load(memory_order_acquire)) return;
+        lock_guard<mutex> once(financeBuildMtx);
+        if (financeBuilt.load()) return;
+        auto view = currentSnapshot();
+        shared_ptr<SnapshotView> latest;
+        const SnapshotView *mapped = nullptr; // the snapshot textIds was built for
+        vector<uint32_t> textIds;             // its text dictionary as billText() IDs
+        for (int id = idBase + 1;; ++id) {
+            unique_lock<shared_mutex> lock(financeMtx);
+            if (id > lastPatientId.load()) {
+                financeBuilt.store(true, memory_order_release);
+                return;
+            }
+            const Patient *p = residentPatient(id);
+            shared_lock<shared_mutex> record;
+            if (p) {
+                lock.unlock();
+                record = shared_lock<shared_mutex>(p->recordLock());
+                lock.lock();
+            }
+            const SnapshotView *v = p ? latestSnapshot(view.get(), latest) : view.get();
+            ArchivedPatient a;
+            const Bill *bill = p && p->hasHistory() ? &p->getBill()
+                               : readArchived(v, id, a) >= 0 ? &a.history.bill : nullptr;
+            if (bill) {
+                rollup.addBill(FinancialRollup::stateOf(*bill));
+                const LineItems &charges = bill->getCharges(), &payments = bill->getPayments();
+                for (size_t i = 0; i < charges.size(); ++i) rollup.addCharge(charges.textId[i], charges.cents[i]);
+                for (size_t i = 0; i < payments.size(); ++i) rollup.addPayment(payments.textId[i], payments.cents[i]);
+            } else if (long rec = v ? v->findRecord(id) : -1; rec >= 0) {
+                if (v != mapped) {
+                    textIds.clear();
+                    for (uint32_t i = 0; i < v->textCount(); ++i) textIds.push_back(billText().intern(string(v->text(i))));
+                    mapped = v;
+                }
+                SnapPatient r = v->record(rec);
+                rollup.addBill({r.chargesCents, r.paymentsCents, static_cast<Bill::Status>(r.status)});
+                for (int kind = 0; kind < 2; ++kind) {
+                    uint64_t block = kind == 0 ? r.charges : r.payments;
+                    for (uint32_t i = 0, n = v->itemCount(block); i < n; ++i) {
+                        uint32_t text; long long cents; int64_t when;
+                        v->item(block, i, text, cents, when);
+                        uint32_t textId = text < textIds.size() ? textIds[text] : 0;
+                        if (kind == 0) rollup.addCharge(textId, cents);
+                        else rollup.addPayment(textId, cents);
+                    }
+                }
+            }
+            rollup.markCovered(localId(id));
+        }
+    }
+
+    // Optionally also reads the bill totals, under the patient lock for a
+    // resident record
+    bool basicFields(int id, const SnapshotView *view, BasicFields &f,
+                     FinancialRollup::BillState *bill = nullptr) const {
+        if (const Patient *p = residentPatient(id)) {
+            f = BasicFields{id, p->getAge(), p->getName(), p->getGender(), p->getSymptoms(), p->getAdmissionDate()};
+            if (bill) {
+                shared_lock<shared_mutex> lock(p->recordLock());
+                if (p->hasHistory()) {
+                    *bill = FinancialRollup::stateOf(p->getBill());
+                } else {
+                    shared_ptr<SnapshotView> latest;
+                    const SnapshotView *v = latestSnapshot(view, latest);
+                    long rec = v ? v->findRecord(id) : -1;
+                    ArchivedPatient a;
+                    SnapPatient r = rec >= 0 ? v->record(rec) : SnapPatient{};
+                    if (rec >= 0) *bill = {r.chargesCents, r.paymentsCents, static_cast<Bill::Status>(r.status)};
+                    else if (readArchived(v, id, a) >= 0) *bill = FinancialRollup::stateOf(a.history.bill);
+                    else *bill = {};
+                }
+            }
+            return true;
+        }
+        long rec = view ? view->findRecord(id) : -1;
+        if (rec < 0) {
+            // Archived: loaded into the patient table, as findPatientById would
+            if (!view || view->findArchived(id) < 0) return false;
+            return const_cast<HospitalSystem*>(this)->findPatientById(id) && basicFields(id, view, f, bill);
+        }
+        SnapPatient r = view->record(rec);
+        f = BasicFields{r.id, r.age, view->str(r.name), view->str(r.gender),
+                        view->str(r.symptoms), view->str(r.admissionDate)};
+        if (bill) *bill = {r.chargesCents, r.paymentsCents, static_cast<Bill::Status>(r.status)};
+        return true;
+    }
+
+    int localId(int id) const { return id - idBase; }
+    // The facility holding id when that is not this one (see FacilityRouter)
+    HospitalSystem *foreignOwner(int id) const;
+
+    Patient *residentPatient(int id) {
+        int local = localId(id);
+        if (local <= 0 || static_cast<size_t>(local) >= patientSlot.size()) return nullptr;
+        uint32_t slot = patientSlot[local].load(memory_order_acquire);
+        return slot == NO_SLOT ? nullptr : &patients[slot];
+    }
+    const Patient *residentPatient(int id) const {
+        return const_cast<HospitalSystem*>(this)->residentPatient(id);
+    }
+
+    void raiseLastPatientId(int id) {
+        int cur = lastPatientId.load();
+        while (cur < id && !lastPatientId.compare_exchange_weak(cur, id)) {}
+    }
+
+    // Picks up users, the ID counter and the bill text dictionary from a newly
+    // mapped snapshot. Patient records stay in the mapping until touched.
+    void adoptSnapshot(bool loadUsers) {
+        const SnapshotView &v = *snapshot;
+        snapTextIds.clear();
+        for (uint32_t i = 0; i < v.textCount(); ++i)
+            snapTextIds.push_back(billText().intern(string(v.text(i))));
+        raiseLastPatientId(v.lastPatientId());
+        if (!loadUsers) return; // a checkpoint remap; the ledger and discharges are already resident
+        for (size_t i = 0; i < v.archivedCount(); ++i) {
+            int id = localId(v.archivedEntry(i).id);
+            if (id <= 0) continue;
+            while (dischargedBits.size() <= static_cast<size_t>(id) >> 6) dischargedBits.emplace_back(0);
+            dischargedBits[static_cast<size_t>(id) >> 6].fetch_or(uint64_t(1) << (id & 63), memory_order_relaxed);
+        }
+        if (!ledger.decode(v.ledger())) cerr << "Storage: dispensing ledger in snapshot is damaged\n";
+        ByteReader r = v.users();
+        for (uint32_t n = r.u32(); n > 0 && r.good(); --n) {
+            string uname = r.str();
+            string credential = r.str();
+            Role role = static_cast<Role>(r.u8());
+            if (r.good()) addUserRecord(uname, credential, role);
+        }
+    }
+
+    // Copies the basic fields of one snapshot record into the resident
+    // patient table; the history stays in the snapshot until it is read.
+    // Caller holds tableMtx.
+    Patient &materialize(const SnapshotView &v, long rec) {
+        SnapPatient r = v.record(rec);
+        uint32_t slot = static_cast<uint32_t>(patients.size());
+        Patient &p = patients.emplace_back(r.id, string(v.str(r.name)), r.age, v.str(r.gender),
+                                           string(v.str(r.symptoms)), string(v.str(r.admissionDate)), true);
+        publishPatient(r.id, slot);
+        return p;
+    }
+
+    // Loads an archived patient's basic fields, discharge time and (since
+    // the whole blob has been read) history. Caller holds tableMtx.
+    Patient *materializeArchived(const SnapshotView &v, long i) {
+        ArchivedPatient a;
+        if (!v.archived(static_cast<size_t>(i), a)) {
+            cerr << "Storage: archived record " << i << " is damaged\n";
+            return nullptr;
+        }
+        uint32_t slot = static_cast<uint32_t>(patients.size());
+        Patient &p = patients.emplace_back(a.id, move(a.name), a.age, a.gender, move(a.symptoms),
+                                           move(a.admissionDate), true);
+        p.markDischarged(a.dischargedAt);
+        p.setHistory(make_shared<PatientHistory>(move(a.history)));
+        p.accountedBytes = p.historyBytes();
+        historyBytes.fetch_add(p.accountedBytes, memory_order_relaxed);
+        publishPatient(a.id, slot);
+        return &p;
+    }
+
+    // The user table changes behind addUser and deleteUser; replay applies
+    // logged ones directly
+    bool addUserRecord(const string &username, const string &credential, Role role) {
+        optional<UserRecord> record = makeUser(username, credential, role);
+        if (!record) return false;
+        MutationScope scope(*this);
+        unique_lock<shared_mutex> lock(usersMtx);
+        if (usersByName.count(username)) return false;
+        logMutation(LogOp::ADD_USER, [&](ByteWriter &w) {
+            w.str(username);
+            w.str(credential);
+            w.u8(static_cast<uint8_t>(role));
+        });
+        if (audit) auditEvent(AuditAction::ADD_USER, 0, username + " (" + roleToString(role) + ")");
+        if (role == Role::ADMIN) adminCount++;
+        uint32_t slot = static_cast<uint32_t>(userTable.size());
+        UserEntry &entry = userTable.emplace_back(move(*record));
+        usersByName.emplace(asUser(entry.record).getUsername(), slot);
+        ++activeUsers;
+        return true;
+    }
+
+    // The entry stays in the table (marked deleted), so a session that is
+    // still logged in as this user keeps a valid handle
+    bool deleteUserRecord(const string &username) {
+        MutationScope scope(*this);
+        unique_lock<shared_mutex> lock(usersMtx);
+        auto found = usersByName.find(username);
+        if (found == usersByName.end()) return false;
+        UserEntry &entry = userTable[found->second];
+        // Prevent deleting the last admin
+        bool admin = asUser(entry.record).getRole() == Role::ADMIN;
+        if (admin && adminCount <= 1) {
+            out() << "Cannot delete the last Admin account.\n";
+            return false;
+        }
+        logMutation(LogOp::DELETE_USER, [&](ByteWriter &w) { w.str(username); });
+        auditEvent(AuditAction::DELETE_USER, 0, username);
+        if (admin) adminCount--;
+        usersByName.erase(found);
+        entry.deleted = true;
+        --activeUsers;
+        return true;
+    }
+
+    // Adds a patient whose ID is already taken from lastPatientId. The new
+    // (empty) bill joins the rollup in the same step as the insert, so the
+    // rollup build sees either both or neither.
+    void addRegisteredPatient(int id, string name, int age, string_view gender, string symptoms, string date) {
+        const Patient *p;
+        {
+            lock_guard<mutex> lock(tableMtx);
+            lock_guard<shared_mutex> finance(financeMtx);
+            p = &insertPatient(id, move(name), age, gender, move(symptoms), move(date));
+            if (financeBuilt.load(memory_order_relaxed) || rollup.covers(localId(id))) rollup.addBill({});
+        }
+        unique_lock<shared_mutex> lock(searchMtx);
+        if (searchBuilt)
+            search.add(BasicFields{id, age, p->getName(), p->getGender(), p->getSymptoms(), p->getAdmissionDate()});
+    }
+
+    // Caller holds tableMtx
+    Patient &insertPatient(int id, string name, int age, string_view gender, string symptoms, string date) {
+        uint32_t slot = static_cast<uint32_t>(patients.size());
+        Patient &p = patients.emplace_back(id, move(name), age, gender, move(symptoms), move(date));
+        p.accountedBytes = p.historyBytes();
+        historyBytes.fetch_add(p.accountedBytes, memory_order_relaxed);
+        publishPatient(id, slot);
+        return p;
+    }
+
+    void publishPatient(int id, uint32_t slot) {
+        raiseLastPatientId(id);
+        size_t local = static_cast<size_t>(localId(id));
+        while (patientSlot.size() <= local) patientSlot.emplace_back(NO_SLOT);
+        while (dischargedBits.size() <= local >> 6) dischargedBits.emplace_back(0);
+        patientSlot[local].store(slot, memory_order_release);
+    }
 
-// Patient record
-class Patient {
-public:
-    Patient(int id_, const string &name_, int age_, const string &gender_,
-            const string &symptoms_, const string &admissionDate_)
-        : id(id_), name(name_), age(age_), gender(gender_),
-          symptoms(symptoms_), admissionDate(admissionDate_) {}
+    // Queues an audit event for the session's logged-in user (see AuditLog).
+    // Called next to logMutation, under the same locks, so a patient's events
+    // are in the order their changes were applied.
+    void auditEvent(AuditAction action, int patientId, string_view text = {}, long long cents = 0) {
+        if (audit) audit->record(console.user, action, patientId, text, cents);
+    }
 
-    int getId() const { return id; }
-    string getName() const { return name; }
+    // Appends one mutation to the log before it is applied. Does nothing
+    // in-memory or while replaying. Throws StorageFailed if the log does not
+    // hold the record, so the caller unwinds without applying it.
+    template <typename Encode>
+    void logMutation(LogOp op, Encode &&encode) {
+        if (!store || replaying || isReplica) return;
+        thread_local ByteWriter rec; // keeps its capacity between records
+        rec.clear();
+        rec.u8(static_cast<uint8_t>(op));
+        encode(rec);
+        if (!store->append(rec)) throw StorageFailed{};
+        HMS_COUNT(Counter::LOG_RECORDS, 1);
+        HMS_COUNT(Counter::LOG_BYTES, rec.size());
+    }
 
-    void addDiagnosis(const string &d) {
-        if (!d.empty()) diagnoses.push_back(d);
+    // Applies one logged mutation at startup, and on a replica while its
+    // sessions read, so it takes the locks the mutation itself took and
+    // keeps the indexes and rollup current
+    void applyLogRecord(ByteReader &r) {
+        LogOp op = static_cast<LogOp>(r.u8());
+        if (op == LogOp::ADD_USER) {
+            string uname = r.str();
+            string credential = r.str();
+            Role role = static_cast<Role>(r.u8());
+            if (r.good()) addUserRecord(uname, credential, role);
+            return;
+        }
+        if (op == LogOp::DELETE_USER) {
+            string uname = r.str();
+            if (r.good()) deleteUserRecord(uname);
+            return;
+        }
+        if (op == LogOp::SET_PASSWORD) {
+            string uname = r.str();
+            string credential = r.str();
+            unique_lock<shared_mutex> lock(usersMtx);
+            auto found = usersByName.find(uname);
+            if (r.good() && found != usersByName.end()) asUser(userTable[found->second].record).setCredential(credential);
+            return;
+        }
+        if (op == LogOp::REGISTER_PATIENT) {
+            int id = r.i32();
+            string name = r.str();
+            int age = r.i32();
+            string gender = r.str();
+            string symptoms = r.str();
+            string date = r.str();
+            if (r.good() && !findPatientById(id)) addRegisteredPatient(id, move(name), age, gender, move(symptoms), move(date));
+            return;
+        }
+        Patient *p = findPatientById(r.i32());
+        if (!p) return;
+        auto lock = writeHistory(*p);
+        int id = p->getId();
+        Bill &bill = p->getBill();
+        auto before = FinancialRollup::stateOf(bill);
+        switch (op) {
+            case LogOp::ADD_DIAGNOSIS:
+            case LogOp::ADD_NOTE:
+            case LogOp::ADD_PRESCRIPTION: {
+                string s = r.str();
+                if (!r.good()) return;
+                if (op == LogOp::ADD_DIAGNOSIS) p->addDiagnosis(s), indexClinicalText(id, ClinicalField::DIAGNOSIS, s);
+                else if (op == LogOp::ADD_NOTE) p->addMedicalNote(s), indexClinicalText(id, ClinicalField::NOTE, s);
+                else p->addPrescription(s), indexClinicalText(id, ClinicalField::PRESCRIPTION, s);
+                return;
+            }
+            case LogOp::ADD_CHARGE:
+            case LogOp::ADD_PAYMENT: {
+                string text = r.str();
+                long long cents = r.i64();
+                int64_t when = r.i64();
+                if (!r.good()) return;
+                if (op == LogOp::ADD_CHARGE) bill.addChargeCents(text, cents, when);
+                else bill.addPaymentCents(text, cents, when);
+                rollupBillChange(*p, before, op == LogOp::ADD_CHARGE ? &bill.getCharges() : &bill.getPayments());
+                return;
+            }
+            case LogOp::SET_BILL_STATUS: {
+                uint8_t s = r.u8();
+                if (!r.good()) return;
+                bill.setStatus(static_cast<Bill::Status>(s));
+                rollupBillChange(*p, before, nullptr);
+                return;
+            }
+            case LogOp::DISCHARGE: {
+                int64_t when = r.i64();
+                if (!r.good() || p->isDischarged()) return;
+                applyDischarge(*p, when);
+                rollupBillChange(*p, before, nullptr);
+                return;
+            }
+            case LogOp::DISPENSE: {
+                string code = r.str();
+                uint32_t quantity = r.u32();
+                long long unitCents = r.i64();
+                string pharmacist = r.str();
+                int64_t when = r.i64();
+                if (!r.good()) return;
+                bill.addChargeCents(dispenseChargeText(code), quantity * unitCents, when);
+                rollupBillChange(*p, before, &bill.getCharges());
+                unique_lock<shared_mutex> ledgerLock(ledgerMtx);
+                ledger.add(code, id, quantity, unitCents, pharmacist, when);
+                return;
+            }
+            default: return;
+        }
     }
 
-    void addMedicalNote(const string &note) {
-        if (!note.empty()) medicalNotes.push_back(note);
+    void requireWritable() const {
+        if (isReplica) throw ReadOnlyReplica{};
+        if (store && store->failed()) throw StorageFailed{};
     }
 
-    void addPrescription(const string &presc) {
-        if (!presc.empty()) prescriptions.push_back(presc);
+    // The snapshot just mapped must hold this facility's patients; if not,
+    // nothing is loaded (see opened)
+    bool snapshotMatchesFacility(const string &dataDir) {
+        int last = snapshot ? snapshot->lastPatientId() : 0;
+        if (last == 0 || last == idBase || ownsPatientId(last)) return true; // idBase: none registered yet
+        cerr << "Storage: " << dataDir << " holds patients of facility " << facilityOf(last) << ", not "
+             << facilityId << "\n";
+        failOpen();
+        return false;
     }
 
-    Bill &getBill() { return bill; }
-    const Bill &getBill() const { return bill; }
+    // Leaves the data directory as found; the caller must not use the system (see opened)
+    void failOpen() {
+        store.reset();
+        snapshot.reset();
+        liveSnapshot.store(nullptr, memory_order_release);
+        openFailed = true;
+    }
 
-    void printBasicInfo() const {
-        cout << "Patient ID: " << id << "\n";
-        cout << "Name: " << name << ", Age: " << age << ", Gender: " << gender << "\n";
-        cout << "Symptoms: " << symptoms << "\n";
-        cout << "Date of admission: " << admissionDate << "\n";
+    // Replica follower thread: polls the primary's log until destruction
+    void followPrimary() {
+        unique_lock<mutex> lock(followMtx);
+        while (!followWake.wait_for(lock, replicaOptions.poll, [this] { return followStop; })) {
+            lock.unlock();
+            pollPrimary();
+            evictHistories();
+            lock.lock();
+        }
     }
 
-    void printFullRecord() const {
-        printBasicInfo();
-        cout << "Diagnoses:\n";
-        if (diagnoses.empty()) cout << "  (none)\n";
-        for (auto &d : diagnoses) cout << "  - " << d << "\n";
-        cout << "Medical Notes:\n";
-        if (medicalNotes.empty()) cout << "  (none)\n";
-        for (auto &n : medicalNotes) cout << "  - " << n << "\n";
-        cout << "Prescriptions:\n";
-        if (prescriptions.empty()) cout << "  (none)\n";
-        for (auto &p : prescriptions) cout << "  - " << p << "\n";
-        bill.printBillSummary();
+    // Applies everything the primary has logged so far. When it has moved
+    // on to a new log (a checkpoint), the old one is finished first and the
+    // new snapshot taken over. The lag is measured from the moment the log
+    // was found to have nothing more: every change logged before then is
+    // applied.
+    void pollPrimary() {
+        if (!replicaInSync.load(memory_order_relaxed)) return;
+        auto started = chrono::steady_clock::now();
+        auto apply = [this](ByteReader &r) { applyLogRecord(r); };
+        size_t applied = store->tailLog(apply);
+        if (store->logRotated()) {
+            applied += store->tailLog(apply);
+            shared_ptr<SnapshotView> fresh;
+            if (!store->tailDamaged() && store->tailPending() == 0 && store->followNextLog(fresh)) {
+                if (fresh) switchSnapshot(move(fresh), lastPatientId.load());
+                applied += store->tailLog(apply);
+            }
+        }
+        replicatedRecords.fetch_add(applied, memory_order_relaxed);
+        HMS_COUNT(Counter::REPLICATED_RECORDS, applied);
+        if (store->tailDamaged()) {
+            if (replicaInSync.exchange(false)) cerr << "Replica: lost its place in the primary's log; restart it\n";
+            return;
+        }
+        if (store->tailPending() == 0) {
+            auto ms = chrono::duration_cast<chrono::milliseconds>(started.time_since_epoch());
+            caughtUpAtMs.store(ms.count(), memory_order_relaxed);
+        }
     }
 
-private:
-    int id;
-    string name;
-    int age;
-    string gender;
-    string symptoms;
-    string admissionDate;
 
-    vector<string> diagnoses;
-    vector<string> medicalNotes;
-    vector<string> prescriptions;
-    Bill bill;
-};
+    // Employees in registration order, stored inline; deleted entries stay
+    // as tombstones so handles never dangle
+    struct UserEntry {
+        UserRecord record;
+        bool deleted = false;
+        explicit UserEntry(UserRecord r) : record(move(r)) {}
+    };
+    const int facilityId;           // 0 when not part of a multi-facility deployment
+    const int idBase;               // facilityId * FACILITY_ID_SPAN; IDs above it are ours
+    const FacilityRouter *router = nullptr; // set by FacilityRouter::addFacility
+    bool openFailed = false;
 
-// Base User class
-class User {
-public:
-    User(const string &username_, const string &password_, Role role_)
-        : username(username_), password(password_), role(role_) {}
-    virtual ~User() = default;
+    StableVector<UserEntry, 256> userTable;
+    unordered_map<string_view, uint32_t> usersByName; // views the entry's username
+    size_t activeUsers = 0;
+    int adminCount = 0;
+    StableVector<Patient> patients; // pointer-stable: Patient* handles survive registrations
+    StableVector<atomic<uint32_t>, 4096> patientSlot; // localId -> index into patients
+    StableVector<atomic<uint64_t>, 1024> dischargedBits; // bit per localId; grown under tableMtx
+    atomic<int> lastPatientId;
 
-    string getUsername() const { return username; }
-    Role getRole() const { return role; }
+    unique_ptr<DurableStore> store; // null when running in-memory
+    unique_ptr<AuditLog> audit;     // null when running in-memory
+    DispensingLedger ledger;
+    mutable shared_mutex ledgerMtx; // guards ledger
+    shared_ptr<SnapshotView> snapshot; // records not yet loaded are read from here
+    atomic<const SnapshotView*> liveSnapshot{nullptr}; // snapshot.get(), readable without tableMtx
+    vector<uint32_t> snapTextIds;      // snapshot bill text id -> billText() id
+    bool replaying = false;
+    bool seededAdmin = false;
 
-    bool checkPassword(const string &pw) const { return pw == password; }
-    void setPassword(const string &pw) { password = pw; }
+    // Replica side (see pollPrimary)
+    const bool isReplica = false;
+    ReplicaOptions replicaOptions;
+    atomic<bool> replicaInSync{true};
+    atomic<uint64_t> replicatedRecords{0};
+    atomic<int64_t> caughtUpAtMs{0}; // steady clock
+    thread follower;
+    mutex followMtx;
+    condition_variable followWake;
+    bool followStop = false;
 
-    // showMenu will be defined by derived classes (definitions later)
-    virtual void showMenu(HospitalSystem &sys) = 0;
+    // Primary side (see compactInBackground)
+    thread compactor;
+    mutex compactMtx;
+    condition_variable compactWake;
+    bool compactRequested = false;
+    bool compactStop = false;
 
-protected:
-    string username;
-    string password;
-    Role role;
-};
+    mutable shared_mutex checkpointGate;
+    mutable shared_mutex usersMtx;
+    mutable mutex tableMtx;
 
-// Derived role classes - declarations (definitions for showMenu after HospitalSystem)
-class AdminUser : public User {
-public:
-    AdminUser(const string &username_, const string &password_)
-        : User(username_, password_, Role::ADMIN) {}
-    void showMenu(HospitalSystem &sys) override;
-};
+    static constexpr size_t DEFAULT_HISTORY_BUDGET = size_t(256) << 20;
+    atomic<size_t> historyBudget{DEFAULT_HISTORY_BUDGET};
+    mutable atomic<size_t> historyBytes{0}; // accountedBytes of every loaded history
+    mutable mutex evictMtx;                 // one eviction sweep at a time
+    mutable size_t evictHand = 0;           // clock hand: next slot to look at
 
-class NurseUser : public User {
-public:
-    NurseUser(const string &username_, const string &password_)
-        : User(username_, password_, Role::NURSE) {}
-    void showMenu(HospitalSystem &sys) override;
-};
+    mutable PatientSearchIndex search{idBase};
+    mutable bool searchBuilt = false;
+    mutable shared_mutex searchMtx; // guards search and searchBuilt
 
-class DoctorUser : public User {
-public:
-    DoctorUser(const string &username_, const string &password_)
-        : User(username_, password_, Role::DOCTOR) {}
-    void showMenu(HospitalSystem &sys) override;
-};
+    mutable ClinicalTextIndex textIndex;
+    mutable atomic<bool> textBuilt{false};
+    mutable shared_mutex textMtx; // guards textIndex
+    mutable mutex textBuildMtx;   // one build at a time
 
-class PharmacistUser : public User {
-public:
-    PharmacistUser(const string &username_, const string &password_)
-        : User(username_, password_, Role::PHARMACIST) {}
-    void showMenu(HospitalSystem &sys) override;
+    mutable FinancialRollup rollup;
+    mutable atomic<bool> financeBuilt{false};
+    mutable shared_mutex financeMtx; // guards rollup
+    mutable mutex financeBuildMtx;
 };
 
-class AccountsUser : public User {
-public:
-    AccountsUser(const string &username_, const string &password_)
-        : User(username_, password_, Role::ACCOUNTS) {}
-    void showMenu(HospitalSystem &sys) override;
-};
+// ---------------------------------------------------------------------------
+// Multi-facility deployment: each facility is a HospitalSystem of its own
+// (own data directory, staff, locks and indexes) holding the patients whose
+// IDs carry its number (see FACILITY_ID_SPAN). The router hands each patient
+// ID to the facility that owns it, so lookups and updates made through any
+// facility reach the right records, and runs hospital-wide listings, searches
+// and reports on every facility in parallel before merging the results.
+// ---------------------------------------------------------------------------
 
-// HospitalSystem coordinates everything
-class HospitalSystem {
+class FacilityRouter {
 public:
-    HospitalSystem() {
-        // Create default admin
-        users.push_back(make_shared<AdminUser>("admin", "admin123"));
+    // An empty dataDir keeps the facility in memory; with replica set it is
+    // a read-only replica of the primary facility in dataDir. Null if f is
+    // out of range or already added.
+    HospitalSystem *addFacility(int f, const string &dataDir, const ReplicaOptions *replica = nullptr) {
+        if (f < 1 || f > MAX_FACILITY || byNumber[static_cast<size_t>(f)]) return nullptr;
+        unique_ptr<HospitalSystem> sys;
+        if (dataDir.empty()) sys = make_unique<HospitalSystem>(f);
+        else if (replica) sys = make_unique<HospitalSystem>(dataDir, *replica, f);
+        else sys = make_unique<HospitalSystem>(dataDir, f);
+        sys->router = this;
+        HospitalSystem *added = sys.get();
+        byNumber[static_cast<size_t>(f)] = added;
+        auto at = lower_bound(ordered.begin(), ordered.end(), added,
+                              [](const HospitalSystem *a, const HospitalSystem *b) { return a->facility() < b->facility(); });
+        ordered.insert(at, added);
+        owned.push_back(move(sys));
+        return added;
     }
 
-    void run();
-
-    // User management
-    bool usernameExists(const string &uname) const {
-        for (auto &u : users) if (u->getUsername() == uname) return true;
-        return false;
+    // The facility holding patient id, or null if none does
+    HospitalSystem *shardFor(int id) const {
+        int f = id > 0 ? facilityOf(id) : 0;
+        return f >= 1 && f <= MAX_FACILITY ? byNumber[static_cast<size_t>(f)] : nullptr;
     }
+    HospitalSystem *facility(int f) const {
+        return f >= 1 && f <= MAX_FACILITY ? byNumber[static_cast<size_t>(f)] : nullptr;
+    }
+    // In facility order, which is also patient ID order
+    const vector<HospitalSystem*> &facilities() const { return ordered; }
 
-    void addUser(shared_ptr<User> user) {
-        users.push_back(move(user));
+    Patient *findPatientById(int id) const {
+        HospitalSystem *shard = shardFor(id);
+        return shard ? shard->findPatientById(id) : nullptr;
     }
 
-    bool deleteUser(const string &username) {
-        auto it = find_if(users.begin(), users.end(),
-            [&](const shared_ptr<User> &u) { return u->getUsername() == username; });
-        if (it == users.end()) return false;
-        // Prevent deleting the last admin
-        if ((*it)->getRole() == Role::ADMIN) {
-            int adminCount = 0;
-            for (auto &u : users) if (u->getRole() == Role::ADMIN) adminCount++;
-            if (adminCount <= 1) {
-                cout << "Cannot delete the last Admin account.\n";
-                return false;
-            }
+    // One page across the facilities in ID order; same contract as
+    // HospitalSystem::listPatientsBrief
+    int listPatientsBrief(int afterId, size_t limit) const {
+        string page;
+        page.reserve(64 + limit * 48);
+        if (afterId <= 0) page += "---- Patients (brief) ----\n";
+        size_t shown = 0;
+        int cursor = max(afterId, 0);
+        for (const HospitalSystem *f : ordered) {
+            if (shown == limit) break;
+            cursor = f->appendPatientsBrief(page, cursor, limit, shown);
         }
-        users.erase(it);
-        return true;
+        bool more = false;
+        for (const HospitalSystem *f : ordered) more = more || f->hasPatientsAfter(cursor);
+        if (!more) page += "--------------------------\n";
+        out().write(page.data(), static_cast<streamsize>(page.size()));
+        return more ? cursor : 0;
     }
 
-    void listEmployees() const {
-        cout << "---- Registered Employees ----\n";
-        for (auto &u : users) {
-            cout << "Username: " << u->getUsername() << " | Role: " << roleToString(u->getRole()) << "\n";
-        }
-        cout << "------------------------------\n";
+    vector<int> searchPatients(const PatientSearchIndex::Query &q) const {
+        return gatherIds([&q](const HospitalSystem &f) { return f.searchFacility(q); });
+    }
+    vector<int> searchClinicalText(string_view query, unsigned fields) const {
+        return gatherIds([&](const HospitalSystem &f) { return f.searchFacilityText(query, fields); });
     }
 
-    shared_ptr<User> authenticate(const string &username, const string &password) {
-        for (auto &u : users) {
-            if (u->getUsername() == username && u->checkPassword(password)) return u;
-        }
-        return nullptr;
+    CensusTotals census(const CensusFilter &filter) const {
+        // Each facility's census already spreads over every core
+        CensusTotals total;
+        for (const HospitalSystem *f : ordered) total.merge(f->census(filter));
+        return total;
     }
 
-    // Patient management
-    int registerPatient(const string &name, int age, const string &gender,
-                        const string &symptoms, const string &date) {
-        int id = ++lastPatientId;
-        patients.emplace_back(id, name, age, gender, symptoms, date);
-        cout << "Patient registered with ID: " << id << "\n";
-        return id;
+    FinancialSummary financialSummary() const {
+        vector<FinancialSummary> parts = scatter([](const HospitalSystem &f) { return f.financialSummary(); });
+        FinancialSummary total;
+        for (auto &part : parts) total.merge(part);
+        return total;
     }
 
-    Patient* findPatientById(int id) {
-        for (auto &p : patients) if (p.getId() == id) return &p;
-        return nullptr;
+    void checkpoint() const {
+        for (HospitalSystem *f : ordered) f->checkpoint();
     }
 
-    void listPatientsBrief() const {
-        cout << "---- Patients (brief) ----\n";
-        for (auto &p : patients) {
-            cout << "ID: " << p.getId() << " | Name: " << p.getName() << "\n";
+    // Asked at login when there is more than one facility: staff accounts
+    // belong to a facility
+    HospitalSystem &chooseFacility() const {
+        if (ordered.size() == 1) return *ordered[0];
+        while (true) {
+            out() << "Facility (";
+            for (size_t i = 0; i < ordered.size(); ++i) out() << (i ? ", " : "") << ordered[i]->facility();
+            out() << "): ";
+            if (HospitalSystem *f = facility(readIntInRange(1, MAX_FACILITY))) return *f;
+            out() << "No such facility.\n";
         }
-        cout << "--------------------------\n";
     }
 
-    const vector<shared_ptr<User>>& getUsers() const { return users; }
-
 private:
-    vector<shared_ptr<User>> users;
-    vector<Patient> patients;
-    int lastPatientId = 0;
+    // Runs fn on every facility at once; results in facility order
+    template <typename Fn, typename Result = decltype(declval<Fn&>()(declval<const HospitalSystem&>()))>
+    vector<Result> scatter(Fn fn) const {
+        vector<future<Result>> pending;
+        for (size_t i = 1; i < ordered.size(); ++i)
+            pending.push_back(async(launch::async, [&fn, f = ordered[i]] { return fn(*f); }));
+        vector<Result> results;
+        results.push_back(fn(*ordered[0])); // the calling thread takes the first
+        for (auto &p : pending) results.push_back(p.get());
+        return results;
+    }
+
+    // Each facility's IDs are sorted and lie above the previous facility's,
+    // so concatenating in facility order keeps the whole list sorted
+    template <typename Fn>
+    vector<int> gatherIds(Fn fn) const {
+        vector<int> ids;
+        for (auto &part : scatter(fn)) ids.insert(ids.end(), part.begin(), part.end());
+        return ids;
+    }
+
+    array<HospitalSystem*, MAX_FACILITY + 1> byNumber{};
+    vector<HospitalSystem*> ordered;
+    vector<unique_ptr<HospitalSystem>> owned;
 };
 
+HospitalSystem *HospitalSystem::foreignOwner(int id) const {
+    if (!router || ownsPatientId(id)) return nullptr;
+    return router->shardFor(id);
+}
+
+vector<HospitalSystem*> HospitalSystem::allFacilities() {
+    return router ? router->facilities() : vector<HospitalSystem*>{this};
+}
+
+int HospitalSystem::listPatientsBrief(int afterId, size_t limit) const {
+    if (router) return router->listPatientsBrief(afterId, limit);
+    string page;
+    page.reserve(64 + limit * 48); // typical row, so the page is allocated once
+    if (afterId <= 0) page += "---- Patients (brief) ----\n";
+    size_t shown = 0;
+    int id = appendPatientsBrief(page, afterId, limit, shown);
+    bool more = hasPatientsAfter(id);
+    if (!more) page += "--------------------------\n";
+    out().write(page.data(), static_cast<streamsize>(page.size()));
+    return more ? id : 0;
+}
+
+vector<int> HospitalSystem::searchPatients(const PatientSearchIndex::Query &q) const {
+    return router ? router->searchPatients(q) : searchFacility(q);
+}
+
+vector<int> HospitalSystem::searchClinicalText(string_view query, unsigned fields) const {
+    return router ? router->searchClinicalText(query, fields) : searchFacilityText(query, fields);
+}
+
+FinancialSummary HospitalSystem::hospitalFinancialSummary() const {
+    return router ? router->financialSummary() : financialSummary();
+}
+
+CensusTotals HospitalSystem::hospitalCensus(const CensusFilter &filter) const {
+    return router ? router->census(filter) : census(filter);
+}
+
 // Definitions of showMenu functions for each role (after HospitalSystem defined)
 
+// Listings are shown a page at a time; the user can stop after any page
+constexpr size_t LIST_PAGE_SIZE = 50;
+
+// Why p's bill turned down a charge or payment whose amount was valid
+string billRefusal(const Patient &p, bool payment) {
+    if (!payment && p.isDischarged()) return "Patient has been discharged; the bill is final.\n";
+    return string("That would take the bill's ") + (payment ? "payments" : "charges") + " past $" +
+           formatCents(MAX_BILL_CENTS) + ".\n";
+}
+
+bool wantsNextPage() {
+    string_view more = readLineView("-- Enter for next page, 'q' to stop: ");
+    return more != "q" && more != "Q";
+}
+
+void browsePatients(const HospitalSystem &sys) {
+    int cursor = 0;
+    while ((cursor = sys.listPatientsBrief(cursor, LIST_PAGE_SIZE)) != 0 && wantsNextPage()) {}
+}
+
+void browseEmployees(const HospitalSystem &sys) {
+    size_t offset = 0;
+    while ((offset = sys.listEmployees(offset, LIST_PAGE_SIZE)) != 0 && wantsNextPage()) {}
+}
+
+void showMatches(const HospitalSystem &sys, const vector<int> &ids) {
+    if (ids.empty()) {
+        out() << "No matching patients.\n";
+        return;
+    }
+    out() << ids.size() << " matching patient(s):\n";
+    for (size_t i = 0; i < ids.size(); i += LIST_PAGE_SIZE) {
+        if (i > 0 && !wantsNextPage()) break;
+        auto first = ids.begin() + static_cast<ptrdiff_t>(i);
+        sys.listPatients(vector<int>(first, first + static_cast<ptrdiff_t>(min(LIST_PAGE_SIZE, ids.size() - i))));
+    }
+}
+
+// Blank answers leave that criterion out; at least one is needed
+void searchPatientsMenu(const HospitalSystem &sys) {
+    PatientSearchIndex::Query q;
+    q.name = readLineAllowEmpty("Name starts with (blank for any): ");
+    q.dateFrom = readLineAllowEmpty("Admitted from YYYY-MM-DD (blank for any): ");
+    q.dateTo = readLineAllowEmpty("Admitted to YYYY-MM-DD (blank for any): ");
+    q.symptoms = readLineAllowEmpty("Symptom words (blank for any): ");
+    if (q.name.empty() && q.dateFrom.empty() && q.dateTo.empty() && q.symptoms.empty()) {
+        out() << "No search criteria given.\n";
+        return;
+    }
+    showMatches(sys, sys.searchPatients(q));
+}
+
+void searchClinicalMenu(const HospitalSystem &sys) {
+    out() << "Words are all required; use \"...\" for a phrase, -word to exclude, OR for alternatives.\n";
+    string query = readNonEmptyLine("Search for: ");
+    out() << "Search in:\n1. All clinical records\n2. Diagnoses\n3. Medical notes\n4. Prescriptions\nChoose: ";
+    int where = readIntInRange(1, 4);
+    static const ClinicalField fields[] = {ClinicalField::DIAGNOSIS, ClinicalField::NOTE, ClinicalField::PRESCRIPTION};
+    unsigned mask = where == 1 ? ClinicalTextIndex::ALL_FIELDS : ClinicalTextIndex::fieldBit(fields[where - 2]);
+    showMatches(sys, sys.searchClinicalText(query, mask));
+}
+
+// Blank answers leave that filter out
+void censusMenu(const HospitalSystem &sys) {
+    CensusFilter f;
+    auto readAge = [](const char *prompt, int &age) {
+        while (true) {
+            string_view line = readLineView(prompt);
+            if (trimSpaces(line).empty()) return;
+            int v = 0;
+            if (parseNumber(line, v) && v >= 0) {
+                age = v;
+                return;
+            }
+            out() << "Invalid age.\n";
+        }
+    };
+    readAge("Minimum age (blank for any): ", f.minAge);
+    readAge("Maximum age (blank for any): ", f.maxAge);
+    f.gender = readLineAllowEmpty("Gender (blank for any): ");
+    f.dateFrom = readLineAllowEmpty("Admitted from YYYY-MM-DD (blank for any): ");
+    f.dateTo = readLineAllowEmpty("Admitted to YYYY-MM-DD (blank for any): ");
+    string_view owing = readLineView("Only patients with an outstanding balance? (y/N): ");
+    f.owingOnly = owing == "y" || owing == "Y";
+    sys.printCensusReport(f);
+}
+
 // AdminUser
 void AdminUser::showMenu(HospitalSystem &sys) {
     while (true) {
-        cout << "\n--- Admin Menu ---\n";
-        cout << "1. Register employee\n";
-        cout << "2. Delete employee\n";
-        cout << "3. View all employees\n";
-        cout << "4. Change my password\n";
-        cout << "5. Logout (Back)\n";
-        cout << "Choose an option: ";
-        int opt = readIntInRange(1,5);
+        out() << "\n--- Admin Menu ---\n";
+        out() << "1. Register employee\n";
+        out() << "2. Delete employee\n";
+        out() << "3. View all employees\n";
+        out() << "4. Census report\n";
+        out() << "5. Operation metrics\n";
+        out() << "6. Change my password\n";
+        out() << "7. Logout (Back)\n";
+        out() << "Choose an option: ";
+        int opt = readIntInRange(1,7);
+        HMS_TIME_MENU(Role::ADMIN, opt);
         if (opt == 1) {
             string uname = readNonEmptyLine("Enter username for employee: ");
             if (sys.usernameExists(uname)) {
-                cout << "Username already exists.\n";
+                out() << "Username already exists.\n";
                 continue;
             }
-            cout << "Select role:\n";
-            cout << "1. Doctor\n2. Nurse\n3. Pharmacist\n4. Accounts Manager\nChoose role: ";
+            out() << "Select role:\n";
+            out() << "1. Doctor\n2. Nurse\n3. Pharmacist\n4. Accounts Manager\nChoose role: ";
             int r = readIntInRange(1, 4);
             string pw = readNonEmptyLine("Set password for employee: ");
-            shared_ptr<User> newUser;
-            switch (r) {
-                case 1: newUser = make_shared<DoctorUser>(uname, pw); break;
-                case 2: newUser = make_shared<NurseUser>(uname, pw); break;
-                case 3: newUser = make_shared<PharmacistUser>(uname, pw); break;
-                case 4: newUser = make_shared<AccountsUser>(uname, pw); break;
-                default: break;
-            }
-            sys.addUser(newUser);
-            cout << "Employee registered: " << uname << " (" << roleToString(newUser->getRole()) << ")\n";
+            static const Role roles[] = {Role::DOCTOR, Role::NURSE, Role::PHARMACIST, Role::ACCOUNTS};
+            if (sys.addUser(uname, hashPassword(pw), roles[r - 1]))
+                out() << "Employee registered: " << uname << " (" << roleToString(roles[r - 1]) << ")\n";
+            else
+                out() << "Username already exists.\n";
         } else if (opt == 2) {
-            sys.listEmployees();
+            browseEmployees(sys);
             string del = readNonEmptyLine("Enter username to delete (or type 'back' to cancel): ");
             if (del == "back") continue;
             if (!sys.usernameExists(del)) {
-                cout << "No such user.\n";
+                out() << "No such user.\n";
                 continue;
             }
             if (del == username) {
-                cout << "You cannot delete your own account here.\n";
+                out() << "You cannot delete your own account here.\n";
                 continue;
             }
-            if (sys.deleteUser(del)) cout << "Deleted user: " << del << "\n";
-            else cout << "Failed to delete user.\n";
+            if (sys.deleteUser(del)) out() << "Deleted user: " << del << "\n";
+            else out() << "Failed to delete user.\n";
         } else if (opt == 3) {
-            sys.listEmployees();
+            browseEmployees(sys);
         } else if (opt == 4) {
+            censusMenu(sys);
+        } else if (opt == 5) {
+            printMetricsReport();
+            string_view dump = readLineView("Show the machine-readable dump? (y/n): ");
+            if (dump == "y" || dump == "Y") {
+                ostringstream text;
+                writeMetricsDump(text);
+                out() << text.str();
+            }
+        } else if (opt == 6) {
             string newpw = readNonEmptyLine("Enter new password: ");
-            setPassword(newpw);
-            cout << "Password updated.\n";
+            sys.changePassword(*this, newpw);
+            out() << "Password updated.\n";
         } else {
             break;
         }
@@ -409,42 +5530,37 @@ void AdminUser::showMenu(HospitalSystem &sys) {
 // NurseUser
 void NurseUser::showMenu(HospitalSystem &sys) {
     while (true) {
-        cout << "\n--- Nurse Menu ---\n";
-        cout << "1. Register new patient\n";
-        cout << "2. View basic patient information\n";
-        cout << "3. Change my password\n";
-        cout << "4. Logout (Back)\n";
-        cout << "Choose an option: ";
-        int opt = readIntInRange(1,4);
+        out() << "\n--- Nurse Menu ---\n";
+        out() << "1. Register new patient\n";
+        out() << "2. View basic patient information\n";
+        out() << "3. Search patients\n";
+        out() << "4. Change my password\n";
+        out() << "5. Logout (Back)\n";
+        out() << "Choose an option: ";
+        int opt = readIntInRange(1,5);
+        HMS_TIME_MENU(Role::NURSE, opt);
         if (opt == 1) {
             string name = readNonEmptyLine("Full name: ");
-            int age;
-            while (true) {
-                cout << "Age: ";
-                if ((cin >> age) && age > 0) {
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                    break;
-                }
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Invalid age.\n";
-            }
+            out() << "Age: ";
+            int age = readIntInRange(1, 150);
             string gender = readNonEmptyLine("Gender: ");
             string symptoms = readNonEmptyLine("Symptoms: ");
             string date = readNonEmptyLine("Date of admission (YYYY-MM-DD): ");
-            sys.registerPatient(name, age, gender, symptoms, date);
+            int id = sys.registerPatient(move(name), age, gender, move(symptoms), move(date));
+            if (id == 0) out() << "No patient IDs left at this facility.\n";
+            else out() << "Patient registered with ID: " << id << "\n";
         } else if (opt == 2) {
-            sys.listPatientsBrief();
-            cout << "Enter patient ID to view (0 to cancel): ";
-            int id = readIntInRange(0, 1000000);
+            browsePatients(sys);
+            out() << "Enter patient ID to view (0 to cancel): ";
+            int id = readIntInRange(0, MAX_PATIENT_ID);
             if (id == 0) continue;
-            Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
-            p->printBasicInfo();
+            if (!sys.printBasicInfo(id)) out() << "Patient not found.\n";
         } else if (opt == 3) {
+            searchPatientsMenu(sys);
+        } else if (opt == 4) {
             string newpw = readNonEmptyLine("Enter new password: ");
-            setPassword(newpw);
-            cout << "Password updated.\n";
+            sys.changePassword(*this, newpw);
+            out() << "Password updated.\n";
         } else break;
     }
 }
@@ -452,70 +5568,79 @@ void NurseUser::showMenu(HospitalSystem &sys) {
 // DoctorUser
 void DoctorUser::showMenu(HospitalSystem &sys) {
     while (true) {
-        cout << "\n--- Doctor Menu ---\n";
-        cout << "1. View registered patient records (brief)\n";
-        cout << "2. View full patient record by ID\n";
-        cout << "3. Add diagnostic information\n";
-        cout << "4. Add medical notes\n";
-        cout << "5. Prescribe medication\n";
-        cout << "6. Add billing entry (consultation/tests)\n";
-        cout << "7. Change my password\n";
-        cout << "8. Logout (Back)\n";
-        cout << "Choose an option: ";
-        int opt = readIntInRange(1,8);
+        out() << "\n--- Doctor Menu ---\n";
+        out() << "1. View registered patient records (brief)\n";
+        out() << "2. View full patient record by ID\n";
+        out() << "3. Add diagnostic information\n";
+        out() << "4. Add medical notes\n";
+        out() << "5. Prescribe medication\n";
+        out() << "6. Add billing entry (consultation/tests)\n";
+        out() << "7. Search patients\n";
+        out() << "8. Search clinical records\n";
+        out() << "9. Discharge patient\n";
+        out() << "10. Change my password\n";
+        out() << "11. Logout (Back)\n";
+        out() << "Choose an option: ";
+        int opt = readIntInRange(1,11);
+        HMS_TIME_MENU(Role::DOCTOR, opt);
         if (opt == 1) {
-            sys.listPatientsBrief();
+            browsePatients(sys);
         } else if (opt == 2) {
-            cout << "Enter patient ID (0 to cancel): ";
-            int id = readIntInRange(0, 1000000);
+            out() << "Enter patient ID (0 to cancel): ";
+            int id = readIntInRange(0, MAX_PATIENT_ID);
             if (id == 0) continue;
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
-            p->printFullRecord();
+            if (!p) { out() << "Patient not found.\n"; continue; }
+            sys.printFullRecord(*p);
         } else if (opt == 3) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
+            if (!p) { out() << "Patient not found.\n"; continue; }
             string diag = readNonEmptyLine("Enter diagnostic information: ");
-            p->addDiagnosis(diag);
-            cout << "Diagnosis added.\n";
+            sys.addDiagnosis(*p, diag);
+            out() << "Diagnosis added.\n";
         } else if (opt == 4) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
+            if (!p) { out() << "Patient not found.\n"; continue; }
             string note = readNonEmptyLine("Enter medical note: ");
-            p->addMedicalNote(note);
-            cout << "Medical note added.\n";
+            sys.addMedicalNote(*p, note);
+            out() << "Medical note added.\n";
         } else if (opt == 5) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
+            if (!p) { out() << "Patient not found.\n"; continue; }
             string presc = readNonEmptyLine("Enter prescription details: ");
-            p->addPrescription(presc);
-            cout << "Prescription recorded.\n";
+            sys.addPrescription(*p, presc);
+            out() << "Prescription recorded.\n";
         } else if (opt == 6) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
+            if (!p) { out() << "Patient not found.\n"; continue; }
             string desc = readNonEmptyLine("Charge description (e.g., Consultation, X-ray): ");
-            double amt;
-            while (true) {
-                cout << "Amount: $";
-                if ((cin >> amt) && amt > 0.0) { cin.ignore(numeric_limits<streamsize>::max(), '\n'); break; }
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Invalid amount.\n";
-            }
-            p->getBill().addCharge(desc, amt);
-            cout << "Charge added to bill.\n";
+            double amt = readAmount("Amount: $");
+            if (sys.addCharge(*p, desc, amt)) out() << "Charge added to bill.\n";
+            else out() << billRefusal(*p, false);
         } else if (opt == 7) {
+            searchPatientsMenu(sys);
+        } else if (opt == 8) {
+            searchClinicalMenu(sys);
+        } else if (opt == 9) {
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
+            Patient* p = sys.findPatientById(id);
+            if (!p) { out() << "Patient not found.\n"; continue; }
+            if (!sys.discharge(*p)) { out() << "Patient was already discharged.\n"; continue; }
+            out() << "Patient discharged. Final bill:\n";
+            sys.printBillSummary(*p);
+        } else if (opt == 10) {
             string newpw = readNonEmptyLine("Enter new password: ");
-            setPassword(newpw);
-            cout << "Password updated.\n";
+            sys.changePassword(*this, newpw);
+            out() << "Password updated.\n";
         } else break;
     }
 }
@@ -523,48 +5648,55 @@ void DoctorUser::showMenu(HospitalSystem &sys) {
 // PharmacistUser
 void PharmacistUser::showMenu(HospitalSystem &sys) {
     while (true) {
-        cout << "\n--- Pharmacist Menu ---\n";
-        cout << "1. View patient medical record (full)\n";
-        cout << "2. Record medication dispensed\n";
-        cout << "3. Add medication cost to patient bill\n";
-        cout << "4. Change my password\n";
-        cout << "5. Logout (Back)\n";
-        cout << "Choose an option: ";
-        int opt = readIntInRange(1,5);
+        out() << "\n--- Pharmacist Menu ---\n";
+        out() << "1. View patient medical record (full)\n";
+        out() << "2. Record medication dispensed\n";
+        out() << "3. Add medication cost to patient bill\n";
+        out() << "4. Search clinical records\n";
+        out() << "5. Medication usage report\n";
+        out() << "6. Change my password\n";
+        out() << "7. Logout (Back)\n";
+        out() << "Choose an option: ";
+        int opt = readIntInRange(1,7);
+        HMS_TIME_MENU(Role::PHARMACIST, opt);
         if (opt == 1) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
-            p->printFullRecord();
+            if (!p) { out() << "Patient not found.\n"; continue; }
+            sys.printFullRecord(*p);
         } else if (opt == 2) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
-            string med = readNonEmptyLine("Enter medication details dispensed: ");
-            p->addPrescription(med); // store medications as prescriptions for now
-            cout << "Medication dispensed and recorded.\n";
+            if (!p) { out() << "Patient not found.\n"; continue; }
+            string code = readNonEmptyLine("Drug code (e.g., AMOX500): ");
+            out() << "Quantity: ";
+            int quantity = readIntInRange(1, 100000);
+            double unitCost = readAmount("Unit cost: $");
+            if (DispensingLedger::normalizeCode(code).empty())
+                out() << "Invalid drug code.\n";
+            else if (sys.dispense(*p, code, static_cast<uint32_t>(quantity), unitCost))
+                out() << "Medication dispensed and recorded; cost added to bill.\n";
+            else
+                out() << billRefusal(*p, false);
         } else if (opt == 3) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
+            if (!p) { out() << "Patient not found.\n"; continue; }
             string desc = readNonEmptyLine("Medication description: ");
-            double amt;
-            while (true) {
-                cout << "Amount: $";
-                if ((cin >> amt) && amt > 0.0) { cin.ignore(numeric_limits<streamsize>::max(), '\n'); break; }
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Invalid amount.\n";
-            }
-            p->getBill().addCharge(desc, amt);
-            cout << "Medication cost added to bill.\n";
+            double amt = readAmount("Amount: $");
+            if (sys.addCharge(*p, desc, amt)) out() << "Medication cost added to bill.\n";
+            else out() << billRefusal(*p, false);
         } else if (opt == 4) {
+            searchClinicalMenu(sys);
+        } else if (opt == 5) {
+            sys.printDispensingReport(readLineView("Drug code (blank for all): "));
+        } else if (opt == 6) {
             string newpw = readNonEmptyLine("Enter new password: ");
-            setPassword(newpw);
-            cout << "Password updated.\n";
+            sys.changePassword(*this, newpw);
+            out() << "Password updated.\n";
         } else break;
     }
 }
@@ -572,42 +5704,37 @@ void PharmacistUser::showMenu(HospitalSystem &sys) {
 // AccountsUser
 void AccountsUser::showMenu(HospitalSystem &sys) {
     while (true) {
-        cout << "\n--- Accounts Manager Menu ---\n";
-        cout << "1. View complete patient bill\n";
-        cout << "2. Record payment made\n";
-        cout << "3. Mark bill status manually\n";
-        cout << "4. Change my password\n";
-        cout << "5. Logout (Back)\n";
-        cout << "Choose an option: ";
-        int opt = readIntInRange(1,5);
+        out() << "\n--- Accounts Manager Menu ---\n";
+        out() << "1. View complete patient bill\n";
+        out() << "2. Record payment made\n";
+        out() << "3. Mark bill status manually\n";
+        out() << "4. Hospital financial summary\n";
+        out() << "5. Change my password\n";
+        out() << "6. Logout (Back)\n";
+        out() << "Choose an option: ";
+        int opt = readIntInRange(1,6);
+        HMS_TIME_MENU(Role::ACCOUNTS, opt);
         if (opt == 1) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
-            p->getBill().printBillSummary();
+            if (!p) { out() << "Patient not found.\n"; continue; }
+            sys.printBillSummary(*p);
         } else if (opt == 2) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
+            if (!p) { out() << "Patient not found.\n"; continue; }
             string method = readNonEmptyLine("Payment method (e.g., Cash/Card/Insurance): ");
-            double amt;
-            while (true) {
-                cout << "Amount paid: $";
-                if ((cin >> amt) && amt > 0.0) { cin.ignore(numeric_limits<streamsize>::max(), '\n'); break; }
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Invalid amount.\n";
-            }
-            p->getBill().addPayment(method, amt);
-            cout << "Payment recorded.\n";
+            double amt = readAmount("Amount paid: $");
+            if (sys.addPayment(*p, method, amt)) out() << "Payment recorded.\n";
+            else out() << billRefusal(*p, true);
         } else if (opt == 3) {
-            cout << "Enter patient ID: ";
-            int id = readIntInRange(1, 1000000);
+            out() << "Enter patient ID: ";
+            int id = readIntInRange(1, MAX_PATIENT_ID);
             Patient* p = sys.findPatientById(id);
-            if (!p) { cout << "Patient not found.\n"; continue; }
-            cout << "Select status:\n1. Fully cleared\n2. Partially paid\n3. Pending\nChoose: ";
+            if (!p) { out() << "Patient not found.\n"; continue; }
+            out() << "Select status:\n1. Fully cleared\n2. Partially paid\n3. Pending\nChoose: ";
             int s = readIntInRange(1,3);
             Bill::Status ns;
             switch (s) {
@@ -615,46 +5742,620 @@ void AccountsUser::showMenu(HospitalSystem &sys) {
                 case 2: ns = Bill::Status::PARTIALLY_PAID; break;
                 default: ns = Bill::Status::PENDING; break;
             }
-            p->getBill().setStatus(ns);
-            cout << "Bill status updated.\n";
+            if (sys.setBillStatus(*p, ns)) out() << "Bill status updated.\n";
+            else out() << "Patient has been discharged; the bill is final.\n";
         } else if (opt == 4) {
+            sys.printFinancialReport();
+        } else if (opt == 5) {
             string newpw = readNonEmptyLine("Enter new password: ");
-            setPassword(newpw);
-            cout << "Password updated.\n";
+            sys.changePassword(*this, newpw);
+            out() << "Password updated.\n";
         } else break;
     }
 }
 
-// HospitalSystem::run implementation
+// HospitalSystem::run implementation: one interactive session on the console
 void HospitalSystem::run() {
+    try {
+        runSession();
+    } catch (const InputClosed&) {
+        // console input ended; fall through to the final checkpoint
+    }
+    for (HospitalSystem *f : allFacilities()) f->checkpoint();
+}
+
+// Login loop for a single terminal; returns when that terminal chooses Exit.
+// With several facilities the user first picks the one they work at.
+void HospitalSystem::runSession() {
     while (true) {
-        cout << "\n=== Hospital Management System ===\n";
-        cout << "1. Login\n";
-        cout << "2. Exit\n";
-        cout << "Choose an option: ";
+        out() << "\n=== Hospital Management System ===\n";
+        out() << replicationNote();
+        out() << "1. Login\n";
+        out() << "2. Exit\n";
+        out() << "Choose an option: ";
         int opt = readIntInRange(1,2);
         if (opt == 2) {
-            cout << "Exiting. Goodbye.\n";
+            out() << "Exiting. Goodbye.\n";
             break;
         }
         // Login
+        HospitalSystem &home = router ? router->chooseFacility() : *this;
         string uname = readNonEmptyLine("Username: ");
         string pw = readNonEmptyLine("Password: ");
-        auto user = authenticate(uname, pw);
-        if (!user) {
-            cout << "Invalid username or password.\n";
+        UserHandle h = home.authenticate(uname, pw);
+        if (!h) {
+            out() << "Invalid username or password.\n";
             continue;
         }
-        cout << "Login successful. Welcome, " << user->getUsername() << " (" << roleToString(user->getRole()) << ")\n";
-        user->showMenu(*this);
-        cout << "Logged out.\n";
+        const User &u = home.user(h);
+        out() << "Login successful. Welcome, " << u.getUsername() << " (" << roleToString(u.getRole()) << ")\n";
+        console.user = &u;
+        home.showMenu(h);
+        console.user = nullptr;
+        out() << "Logged out.\n";
     }
 }
 
+// ---------------------------------------------------------------------------
+// Server mode: many terminals share one HospitalSystem over TCP. A fixed pool
+// of workers serves the connections; each worker points its thread's Console
+// at the session socket and runs the ordinary login loop and role menus.
+// ---------------------------------------------------------------------------
+
+// Buffered output stream adapter over a connected socket. Input is read by an
+// InputReader on the same socket, which flushes this before every blocking
+// read, so prompts reach the terminal.
+class SocketStreamBuf : public streambuf {
+public:
+    explicit SocketStreamBuf(int fd_) : fd(fd_) {
+        setp(outBuf, outBuf + sizeof outBuf);
+    }
+    ~SocketStreamBuf() override { sync(); }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (sync() != 0) return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        const char *p = pbase();
+        size_t n = static_cast<size_t>(pptr() - pbase());
+        while (n > 0) {
+            ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        setp(outBuf, outBuf + sizeof outBuf);
+        return 0;
+    }
+
+private:
+    int fd;
+    char outBuf[4096];
+};
+
+class SessionServer {
+public:
+    // A connection with no input for idleTimeout is logged out and closed,
+    // so terminals left open cannot hold on to the workers
+    SessionServer(HospitalSystem &sys_, size_t workers_, chrono::seconds idleTimeout_ = chrono::seconds(300))
+        : sys(sys_), workerCount(max<size_t>(1, workers_)), idleTimeout(idleTimeout_) {}
+
+    bool listenOn(const string &addr, int port) {
+        listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) return fail("socket");
+        int one = 1;
+        ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        sockaddr_in sa{};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(static_cast<uint16_t>(port));
+        if (::inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1) {
+            cerr << "Server: invalid bind address " << addr << "\n";
+            return false;
+        }
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&sa), sizeof sa) != 0) return fail("bind");
+        if (::listen(listenFd, 128) != 0) return fail("listen");
+        return true;
+    }
+
+    // Accepts connections forever, handing each one to the worker pool.
+    // Running out of descriptors or memory only pauses accepting; the loop
+    // ends if the listening socket itself becomes unusable.
+    void serve() {
+        vector<thread> pool;
+        for (size_t i = 0; i < workerCount; ++i) pool.emplace_back([this] { workerLoop(); });
+        while (true) {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) continue;
+                int err = errno;
+                fail("accept");
+                if (err == EBADF || err == EINVAL || err == ENOTSOCK) break;
+                this_thread::sleep_for(chrono::milliseconds(100)); // e.g. EMFILE: let sessions close
+                continue;
+            }
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            if (idleTimeout.count() > 0) {
+                timeval tv{static_cast<time_t>(idleTimeout.count()), 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv); // a terminal that stops reading
+            }
+            {
+                lock_guard<mutex> lock(queueMtx);
+                waiting.push_back(fd);
+            }
+            queueReady.notify_one();
+        }
+        {
+            lock_guard<mutex> lock(queueMtx);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (auto &t : pool) t.join();
+    }
+
+private:
+    void workerLoop() {
+        while (true) {
+            int fd;
+            {
+                unique_lock<mutex> lock(queueMtx);
+                queueReady.wait(lock, [this] { return stopping || !waiting.empty(); });
+                if (waiting.empty()) return;
+                fd = waiting.front();
+                waiting.pop_front();
+            }
+            serveConnection(fd);
+        }
+    }
+
+    void serveConnection(int fd) {
+        {
+            InputReader reader(fd);
+            SocketStreamBuf buf(fd);
+            ostream os(&buf);
+            console = Console{&reader, &os};
+            try {
+                sys.runSession();
+            } catch (const InputClosed&) {
+                // terminal hung up, or sat idle: unwinding the menus logs it out
+                if (reader.timedOut())
+                    os << "\nSession closed after " << idleTimeout.count() << " seconds without input.\n";
+            }
+            os.flush();
+            console = Console{};
+        }
+        ::close(fd);
+    }
+
+    bool fail(const char *what) {
+        cerr << "Server: " << what << " failed: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    HospitalSystem &sys;
+    size_t workerCount;
+    chrono::seconds idleTimeout;
+    int listenFd = -1;
+    mutex queueMtx;
+    condition_variable queueReady;
+    deque<int> waiting; // accepted connections not yet picked up by a worker
+    bool stopping = false;
+};
+
+// ---------------------------------------------------------------------------
+// Batch mode: applies a file of commands straight through the HospitalSystem
+// API with no prompts, for bulk imports from upstream systems. One command
+// per line, fields separated by tabs; blank lines and '#' comments are
+// skipped. A patient ID field may be "last" for the most recently
+// registered patient in this batch.
+//
+//   patient       NAME  AGE  GENDER  SYMPTOMS  YYYY-MM-DD
+//   diagnosis     ID    TEXT
+//   note          ID    TEXT
+//   prescription  ID    TEXT
+//   charge        ID    DESCRIPTION  AMOUNT
+//   payment       ID    METHOD       AMOUNT
+//   dispense      ID    DRUG_CODE    QUANTITY  UNIT_COST
+//   status        ID    pending|partial|cleared
+//   discharge     ID
+//   user          USERNAME  PASSWORD  admin|doctor|nurse|pharmacist|accounts
+//   deluser       USERNAME
+//   facility      N        later patient, user and deluser lines go to
+//                          facility N (with --facilities)
+// ---------------------------------------------------------------------------
+
+class BatchRunner {
+public:
+    explicit BatchRunner(HospitalSystem &sys_) : sys(&sys_) {}
+
+    // Returns the number of lines that failed; each failure is reported on err
+    size_t run(istream &input, ostream &err) {
+        string line;
+        size_t lineNo = 0;
+        for (HospitalSystem *f : sys->allFacilities()) f->setDeferredSync(true); // one log sync for the whole batch
+        while (getline(input, line)) {
+            ++lineNo;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            split(line);
+            bool ok;
+            try {
+                ok = apply();
+            } catch (const StorageFailed&) {
+                ok = fail("the log cannot be written; not applied");
+            }
+            if (ok) ++applied;
+            else {
+                ++failed;
+                err << "line " << lineNo << ": " << problem << "\n";
+            }
+        }
+        for (HospitalSystem *f : sys->allFacilities()) f->setDeferredSync(false);
+        return failed;
+    }
+
+    size_t appliedCount() const { return applied; }
+
+private:
+    void split(const string &line) {
+        fields.clear();
+        size_t start = 0;
+        while (true) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(string_view(line).substr(start, tab == string::npos ? string::npos : tab - start));
+            if (tab == string::npos) break;
+            start = tab + 1;
+        }
+    }
+
+    bool fail(const string &why) {
+        problem = why;
+        return false;
+    }
+
+    // A charge or payment with a valid amount that the patient's bill refused
+    bool billRefused(string_view id, const Patient &p, bool payment) {
+        if (!payment && p.isDischarged()) return fail("patient " + string(id) + " is discharged");
+        return fail("bill of patient " + string(id) + " would pass $" + formatCents(MAX_BILL_CENTS) +
+                    (payment ? " in payments" : " in charges"));
+    }
+
+    bool expect(size_t n) {
+        if (fields.size() == n) return true;
+        return fail("'" + string(fields[0]) + "' expects " + to_string(n - 1) + " fields, got " +
+                    to_string(fields.size() - 1));
+    }
+
+    static bool parseInt(string_view s, int &v) { return parseNumber(s, v); }
+
+    // $0.01 up to MAX_AMOUNT_CENTS, as readAmount accepts
+    static bool parseAmount(string_view s, double &v) { return parseNumber(s, v) && toCents(v) > 0; }
+
+    Patient *patientArg(string_view s) {
+        int id = 0;
+        if (s == "last") id = lastRegistered;
+        else if (!parseInt(s, id)) { fail("bad patient ID '" + string(s) + "'"); return nullptr; }
+        Patient *p = sys->findPatientById(id);
+        if (!p) fail("no patient with ID " + string(s));
+        return p;
+    }
+
+    bool apply() {
+        string_view cmd = fields[0];
+        if (cmd == "patient") {
+            if (!expect(6)) return false;
+            int age;
+            if (!parseInt(fields[2], age) || age <= 0) return fail("bad age '" + string(fields[2]) + "'");
+            int id = sys->registerPatient(string(fields[1]), age, fields[3], string(fields[4]), string(fields[5]));
+            if (id == 0) return fail("no patient IDs left at facility " + to_string(sys->facility()));
+            lastRegistered = id;
+            return true;
+        }
+        if (cmd == "facility") {
+            if (!expect(2)) return false;
+            int f;
+            HospitalSystem *target = nullptr;
+            if (parseInt(fields[1], f))
+                for (HospitalSystem *each : sys->allFacilities())
+                    if (each->facility() == f) target = each;
+            if (!target) return fail("no facility '" + string(fields[1]) + "'");
+            sys = target;
+            return true;
+        }
+        if (cmd == "diagnosis" || cmd == "note" || cmd == "prescription") {
+            if (!expect(3)) return false;
+            Patient *p = patientArg(fields[1]);
+            if (!p) return false;
+            if (fields[2].empty()) return fail("empty text");
+            string text(fields[2]);
+            if (cmd == "diagnosis") sys->addDiagnosis(*p, text);
+            else if (cmd == "note") sys->addMedicalNote(*p, text);
+            else sys->addPrescription(*p, text);
+            return true;
+        }
+        if (cmd == "charge" || cmd == "payment") {
+            if (!expect(4)) return false;
+            Patient *p = patientArg(fields[1]);
+            if (!p) return false;
+            double amt;
+            if (!parseAmount(fields[3], amt)) return fail("bad amount '" + string(fields[3]) + "'");
+            bool payment = cmd == "payment";
+            if (payment ? sys->addPayment(*p, string(fields[2]), amt) : sys->addCharge(*p, string(fields[2]), amt))
+                return true;
+            return billRefused(fields[1], *p, payment);
+        }
+        if (cmd == "dispense") {
+            if (!expect(5)) return false;
+            Patient *p = patientArg(fields[1]);
+            if (!p) return false;
+            int quantity;
+            double unitCost;
+            if (!parseInt(fields[3], quantity) || quantity <= 0) return fail("bad quantity '" + string(fields[3]) + "'");
+            if (!parseAmount(fields[4], unitCost)) return fail("bad amount '" + string(fields[4]) + "'");
+            if (DispensingLedger::normalizeCode(fields[2]).empty()) return fail("bad drug code '" + string(fields[2]) + "'");
+            if (!sys->dispense(*p, fields[2], static_cast<uint32_t>(quantity), unitCost))
+                return billRefused(fields[1], *p, false);
+            return true;
+        }
+        if (cmd == "discharge") {
+            if (!expect(2)) return false;
+            Patient *p = patientArg(fields[1]);
+            if (!p) return false;
+            if (!sys->discharge(*p)) return fail("patient " + string(fields[1]) + " is already discharged");
+            return true;
+        }
+        if (cmd == "status") {
+            if (!expect(3)) return false;
+            Patient *p = patientArg(fields[1]);
+            if (!p) return false;
+            Bill::Status st;
+            if (fields[2] == "pending") st = Bill::Status::PENDING;
+            else if (fields[2] == "partial") st = Bill::Status::PARTIALLY_PAID;
+            else if (fields[2] == "cleared") st = Bill::Status::FULLY_CLEARED;
+            else return fail("bad status '" + string(fields[2]) + "'");
+            if (!sys->setBillStatus(*p, st)) return fail("patient " + string(fields[1]) + " is discharged");
+            return true;
+        }
+        if (cmd == "user") {
+            if (!expect(4)) return false;
+            static const pair<const char*, Role> roles[] = {
+                {"admin", Role::ADMIN}, {"doctor", Role::DOCTOR}, {"nurse", Role::NURSE},
+                {"pharmacist", Role::PHARMACIST}, {"accounts", Role::ACCOUNTS}};
+            string uname(fields[1]);
+            if (uname.empty() || fields[2].empty()) return fail("empty username or password");
+            if (sys->usernameExists(uname)) return fail("username already exists: " + uname);
+            for (auto &r : roles) {
+                if (fields[3] == r.first) {
+                    sys->addUser(uname, hashPassword(string(fields[2])), r.second);
+                    return true;
+                }
+            }
+            return fail("bad role '" + string(fields[3]) + "'");
+        }
+        if (cmd == "deluser") {
+            if (!expect(2)) return false;
+            if (!sys->deleteUser(string(fields[1]))) return fail("cannot delete user " + string(fields[1]));
+            return true;
+        }
+        return fail("unknown command '" + string(cmd) + "'");
+    }
+
+    HospitalSystem *sys; // where patients are registered and users managed
+    vector<string_view> fields; // reused across lines
+    string problem;
+    int lastRegistered = 0;
+    size_t applied = 0;
+    size_t failed = 0;
+};
+
 // Main
-int main() {
-    HospitalSystem hs;
-    cout << "Default admin account created: username='admin', password='admin123'\n";
-    hs.run();
+// Measures scrypt logins per second at each cost, first on one core and then
+// with every core busy, so --hash-cost is picked from measured numbers
+void runLoginBenchmark() {
+    using Clock = chrono::steady_clock;
+    const auto window = chrono::seconds(1);
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    auto hashFor = [](const PasswordCost &cost, Clock::time_point until) {
+        static const uint8_t salt[16] = {0};
+        uint8_t key[32];
+        size_t n = 0;
+        while (Clock::now() < until) {
+            scrypt("benchmark-password", salt, sizeof salt, cost, key);
+            ++n;
+        }
+        return n;
+    };
+    out() << "ln  memory     ms/login  logins/s/core  logins/s on " << cores << " cores\n";
+    for (int logN = 10; logN <= 18; logN += 2) {
+        PasswordCost cost;
+        cost.logN = logN;
+        auto start = Clock::now();
+        size_t solo = hashFor(cost, start + window);
+        double soloSecs = chrono::duration<double>(Clock::now() - start).count();
+
+        vector<size_t> counts(cores);
+        vector<thread> threads;
+        start = Clock::now();
+        for (unsigned c = 0; c < cores; ++c)
+            threads.emplace_back([&, c] { counts[c] = hashFor(cost, start + window); });
+        for (auto &t : threads) t.join();
+        double allSecs = chrono::duration<double>(Clock::now() - start).count();
+        size_t total = 0;
+        for (size_t n : counts) total += n;
+
+        out() << setw(2) << logN << "  " << setw(5) << (cost.memoryBytes() >> 20) << " MiB  "
+              << fixed << setprecision(2) << setw(8) << (solo ? soloSecs * 1000.0 / static_cast<double>(solo) : 0.0)
+              << "  " << setw(13) << (static_cast<double>(solo) / soloSecs)
+              << "  " << (static_cast<double>(total) / allSecs) << "\n";
+    }
+    out() << "Current setting: --hash-cost " << passwordCost().logN << "\n";
+}
+
+// Other programs (the benchmark) include this file with HMS_NO_MAIN defined
+#ifndef HMS_NO_MAIN
+int main(int argc, char **argv) {
+    string dataDir = "hospital_data";
+    bool persistent = true;
+    int port = 0;
+    string bindAddr = "127.0.0.1";
+    size_t workers = 64;
+    long idleTimeout = 300;
+    string batchFile;
+    bool benchLogin = false;
+    bool census = false;
+    string exportFile;
+    string metricsFile;
+    long historyBudgetMb = -1;
+    vector<int> facilities;
+    string primaryDir;
+    ReplicaOptions replica;
+    ios::sync_with_stdio(false); // all console I/O goes through iostreams or InputReader
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--data" && i + 1 < argc) dataDir = argv[++i];
+        else if (arg == "--in-memory") persistent = false;
+        else if (arg == "--serve" && i + 1 < argc) port = atoi(argv[++i]);
+        else if (arg == "--bind" && i + 1 < argc) bindAddr = argv[++i];
+        else if (arg == "--workers" && i + 1 < argc) workers = static_cast<size_t>(atoi(argv[++i]));
+        else if (arg == "--idle-timeout" && i + 1 < argc) idleTimeout = max(0L, atol(argv[++i]));
+        else if (arg == "--batch" && i + 1 < argc) batchFile = argv[++i];
+        else if (arg == "--hash-cost" && i + 1 < argc) passwordCost().logN = atoi(argv[++i]);
+        else if (arg == "--bench-login") benchLogin = true;
+        else if (arg == "--census") census = true;
+        else if (arg == "--export" && i + 1 < argc) exportFile = argv[++i];
+        else if (arg == "--metrics-out" && i + 1 < argc) metricsFile = argv[++i];
+        else if (arg == "--history-budget" && i + 1 < argc) historyBudgetMb = atol(argv[++i]);
+        else if (arg == "--replica-of" && i + 1 < argc) primaryDir = argv[++i];
+        else if (arg == "--replica-poll" && i + 1 < argc) replica.poll = chrono::milliseconds(max(1, atoi(argv[++i])));
+        else if (arg == "--max-lag" && i + 1 < argc) replica.maxLag = chrono::milliseconds(max(0, atoi(argv[++i])));
+        else if (arg == "--facilities" && i + 1 < argc) {
+            string list = argv[++i];
+            for (size_t at = 0; at <= list.size();) {
+                size_t comma = min(list.find(',', at), list.size());
+                int f = 0;
+                if (!parseNumber(string_view(list).substr(at, comma - at), f) || f < 1 || f > MAX_FACILITY) {
+                    cerr << "--facilities takes numbers between 1 and " << MAX_FACILITY << "\n";
+                    return 1;
+                }
+                facilities.push_back(f);
+                at = comma + 1;
+            }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--data DIR | --in-memory] [--hash-cost LOGN]"
+                 << " [--serve PORT [--bind ADDR] [--workers N] [--idle-timeout S] | --batch FILE | --census | --export FILE | --bench-login]"
+                 << " [--metrics-out FILE] [--history-budget MB] [--facilities N[,N...]]"
+                 << " [--replica-of DIR [--replica-poll MS] [--max-lag MS]]\n";
+            return 1;
+        }
+    }
+    if (passwordCost().logN < 10 || passwordCost().logN > 20) {
+        cerr << "--hash-cost must be between 10 and 20\n";
+        return 1;
+    }
+    if (benchLogin) {
+        runLoginBenchmark();
+        return 0;
+    }
+    if (!primaryDir.empty()) {
+        if (!batchFile.empty()) {
+            cerr << "--batch needs the primary; a replica is read-only\n";
+            return 1;
+        }
+        dataDir = primaryDir;
+        persistent = true;
+    }
+    const ReplicaOptions *replicaOf = primaryDir.empty() ? nullptr : &replica;
+    auto dumpMetrics = [&metricsFile] {
+        if (metricsFile.empty()) return;
+        ofstream file(metricsFile);
+        writeMetricsDump(file);
+        if (!file) cerr << "Cannot write metrics to " << metricsFile << "\n";
+    };
+    // With --facilities, each facility keeps its data in DIR/facility-N and
+    // sessions, batches and reports enter through the first one listed
+    unique_ptr<HospitalSystem> single;
+    FacilityRouter router;
+    HospitalSystem *hs;
+    if (facilities.empty()) {
+        if (replicaOf) single = make_unique<HospitalSystem>(dataDir, *replicaOf);
+        else if (persistent) single = make_unique<HospitalSystem>(dataDir);
+        else single = make_unique<HospitalSystem>();
+        hs = single.get();
+    } else {
+        if (persistent && !replicaOf && ::mkdir(dataDir.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Cannot create " << dataDir << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        hs = nullptr;
+        for (int f : facilities) {
+            HospitalSystem *added =
+                router.addFacility(f, persistent ? dataDir + "/facility-" + to_string(f) : "", replicaOf);
+            if (!added) {
+                cerr << "Facility " << f << " is listed twice\n";
+                return 1;
+            }
+            if (!hs) hs = added;
+        }
+    }
+    for (HospitalSystem *f : hs->allFacilities()) {
+        if (!f->opened()) return 1;
+        if (historyBudgetMb >= 0) f->setHistoryBudget(static_cast<size_t>(historyBudgetMb) << 20);
+        if (!f->createdDefaultAdmin()) continue;
+        out() << "Default admin account created";
+        if (f->facility()) out() << " at facility " << f->facility();
+        out() << ": username='admin', password='admin123'\n";
+    }
+    if (census) {
+        hs->printCensusReport(CensusFilter{});
+        return 0;
+    }
+    if (!exportFile.empty()) {
+        size_t patientRows = 0, itemRows = 0;
+        if (!hs->exportColumnar(exportFile, patientRows, itemRows)) {
+            cerr << "Export to " << exportFile << " failed: " << strerror(errno) << "\n";
+            return 1;
+        }
+        out() << "Exported " << patientRows << " patients and " << itemRows << " bill items to " << exportFile << "\n";
+        return 0;
+    }
+    if (!batchFile.empty()) {
+        ifstream file;
+        if (batchFile != "-") {
+            file.open(batchFile);
+            if (!file) {
+                cerr << "Cannot open batch file " << batchFile << "\n";
+                return 1;
+            }
+        }
+        BatchRunner batch(*hs);
+        size_t failed = batch.run(batchFile == "-" ? cin : file, cerr);
+        for (HospitalSystem *f : hs->allFacilities()) f->checkpoint();
+        dumpMetrics();
+        out() << "Batch applied " << batch.appliedCount() << " commands, " << failed << " failed\n";
+        return failed ? 2 : 0;
+    }
+    if (port > 0) {
+        SessionServer server(*hs, workers, chrono::seconds(idleTimeout));
+        if (!server.listenOn(bindAddr, port)) return 1;
+        out() << "Serving sessions on " << bindAddr << ":" << port << " with " << workers << " workers" << endl;
+        server.serve();
+        for (HospitalSystem *f : hs->allFacilities()) f->checkpoint();
+        dumpMetrics();
+        return 1;
+    }
+    hs->run();
+    dumpMetrics();
     return 0;
-}
\ No newline at end of file
+}
+#endif // HMS_NO_MAIN